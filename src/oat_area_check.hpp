@@ -0,0 +1,1327 @@
+#ifndef OAT_AREA_CHECK_HPP
+#define OAT_AREA_CHECK_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Validity check for areas
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <osmium/osm/area.hpp>
+
+#include "oat_area_rings.hpp"
+#include "oat_rtree.hpp"
+
+/**
+ * Computes the orientation determinants for a batch of point/segment
+ * combinations in double precision. The loop is written so that the
+ * compiler can vectorize it. Results for which the sign can not be
+ * trusted because of rounding errors are set to exactly 0.0, the caller
+ * has to recompute those with the exact orientation() function.
+ */
+inline void orientation_batch(const double* ax, const double* ay,
+                              const double* bx, const double* by,
+                              const double* cx, const double* cy,
+                              double* result, std::size_t count) noexcept {
+    // error bound for the determinant, see Shewchuk, "Adaptive Precision
+    // Floating-Point Arithmetic and Fast Robust Geometric Predicates"
+    const double error_bound = 3.3306690738754716e-16;
+    for (std::size_t i = 0; i < count; ++i) {
+        const double left  = (bx[i] - ax[i]) * (cy[i] - ay[i]);
+        const double right = (by[i] - ay[i]) * (cx[i] - ax[i]);
+        const double det = left - right;
+        const double bound = error_bound * (std::abs(left) + std::abs(right));
+        result[i] = (det > bound || -det > bound) ? det : 0.0;
+    }
+}
+
+/**
+ * Checks an area for validity in the sense of the OGC Simple Feature
+ * specification directly on the rings of the osmium::Area, without
+ * creating a geometry first. The result is the same as from the GEOS
+ * IsValidOp with setSelfTouchingRingFormingHoleValid(true), which is what
+ * the `--check` option of oat_create_areas used before.
+ *
+ * All intersections between segments are found with a sweep line over the
+ * segments sorted by their smallest x coordinate. The candidate pairs found
+ * are then checked in batches with the vectorized orientation test. This
+ * compares each segment with all segments overlapping it in x direction,
+ * which is quadratic for rings with many long segments (star-shaped
+ * coastline or border polygons). Areas with more segments than the tree
+ * threshold use a Shamos-Hoey sweep line instead, which keeps the segments
+ * crossing the sweep line ordered by y in a balanced tree. It only checks
+ * segments becoming neighbours in the tree and all segments meeting at an
+ * end point of a segment, which is O((n + k) log n) for n segments and k
+ * touching pairs, and finds at least one crossing or overlap if there is
+ * any.
+ *
+ * With more than one thread set, the segments of areas above the parallel
+ * threshold are split into vertical strips with about the same number of
+ * segments, each segment going into all strips it overlaps. The strips are
+ * checked with the tree sweep line in parallel by helper validators, every
+ * crossing or touching point lies in a strip containing both segments. If
+ * any strip has a problem, the area is checked again serially, so the
+ * problem reported is always the same as without threads.
+ *
+ * An AreaValidator keeps all its buffers between calls, so after some
+ * warm-up no memory is allocated any more, except for the tree nodes when
+ * checking large areas and some scratch space when building the R-tree
+ * over the rings of areas with many rings. It is not thread-safe, use one
+ * object per thread.
+ */
+class AreaValidator {
+
+public:
+
+    enum class problem {
+        none = 0,
+        invalid_location,
+        too_few_points,
+        self_intersection,
+        ring_overlap,
+        disconnected_interior,
+        hole_outside_shell,
+        nested_holes,
+        nested_shells
+    };
+
+private:
+
+    struct segment {
+        int32_t min_x;
+        int32_t max_x;
+        int32_t min_y;
+        int32_t max_y;
+        uint32_t ring;
+        uint32_t point;
+    };
+
+    struct touch {
+        uint32_t ring1;
+        uint32_t ring2;
+        int32_t x;
+        int32_t y;
+
+        bool operator<(const touch& other) const noexcept {
+            return ring1 < other.ring1 ||
+                   (ring1 == other.ring1 && (ring2 < other.ring2 ||
+                   (ring2 == other.ring2 && (x < other.x ||
+                   (x == other.x && y < other.y)))));
+        }
+
+        bool operator==(const touch& other) const noexcept {
+            return ring1 == other.ring1 && ring2 == other.ring2 && x == other.x && y == other.y;
+        }
+    };
+
+    enum event_kind : uint32_t {
+        event_end = 0,
+        event_start = 1,
+        event_vertical = 2
+    };
+
+    // end points of the segments for the tree sweep line, vertical
+    // segments have one event at their lower end
+    struct event {
+        int32_t x;
+        uint32_t kind;
+        int32_t y;
+        uint32_t seg;
+
+        bool operator<(const event& other) const noexcept {
+            return x < other.x ||
+                   (x == other.x && (kind < other.kind ||
+                   (kind == other.kind && (y < other.y ||
+                   (y == other.y && seg < other.seg)))));
+        }
+    };
+
+    // orders the segments in the tree from bottom to top
+    struct sweep_order {
+        const AreaValidator* validator;
+
+        bool operator()(uint32_t a, uint32_t b) const noexcept {
+            return validator->below(a, b);
+        }
+    };
+
+    using sweep_tree = std::set<uint32_t, sweep_order>;
+
+    enum : uint32_t {
+        // id in the tree standing for the point m_probe_x/m_probe_y
+        probe = std::numeric_limits<uint32_t>::max()
+    };
+
+    enum {
+        batch_size = 256,
+        max_segments_small = 16,
+        default_tree_threshold = 2000,
+        default_parallel_threshold = 50000,
+        // smallest number of rings for which the nesting check finds the
+        // candidate rings through an R-tree
+        min_rings_tree = 32,
+        // smallest number of points of a ring for which the nesting check
+        // builds a slab index for the point in ring tests
+        min_points_indexed = 64
+    };
+
+    AreaRings m_rings;
+
+    // deduplicated points of all rings
+    std::vector<int32_t> m_x;
+    std::vector<int32_t> m_y;
+
+    // first point of each ring in m_x/m_y, plus one entry at the end
+    std::vector<uint32_t> m_ring_start;
+
+    std::vector<segment> m_segments;
+    std::vector<uint32_t> m_active;
+
+    std::vector<event> m_events;
+    std::vector<sweep_tree::iterator> m_positions;
+    int32_t m_probe_x = 0;
+    int32_t m_probe_y = 0;
+
+    std::size_t m_tree_threshold = default_tree_threshold;
+
+    std::size_t m_parallel_threshold = default_parallel_threshold;
+    unsigned int m_num_threads = 1;
+
+    // x coordinates of the borders between the strips, with the lowest
+    // and highest possible value at the ends
+    std::vector<int32_t> m_strip_bounds;
+    std::vector<int32_t> m_strip_x;
+    std::vector<std::size_t> m_strip_load;
+
+    // validators checking the strips, one per thread
+    std::vector<std::unique_ptr<AreaValidator>> m_helpers;
+
+    std::vector<uint32_t> m_candidates;
+    std::vector<double> m_batch[6];
+    std::vector<double> m_orientation[4];
+
+    std::vector<touch> m_touches;
+    std::vector<uint32_t> m_passes1;
+    std::vector<uint32_t> m_passes2;
+    std::vector<uint32_t> m_order;
+    std::vector<uint64_t> m_edges;
+    std::vector<uint32_t> m_parent;
+
+    // bounding boxes of the rings and the tree over them
+    std::vector<rtree_box> m_ring_boxes;
+    PackedRTree m_ring_tree;
+    std::vector<uint32_t> m_nesting_candidates;
+
+    // slab indexes of the large rings, built when a ring is first used
+    // in the nesting check, the slot of each ring is 0 for none or the
+    // position in m_ring_indexes plus 1
+    std::vector<RingSlabIndex> m_ring_indexes;
+    std::vector<uint32_t> m_ring_index_slot;
+    std::size_t m_num_ring_indexes = 0;
+
+    std::size_t m_points_checked = 0;
+
+    problem m_problem = problem::none;
+
+    bool m_had_touches = false;
+
+    uint32_t ring_end(uint32_t ring) const noexcept {
+        return m_ring_start[ring + 1];
+    }
+
+    bool adjacent(const segment& s1, const segment& s2) const noexcept {
+        if (s1.ring != s2.ring) {
+            return false;
+        }
+        const uint32_t a = std::min(s1.point, s2.point);
+        const uint32_t b = std::max(s1.point, s2.point);
+        return b == a + 1 ||
+               (a == m_ring_start[s1.ring] && b + 2 == ring_end(s1.ring));
+    }
+
+    void copy_points() {
+        m_x.clear();
+        m_y.clear();
+        m_ring_start.clear();
+        for (const auto& r : m_rings.rings()) {
+            m_ring_start.push_back(static_cast<uint32_t>(m_x.size()));
+            for (uint32_t i = r.first; i < r.last; ++i) {
+                const int32_t x = m_rings.x()[i];
+                const int32_t y = m_rings.y()[i];
+                if (i == r.first || x != m_x.back() || y != m_y.back()) {
+                    m_x.push_back(x);
+                    m_y.push_back(y);
+                }
+            }
+        }
+        m_ring_start.push_back(static_cast<uint32_t>(m_x.size()));
+    }
+
+    bool check_ring_sizes() const noexcept {
+        for (std::size_t ring = 0; ring + 1 < m_ring_start.size(); ++ring) {
+            const uint32_t first = m_ring_start[ring];
+            const uint32_t last = m_ring_start[ring + 1];
+            // a valid ring needs at least 3 different points plus the
+            // closing point which must be the same as the first point
+            if (last - first < 4 || m_x[first] != m_x[last - 1] || m_y[first] != m_y[last - 1]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void build_segments() {
+        m_segments.clear();
+        for (std::size_t ring = 0; ring + 1 < m_ring_start.size(); ++ring) {
+            for (uint32_t i = m_ring_start[ring]; i + 1 < m_ring_start[ring + 1]; ++i) {
+                segment s;
+                s.min_x = std::min(m_x[i], m_x[i + 1]);
+                s.max_x = std::max(m_x[i], m_x[i + 1]);
+                s.min_y = std::min(m_y[i], m_y[i + 1]);
+                s.max_y = std::max(m_y[i], m_y[i + 1]);
+                s.ring = static_cast<uint32_t>(ring);
+                s.point = i;
+                m_segments.push_back(s);
+            }
+        }
+    }
+
+    void add_touch(uint32_t ring1, uint32_t ring2, int32_t x, int32_t y) {
+        touch t;
+        t.ring1 = std::min(ring1, ring2);
+        t.ring2 = std::max(ring1, ring2);
+        t.x = x;
+        t.y = y;
+        m_touches.push_back(t);
+    }
+
+    static bool in_box(const segment& s, int32_t x, int32_t y) noexcept {
+        return s.min_x <= x && x <= s.max_x && s.min_y <= y && y <= s.max_y;
+    }
+
+    static int sign(double value) noexcept {
+        return (value > 0.0) - (value < 0.0);
+    }
+
+    /**
+     * Classify a pair of segments given the orientations of the end points
+     * of each segment relative to the other segment. Returns false if an
+     * intersection making the area invalid was found.
+     */
+    bool check_pair(const segment& s1, const segment& s2, int o1, int o2, int o3, int o4) {
+        const uint32_t p = s1.point;
+        const uint32_t q = s2.point;
+
+        if (adjacent(s1, s2)) {
+            // adjacent segments share a point, they are only a problem if
+            // they are collinear and go back on themselves (a spike)
+            if (o1 != 0 || o2 != 0) {
+                return true;
+            }
+            uint32_t shared;
+            uint32_t a;
+            uint32_t b;
+            if (m_x[p + 1] == m_x[q] && m_y[p + 1] == m_y[q]) {
+                shared = q; a = p; b = q + 1;
+            } else {
+                shared = p; a = p + 1; b = q;
+            }
+            const int64_t dot = (int64_t(m_x[a]) - m_x[shared]) * (int64_t(m_x[b]) - m_x[shared]) +
+                                (int64_t(m_y[a]) - m_y[shared]) * (int64_t(m_y[b]) - m_y[shared]);
+            if (dot > 0) {
+                m_problem = problem::self_intersection;
+                return false;
+            }
+            return true;
+        }
+
+        if (o1 == 0 && o2 == 0) {
+            // collinear segments, check for overlap along the main axis
+            const bool use_x = s1.min_x != s1.max_x;
+            const int64_t lo = use_x ? std::max(s1.min_x, s2.min_x) : std::max(s1.min_y, s2.min_y);
+            const int64_t hi = use_x ? std::min(s1.max_x, s2.max_x) : std::min(s1.max_y, s2.max_y);
+            if (lo < hi) {
+                m_problem = s1.ring == s2.ring ? problem::self_intersection : problem::ring_overlap;
+                return false;
+            }
+            if (lo == hi) {
+                // touching at an end point
+                for (const uint32_t i : { p, p + 1 }) {
+                    if ((use_x ? m_x[i] : m_y[i]) == lo &&
+                        ((m_x[i] == m_x[q] && m_y[i] == m_y[q]) || (m_x[i] == m_x[q + 1] && m_y[i] == m_y[q + 1]))) {
+                        add_touch(s1.ring, s2.ring, m_x[i], m_y[i]);
+                        return true;
+                    }
+                }
+                m_problem = s1.ring == s2.ring ? problem::self_intersection : problem::ring_overlap;
+                return false;
+            }
+            return true;
+        }
+
+        if (o1 * o2 < 0 && o3 * o4 < 0) {
+            m_problem = s1.ring == s2.ring ? problem::self_intersection : problem::ring_overlap;
+            return false;
+        }
+
+        if (o1 == 0 && in_box(s1, m_x[q], m_y[q])) {
+            add_touch(s1.ring, s2.ring, m_x[q], m_y[q]);
+        } else if (o2 == 0 && in_box(s1, m_x[q + 1], m_y[q + 1])) {
+            add_touch(s1.ring, s2.ring, m_x[q + 1], m_y[q + 1]);
+        } else if (o3 == 0 && in_box(s2, m_x[p], m_y[p])) {
+            add_touch(s1.ring, s2.ring, m_x[p], m_y[p]);
+        } else if (o4 == 0 && in_box(s2, m_x[p + 1], m_y[p + 1])) {
+            add_touch(s1.ring, s2.ring, m_x[p + 1], m_y[p + 1]);
+        }
+
+        return true;
+    }
+
+    void set_batch_entry(std::size_t n, uint32_t a, uint32_t b, uint32_t c) {
+        m_batch[0][n] = m_x[a];
+        m_batch[1][n] = m_y[a];
+        m_batch[2][n] = m_x[b];
+        m_batch[3][n] = m_y[b];
+        m_batch[4][n] = m_x[c];
+        m_batch[5][n] = m_y[c];
+    }
+
+    int exact_or_filtered(double filtered, uint32_t a, uint32_t b, uint32_t c) const noexcept {
+        if (filtered != 0.0) {
+            return sign(filtered);
+        }
+        return orientation(m_x[a], m_y[a], m_x[b], m_y[b], m_x[c], m_y[c]);
+    }
+
+    /**
+     * Check all candidate pairs collected so far.
+     */
+    bool check_candidates() {
+        const std::size_t num = m_candidates.size() / 2;
+        if (num == 0) {
+            return true;
+        }
+
+        for (auto& v : m_batch) {
+            v.resize(num);
+        }
+        for (auto& v : m_orientation) {
+            v.resize(num);
+        }
+
+        // orientation of both end points of the second segment relative to
+        // the first segment and the other way around
+        for (int k = 0; k < 4; ++k) {
+            for (std::size_t n = 0; n < num; ++n) {
+                const uint32_t p = m_segments[m_candidates[2 * n]].point;
+                const uint32_t q = m_segments[m_candidates[2 * n + 1]].point;
+                if (k < 2) {
+                    set_batch_entry(n, p, p + 1, q + k);
+                } else {
+                    set_batch_entry(n, q, q + 1, p + k - 2);
+                }
+            }
+            orientation_batch(m_batch[0].data(), m_batch[1].data(),
+                              m_batch[2].data(), m_batch[3].data(),
+                              m_batch[4].data(), m_batch[5].data(),
+                              m_orientation[k].data(), num);
+        }
+
+        for (std::size_t n = 0; n < num; ++n) {
+            const segment& s1 = m_segments[m_candidates[2 * n]];
+            const segment& s2 = m_segments[m_candidates[2 * n + 1]];
+            const uint32_t p = s1.point;
+            const uint32_t q = s2.point;
+            const int o1 = exact_or_filtered(m_orientation[0][n], p, p + 1, q);
+            const int o2 = exact_or_filtered(m_orientation[1][n], p, p + 1, q + 1);
+            const int o3 = exact_or_filtered(m_orientation[2][n], q, q + 1, p);
+            const int o4 = exact_or_filtered(m_orientation[3][n], q, q + 1, p + 1);
+            if (!check_pair(s1, s2, o1, o2, o3, o4)) {
+                return false;
+            }
+        }
+
+        m_candidates.clear();
+        return true;
+    }
+
+    /**
+     * For small areas (most buildings etc.) comparing all segments with
+     * each other is cheaper than sorting them for the sweep line.
+     */
+    bool find_intersections_small() {
+        m_candidates.clear();
+        const auto num = static_cast<uint32_t>(m_segments.size());
+        for (uint32_t i = 0; i < num; ++i) {
+            const segment& s = m_segments[i];
+            for (uint32_t j = i + 1; j < num; ++j) {
+                const segment& other = m_segments[j];
+                if (other.max_x >= s.min_x && other.min_x <= s.max_x &&
+                    other.max_y >= s.min_y && other.min_y <= s.max_y) {
+                    m_candidates.push_back(i);
+                    m_candidates.push_back(j);
+                }
+            }
+        }
+        return check_candidates();
+    }
+
+    // index of the end point of the segment with the smaller x (or y for
+    // vertical segments) coordinate
+    uint32_t left_point(const segment& s) const noexcept {
+        const uint32_t p = s.point;
+        return (m_x[p] < m_x[p + 1] || (m_x[p] == m_x[p + 1] && m_y[p] < m_y[p + 1])) ? p : p + 1;
+    }
+
+    /**
+     * Position of the point relative to the (non-vertical) segment: 1 if
+     * it is above the line through the segment, -1 if it is below and 0 if
+     * it is on the line.
+     */
+    int side_of(const segment& s, int32_t x, int32_t y) const noexcept {
+        const uint32_t l = left_point(s);
+        const uint32_t r = l == s.point ? l + 1 : s.point;
+        return orientation(m_x[l], m_y[l], m_x[r], m_y[r], x, y);
+    }
+
+    /**
+     * Position of segment b relative to segment a right of the left end
+     * point of b.
+     */
+    int side_of(const segment& a, const segment& b) const noexcept {
+        const uint32_t l = left_point(b);
+        const int o = side_of(a, m_x[l], m_y[l]);
+        if (o != 0) {
+            return o;
+        }
+        const uint32_t r = l == b.point ? l + 1 : b.point;
+        return side_of(a, m_x[r], m_y[r]);
+    }
+
+    /**
+     * Is segment a below segment b? Both must cross the sweep line. The
+     * segment starting further left is compared with the left end point
+     * of the other one, which gives the same order as comparing them at
+     * the sweep line as long as they don't cross. Collinear segments are
+     * ordered by their index.
+     */
+    bool below(uint32_t a, uint32_t b) const noexcept {
+        if (a == b) {
+            return false;
+        }
+        if (a == probe) {
+            return side_of(m_segments[b], m_probe_x, m_probe_y) < 0;
+        }
+        if (b == probe) {
+            return side_of(m_segments[a], m_probe_x, m_probe_y) > 0;
+        }
+        const segment& sa = m_segments[a];
+        const segment& sb = m_segments[b];
+        if (sb.min_x >= sa.min_x) {
+            const int o = side_of(sa, sb);
+            if (o != 0) {
+                return o > 0;
+            }
+        } else {
+            const int o = side_of(sb, sa);
+            if (o != 0) {
+                return o < 0;
+            }
+        }
+        return a < b;
+    }
+
+    void add_candidate(uint32_t a, uint32_t b) {
+        m_candidates.push_back(a);
+        m_candidates.push_back(b);
+    }
+
+    /**
+     * Add all pairs of segments meeting at the end points of segments
+     * ending or starting at the sweep line. Segments from the tree going
+     * through the point are found with a probe point.
+     */
+    void touching_at_points(const sweep_tree& tree, int32_t x, std::size_t ends, std::size_t starts, std::size_t verticals) {
+        std::size_t i = ends;
+        std::size_t j = starts;
+        while (i < starts || j < verticals) {
+            const int32_t y = (i < starts && (j == verticals || m_events[i].y <= m_events[j].y)) ? m_events[i].y : m_events[j].y;
+            m_probe_x = x;
+            m_probe_y = y;
+
+            m_active.clear();
+            const auto range = tree.equal_range(probe);
+            for (auto it = range.first; it != range.second; ++it) {
+                m_active.push_back(*it);
+            }
+            // the segments ending here are in the tree already
+            while (i < starts && m_events[i].y == y) {
+                ++i;
+            }
+            while (j < verticals && m_events[j].y == y) {
+                m_active.push_back(m_events[j].seg);
+                ++j;
+            }
+
+            for (std::size_t a = 0; a < m_active.size(); ++a) {
+                for (std::size_t b = a + 1; b < m_active.size(); ++b) {
+                    add_candidate(m_active[a], m_active[b]);
+                }
+            }
+        }
+    }
+
+    /**
+     * Add all pairs of vertical segments at the sweep line with segments
+     * in the tree, starting segments and other vertical segments they
+     * touch.
+     */
+    void touching_verticals(const sweep_tree& tree, std::size_t starts, std::size_t verticals, std::size_t end) {
+        bool have_reach = false;
+        int32_t reach = 0;
+        uint32_t reaching = 0;
+
+        for (std::size_t v = verticals; v < end; ++v) {
+            const uint32_t n = m_events[v].seg;
+            const segment& s = m_segments[n];
+
+            m_probe_x = s.min_x;
+            m_probe_y = s.min_y;
+            auto it = tree.lower_bound(probe);
+            m_probe_y = s.max_y;
+            const auto last = tree.upper_bound(probe);
+            for (; it != last; ++it) {
+                add_candidate(*it, n);
+            }
+
+            const auto first_start = std::lower_bound(m_events.begin() + starts, m_events.begin() + verticals, s.min_y, [](const event& e, int32_t y) {
+                return e.y < y;
+            });
+            for (auto e = first_start; e != m_events.begin() + verticals && e->y <= s.max_y; ++e) {
+                add_candidate(e->seg, n);
+            }
+
+            // vertical segments are sorted by their lower end, each one
+            // is compared with the one reaching up furthest so far
+            if (have_reach && s.min_y <= reach) {
+                add_candidate(reaching, n);
+            }
+            if (!have_reach || s.max_y > reach) {
+                have_reach = true;
+                reach = s.max_y;
+                reaching = n;
+            }
+        }
+    }
+
+    bool find_intersections_tree() {
+        m_events.clear();
+        for (uint32_t n = 0; n < m_segments.size(); ++n) {
+            const segment& s = m_segments[n];
+            if (s.min_x == s.max_x) {
+                m_events.push_back(event{s.min_x, event_vertical, s.min_y, n});
+            } else {
+                const uint32_t l = left_point(s);
+                const uint32_t r = l == s.point ? l + 1 : s.point;
+                m_events.push_back(event{m_x[l], event_start, m_y[l], n});
+                m_events.push_back(event{m_x[r], event_end, m_y[r], n});
+            }
+        }
+        std::sort(m_events.begin(), m_events.end());
+
+        sweep_tree tree{sweep_order{this}};
+        m_positions.resize(m_segments.size());
+        m_candidates.clear();
+
+        std::size_t ends = 0;
+        while (ends < m_events.size()) {
+            // all events at the same x coordinate are handled together:
+            // first the touching segments are found with the tree as it
+            // was left of the sweep line, then the segments ending here
+            // are removed and the segments starting here are inserted
+            const int32_t x = m_events[ends].x;
+            std::size_t starts = ends;
+            while (starts < m_events.size() && m_events[starts].x == x && m_events[starts].kind == event_end) {
+                ++starts;
+            }
+            std::size_t verticals = starts;
+            while (verticals < m_events.size() && m_events[verticals].x == x && m_events[verticals].kind == event_start) {
+                ++verticals;
+            }
+            std::size_t end = verticals;
+            while (end < m_events.size() && m_events[end].x == x) {
+                ++end;
+            }
+
+            touching_at_points(tree, x, ends, starts, verticals);
+            touching_verticals(tree, starts, verticals, end);
+
+            for (std::size_t i = ends; i < starts; ++i) {
+                const auto it = m_positions[m_events[i].seg];
+                const auto next = std::next(it);
+                if (it != tree.begin() && next != tree.end()) {
+                    add_candidate(*std::prev(it), *next);
+                }
+                tree.erase(it);
+            }
+
+            for (std::size_t i = starts; i < verticals; ++i) {
+                const uint32_t n = m_events[i].seg;
+                const auto it = tree.insert(n).first;
+                m_positions[n] = it;
+                if (it != tree.begin()) {
+                    add_candidate(*std::prev(it), n);
+                }
+                const auto next = std::next(it);
+                if (next != tree.end()) {
+                    add_candidate(n, *next);
+                }
+            }
+
+            if (m_candidates.size() >= 2 * batch_size && !check_candidates()) {
+                return false;
+            }
+
+            ends = end;
+        }
+
+        return check_candidates();
+    }
+
+    // the strips are split at quantiles of the left ends of the segments
+    void calculate_strip_bounds(std::size_t num_strips) {
+        m_strip_x.clear();
+        for (const auto& s : m_segments) {
+            m_strip_x.push_back(s.min_x);
+        }
+
+        m_strip_bounds.clear();
+        m_strip_bounds.push_back(std::numeric_limits<int32_t>::min());
+        auto from = m_strip_x.begin();
+        for (std::size_t i = 1; i < num_strips; ++i) {
+            const auto nth = m_strip_x.begin() + i * m_strip_x.size() / num_strips;
+            std::nth_element(from, nth, m_strip_x.end());
+            m_strip_bounds.push_back(*nth);
+            from = nth;
+        }
+        m_strip_bounds.push_back(std::numeric_limits<int32_t>::max());
+    }
+
+    /**
+     * A segment is checked in each strip it reaches into. If that makes
+     * the largest strip closer to the size of the whole area than to its
+     * share of the area (for instance with long segments crossing all
+     * strips in star or comb shaped rings), the parallel check is not
+     * worth it.
+     */
+    bool strips_balanced() {
+        const std::size_t num_strips = m_strip_bounds.size() - 1;
+        m_strip_load.assign(num_strips + 1, 0);
+        for (const auto& s : m_segments) {
+            // strip i reaches from m_strip_bounds[i] to m_strip_bounds[i + 1]
+            const auto first = std::lower_bound(m_strip_bounds.begin() + 1, m_strip_bounds.end(), s.min_x) - (m_strip_bounds.begin() + 1);
+            const auto last = std::upper_bound(m_strip_bounds.begin(), m_strip_bounds.end() - 1, s.max_x) - m_strip_bounds.begin();
+            ++m_strip_load[static_cast<std::size_t>(first)];
+            --m_strip_load[static_cast<std::size_t>(last)];
+        }
+        const std::size_t max_load = (m_segments.size() + m_segments.size() / num_strips) / 2;
+        std::size_t load = 0;
+        for (std::size_t strip = 0; strip < num_strips; ++strip) {
+            load += m_strip_load[strip];
+            if (load > max_load) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Check the segments of the strip from the parent validator. Called
+     * on the helper validator in its own thread.
+     */
+    bool check_strip(const AreaValidator& parent, std::size_t strip) {
+        const int32_t left = parent.m_strip_bounds[strip];
+        const int32_t right = parent.m_strip_bounds[strip + 1];
+
+        m_x = parent.m_x;
+        m_y = parent.m_y;
+        m_ring_start = parent.m_ring_start;
+        m_segments.clear();
+        for (const auto& s : parent.m_segments) {
+            if (s.min_x <= right && s.max_x >= left) {
+                m_segments.push_back(s);
+            }
+        }
+
+        m_problem = problem::none;
+        m_touches.clear();
+        return find_intersections_tree();
+    }
+
+    bool find_intersections_parallel() {
+        const std::size_t num_strips = m_strip_bounds.size() - 1;
+        while (m_helpers.size() < num_strips) {
+            m_helpers.emplace_back(new AreaValidator{});
+        }
+
+        std::vector<char> results(num_strips, 0);
+        std::vector<std::exception_ptr> errors(num_strips);
+        const auto run = [this, &results, &errors](std::size_t strip) {
+            try {
+                results[strip] = m_helpers[strip]->check_strip(*this, strip);
+            } catch (...) {
+                errors[strip] = std::current_exception();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (std::size_t strip = 1; strip < num_strips; ++strip) {
+            threads.emplace_back(run, strip);
+        }
+        run(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        for (const auto& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+        if (std::find(results.begin(), results.end(), 0) != results.end()) {
+            return false;
+        }
+
+        for (std::size_t strip = 0; strip < num_strips; ++strip) {
+            const auto& touches = m_helpers[strip]->m_touches;
+            m_touches.insert(m_touches.end(), touches.begin(), touches.end());
+        }
+        return true;
+    }
+
+    bool find_intersections() {
+        if (m_num_threads > 1 && m_segments.size() > m_parallel_threshold) {
+            calculate_strip_bounds(m_num_threads);
+            if (strips_balanced() && find_intersections_parallel()) {
+                return true;
+            }
+            // find the same problem as the serial check
+        }
+
+        if (m_segments.size() > m_tree_threshold) {
+            return find_intersections_tree();
+        }
+
+        if (m_segments.size() <= max_segments_small) {
+            return find_intersections_small();
+        }
+
+        std::sort(m_segments.begin(), m_segments.end(), [](const segment& a, const segment& b) {
+            return a.min_x < b.min_x;
+        });
+
+        m_active.clear();
+        m_candidates.clear();
+        for (uint32_t n = 0; n < m_segments.size(); ++n) {
+            const segment& s = m_segments[n];
+
+            // remove segments from the active list which end before the
+            // current segment starts
+            for (std::size_t i = 0; i < m_active.size();) {
+                if (m_segments[m_active[i]].max_x < s.min_x) {
+                    m_active[i] = m_active.back();
+                    m_active.pop_back();
+                } else {
+                    ++i;
+                }
+            }
+
+            for (const uint32_t a : m_active) {
+                const segment& other = m_segments[a];
+                if (other.max_y >= s.min_y && other.min_y <= s.max_y) {
+                    m_candidates.push_back(a);
+                    m_candidates.push_back(n);
+                }
+            }
+
+            if (m_candidates.size() >= 2 * batch_size && !check_candidates()) {
+                return false;
+            }
+
+            m_active.push_back(n);
+        }
+
+        return check_candidates();
+    }
+
+    uint32_t find_root(uint32_t n) noexcept {
+        while (m_parent[n] != n) {
+            m_parent[n] = m_parent[m_parent[n]];
+            n = m_parent[n];
+        }
+        return n;
+    }
+
+    /**
+     * Find all places where the ring goes through the point. For each
+     * place the indexes of the previous and next point are added to out.
+     */
+    void collect_passes(uint32_t ring, int32_t x, int32_t y, std::vector<uint32_t>& out) const {
+        const uint32_t first = m_ring_start[ring];
+        const uint32_t last = ring_end(ring) - 1; // closing point
+        for (uint32_t i = first; i < last; ++i) {
+            if (m_x[i] == x && m_y[i] == y) {
+                out.push_back(i == first ? last - 1 : i - 1);
+                out.push_back(i + 1);
+            } else if (!(m_x[i + 1] == x && m_y[i + 1] == y) &&
+                       std::min(m_x[i], m_x[i + 1]) <= x && x <= std::max(m_x[i], m_x[i + 1]) &&
+                       std::min(m_y[i], m_y[i + 1]) <= y && y <= std::max(m_y[i], m_y[i + 1]) &&
+                       orientation(m_x[i], m_y[i], m_x[i + 1], m_y[i + 1], x, y) == 0) {
+                out.push_back(i);
+                out.push_back(i + 1);
+            }
+        }
+    }
+
+    /**
+     * Is point c strictly inside the sector going counterclockwise from
+     * the direction to point a to the direction to point b as seen from
+     * the point (x, y)?
+     */
+    bool in_sector(int32_t x, int32_t y, uint32_t a, uint32_t b, uint32_t c) const noexcept {
+        const int turn = orientation(x, y, m_x[a], m_y[a], m_x[b], m_y[b]);
+        const int oa = orientation(x, y, m_x[a], m_y[a], m_x[c], m_y[c]);
+        const int ob = orientation(x, y, m_x[c], m_y[c], m_x[b], m_y[b]);
+        if (turn > 0) {
+            return oa > 0 && ob > 0;
+        }
+        if (turn < 0) {
+            return oa > 0 || ob > 0;
+        }
+        return oa > 0;
+    }
+
+    /**
+     * Two passes of rings through the same point cross each other if the
+     * neighbour points of one pass are on different sides of the other.
+     */
+    bool passes_cross(int32_t x, int32_t y, const uint32_t* pass1, const uint32_t* pass2) const noexcept {
+        return in_sector(x, y, pass1[0], pass1[1], pass2[0]) !=
+               in_sector(x, y, pass1[0], pass1[1], pass2[1]);
+    }
+
+    /**
+     * Twice the signed area of the part of the ring starting at the point
+     * (x, y), going through the points with indexes from first to last and
+     * back to (x, y). Calculated relative to (x, y) to keep the numbers
+     * small.
+     */
+    double loop_area(int32_t x, int32_t y, uint32_t first, uint32_t last) const noexcept {
+        double area = 0.0;
+        double prev_x = 0.0;
+        double prev_y = 0.0;
+        for (uint32_t i = first; i <= last; ++i) {
+            const double cur_x = double(m_x[i]) - x;
+            const double cur_y = double(m_y[i]) - y;
+            area += prev_x * cur_y - cur_x * prev_y;
+            prev_x = cur_x;
+            prev_y = cur_y;
+        }
+        return area;
+    }
+
+    /**
+     * A ring touching itself is only valid if the touch forms a hole, ie
+     * if the loop between two passes through the point has the opposite
+     * orientation than the rest of the ring. Otherwise the ring consists
+     * of two lobes touching in a point and the interior is disconnected.
+     */
+    bool self_touch_forms_hole(uint32_t ring, int32_t x, int32_t y) const noexcept {
+        const double ring_area = loop_area(x, y, m_ring_start[ring], ring_end(ring) - 1);
+        for (std::size_t i = 0; i + 2 < m_passes1.size(); i += 2) {
+            // the loop goes from the next point after the first pass to
+            // the previous point before the second pass
+            const uint32_t first = m_passes1[i + 1];
+            const uint32_t last = m_passes1[i + 2];
+            if (first > last) {
+                continue;
+            }
+            const double area = loop_area(x, y, first, last);
+            const double rest = ring_area - area;
+            if ((area > 0.0) == (rest > 0.0)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool rings_cross_at(const touch& t) {
+        m_passes1.clear();
+        collect_passes(t.ring1, t.x, t.y, m_passes1);
+        if (t.ring1 == t.ring2) {
+            for (std::size_t i = 0; i < m_passes1.size(); i += 2) {
+                for (std::size_t j = i + 2; j < m_passes1.size(); j += 2) {
+                    if (passes_cross(t.x, t.y, &m_passes1[i], &m_passes1[j])) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+        m_passes2.clear();
+        collect_passes(t.ring2, t.x, t.y, m_passes2);
+        for (std::size_t i = 0; i < m_passes1.size(); i += 2) {
+            for (std::size_t j = 0; j < m_passes2.size(); j += 2) {
+                if (passes_cross(t.x, t.y, &m_passes1[i], &m_passes2[j])) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Rings touching each other or themselves must not cross at the
+     * touching point. And the interior of a polygon is disconnected if
+     * the graph with the rings and the touching points as nodes contains
+     * a cycle.
+     */
+    bool check_touches() {
+        if (m_touches.empty()) {
+            return true;
+        }
+        m_had_touches = true;
+
+        std::sort(m_touches.begin(), m_touches.end());
+        m_touches.erase(std::unique(m_touches.begin(), m_touches.end()), m_touches.end());
+
+        for (const auto& t : m_touches) {
+            if (rings_cross_at(t)) {
+                m_problem = t.ring1 == t.ring2 ? problem::self_intersection : problem::ring_overlap;
+                return false;
+            }
+            if (t.ring1 == t.ring2 && !self_touch_forms_hole(t.ring1, t.x, t.y)) {
+                m_problem = problem::disconnected_interior;
+                return false;
+            }
+        }
+
+        const auto& rings = m_rings.rings();
+        const uint32_t num_rings = static_cast<uint32_t>(rings.size());
+
+        // give the same node id to all touches at the same point in the
+        // same polygon
+        m_order.resize(m_touches.size());
+        std::iota(m_order.begin(), m_order.end(), 0);
+        std::sort(m_order.begin(), m_order.end(), [this, &rings](uint32_t a, uint32_t b) {
+            const touch& ta = m_touches[a];
+            const touch& tb = m_touches[b];
+            const uint32_t pa = rings[ta.ring1].outer;
+            const uint32_t pb = rings[tb.ring1].outer;
+            return pa < pb || (pa == pb && (ta.x < tb.x || (ta.x == tb.x && ta.y < tb.y)));
+        });
+
+        m_edges.clear();
+        uint32_t point_node = num_rings;
+        for (std::size_t i = 0; i < m_order.size(); ++i) {
+            const touch& t = m_touches[m_order[i]];
+            if (i > 0) {
+                const touch& prev = m_touches[m_order[i - 1]];
+                if (prev.x != t.x || prev.y != t.y || rings[prev.ring1].outer != rings[t.ring1].outer) {
+                    ++point_node;
+                }
+            }
+            if (rings[t.ring1].outer != rings[t.ring2].outer) {
+                // rings of different polygons may touch in any number of points
+                continue;
+            }
+            m_edges.push_back((uint64_t(t.ring1) << 32) | point_node);
+            m_edges.push_back((uint64_t(t.ring2) << 32) | point_node);
+        }
+
+        std::sort(m_edges.begin(), m_edges.end());
+        m_edges.erase(std::unique(m_edges.begin(), m_edges.end()), m_edges.end());
+
+        m_parent.resize(point_node + 1);
+        std::iota(m_parent.begin(), m_parent.end(), 0);
+
+        for (const uint64_t edge : m_edges) {
+            const uint32_t a = find_root(static_cast<uint32_t>(edge >> 32));
+            const uint32_t b = find_root(static_cast<uint32_t>(edge & 0xffffffff));
+            if (a == b) {
+                m_problem = problem::disconnected_interior;
+                return false;
+            }
+            m_parent[a] = b;
+        }
+
+        return true;
+    }
+
+    const RingSlabIndex* ring_index(std::size_t ring) {
+        const auto& r = m_rings.rings()[ring];
+        if (r.size() < min_points_indexed) {
+            return nullptr;
+        }
+        uint32_t& slot = m_ring_index_slot[ring];
+        if (slot == 0) {
+            if (m_num_ring_indexes == m_ring_indexes.size()) {
+                m_ring_indexes.emplace_back();
+            }
+            m_ring_indexes[m_num_ring_indexes].assign(m_rings.x() + r.first, m_rings.y() + r.first, r.size());
+            slot = static_cast<uint32_t>(++m_num_ring_indexes);
+        }
+        return &m_ring_indexes[slot - 1];
+    }
+
+    // find a point of the ring that is not on the boundary of the other
+    // ring, if all vertexes are on the boundary try the segment midpoints
+    point_position position_of_ring(const AreaRings::ring& r, std::size_t other) {
+        const auto& o = m_rings.rings()[other];
+        const RingSlabIndex* index = ring_index(other);
+        const auto position = [&](int64_t px, int64_t py, int64_t scale) {
+            return index ? index->position(px, py, scale) : m_rings.point_in(o, px, py, scale);
+        };
+
+        const int32_t* x = m_rings.x();
+        const int32_t* y = m_rings.y();
+        for (uint32_t i = r.first; i < r.last; ++i) {
+            const auto pos = position(x[i], y[i], 1);
+            if (pos != point_position::boundary) {
+                return pos;
+            }
+        }
+        for (uint32_t i = r.first; i + 1 < r.last; ++i) {
+            const auto pos = position(int64_t(x[i]) + x[i + 1], int64_t(y[i]) + y[i + 1], 2);
+            if (pos != point_position::boundary) {
+                return pos;
+            }
+        }
+        return point_position::boundary;
+    }
+
+    bool boxes_overlap(std::size_t ring1, std::size_t ring2) const noexcept {
+        return m_ring_boxes[ring1].intersects(m_ring_boxes[ring2]);
+    }
+
+    void calculate_ring_boxes() {
+        m_ring_boxes.clear();
+        for (std::size_t ring = 0; ring + 1 < m_ring_start.size(); ++ring) {
+            const auto first = m_ring_start[ring];
+            const auto last = m_ring_start[ring + 1];
+            const auto x = std::minmax_element(m_x.begin() + first, m_x.begin() + last);
+            const auto y = std::minmax_element(m_y.begin() + first, m_y.begin() + last);
+            m_ring_boxes.emplace_back(*x.first, *y.first, *x.second, *y.second);
+        }
+    }
+
+    // all rings with a bounding box overlapping the one of the ring
+    void find_nesting_candidates(std::size_t ring) {
+        m_nesting_candidates.clear();
+        if (m_ring_boxes.size() >= min_rings_tree) {
+            m_ring_tree.search(m_ring_boxes[ring], [this](uint32_t index) {
+                m_nesting_candidates.push_back(index);
+            });
+            return;
+        }
+        for (std::size_t j = 0; j < m_ring_boxes.size(); ++j) {
+            if (boxes_overlap(ring, j)) {
+                m_nesting_candidates.push_back(static_cast<uint32_t>(j));
+            }
+        }
+    }
+
+    /**
+     * With no crossing rings, check that every inner ring is inside its
+     * outer ring, no inner ring is inside another inner ring of the same
+     * polygon and no outer ring is inside another polygon. Only rings
+     * with overlapping bounding boxes are compared, for areas with many
+     * rings they are found through an R-tree. Large rings get a slab
+     * index, so that testing many small rings against them is not
+     * quadratic.
+     */
+    bool check_nesting() {
+        const auto& rings = m_rings.rings();
+        const std::size_t num_rings = rings.size();
+        if (num_rings < 2) {
+            return true;
+        }
+
+        calculate_ring_boxes();
+        if (num_rings >= min_rings_tree) {
+            m_ring_tree.build(m_ring_boxes);
+        }
+        m_ring_index_slot.assign(num_rings, 0);
+        m_num_ring_indexes = 0;
+
+        for (std::size_t i = 0; i < num_rings; ++i) {
+            const auto& r1 = rings[i];
+            if (!r1.is_outer) {
+                if (position_of_ring(r1, r1.outer) == point_position::outside) {
+                    m_problem = problem::hole_outside_shell;
+                    return false;
+                }
+            }
+            find_nesting_candidates(i);
+            for (const uint32_t j : m_nesting_candidates) {
+                const auto& r2 = rings[j];
+                // inner rings are compared to the other inner rings of the
+                // same polygon, outer rings to the other outer rings
+                if (i == j || r1.is_outer != r2.is_outer || (!r1.is_outer && r1.outer != r2.outer)) {
+                    continue;
+                }
+                if (position_of_ring(r1, j) != point_position::inside) {
+                    continue;
+                }
+                if (!r1.is_outer) {
+                    m_problem = problem::nested_holes;
+                    return false;
+                }
+                // an outer ring inside another outer ring is okay if it
+                // is inside one of the inner rings of that other polygon
+                bool in_hole = false;
+                for (const uint32_t k : m_nesting_candidates) {
+                    if (!rings[k].is_outer && rings[k].outer == j && position_of_ring(r1, k) == point_position::inside) {
+                        in_hole = true;
+                        break;
+                    }
+                }
+                if (!in_hole) {
+                    m_problem = problem::nested_shells;
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+public:
+
+    AreaValidator() {
+        m_candidates.reserve(2 * batch_size + 2);
+    }
+
+    /**
+     * Check the area. Returns true if it is valid.
+     */
+    bool operator()(const osmium::Area& area) {
+        m_problem = problem::none;
+        m_had_touches = false;
+        m_touches.clear();
+
+        if (!m_rings.assign(area)) {
+            m_problem = problem::invalid_location;
+            return false;
+        }
+
+        copy_points();
+        m_points_checked += m_x.size();
+
+        if (m_rings.empty() || !check_ring_sizes()) {
+            m_problem = problem::too_few_points;
+            return false;
+        }
+
+        build_segments();
+
+        return find_intersections() &&
+               check_touches() &&
+               check_nesting();
+    }
+
+    /**
+     * Is the area certainly valid? This is the case if the check found
+     * no problems and no rings touching each other, so there is nothing
+     * left where different implementations could come to a different
+     * conclusion. Use this as a screen to find out which areas have to be
+     * checked with another implementation.
+     */
+    bool certainly_valid(const osmium::Area& area) {
+        return (*this)(area) && !m_had_touches;
+    }
+
+    /**
+     * The problem found in the last area checked.
+     */
+    problem last_problem() const noexcept {
+        return m_problem;
+    }
+
+    /**
+     * Did any rings of the last area checked touch each other or
+     * themselves? Only set if there were no other problems found before
+     * the touching rings were checked.
+     */
+    bool had_touches() const noexcept {
+        return m_had_touches;
+    }
+
+    /**
+     * Did the last checks of this and the other validator find the same
+     * problem and, if they got that far, the same touching points?
+     */
+    bool same_result(const AreaValidator& other) const noexcept {
+        return m_problem == other.m_problem &&
+               m_had_touches == other.m_had_touches &&
+               (!m_had_touches || m_touches == other.m_touches);
+    }
+
+    std::size_t points_checked() const noexcept {
+        return m_points_checked;
+    }
+
+    /**
+     * Use the tree sweep line for areas with more than this number of
+     * segments.
+     */
+    void set_tree_threshold(std::size_t segments) noexcept {
+        m_tree_threshold = segments;
+    }
+
+    /**
+     * Use this many threads to find intersections in areas with more than
+     * the parallel threshold of segments.
+     */
+    void set_threads(unsigned int num_threads) noexcept {
+        m_num_threads = std::max(1u, num_threads);
+    }
+
+    void set_parallel_threshold(std::size_t segments) noexcept {
+        m_parallel_threshold = segments;
+    }
+
+    static const char* problem_name(problem p) noexcept {
+        static const char* names[] = {
+            "none",
+            "invalid location",
+            "too few points",
+            "self-intersection",
+            "ring overlap",
+            "disconnected interior",
+            "hole outside shell",
+            "nested holes",
+            "nested shells"
+        };
+        return names[static_cast<int>(p)];
+    }
+
+}; // class AreaValidator
+
+#endif // OAT_AREA_CHECK_HPP
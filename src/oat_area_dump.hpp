@@ -0,0 +1,349 @@
+#ifndef OAT_AREA_DUMP_HPP
+#define OAT_AREA_DUMP_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Write assembled areas to a dump file in a separate thread
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <osmium/handler/dump.hpp>
+#include <osmium/io/file.hpp>
+#include <osmium/io/header.hpp>
+#include <osmium/io/opl_output.hpp>
+#include <osmium/io/writer.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/visitor.hpp>
+
+#include "oat_work_queue.hpp"
+
+namespace dump {
+
+    /**
+     * The "buffers" format is the magic string followed by the contents of
+     * the osmium buffers, each with its size (uint64_t) in front.
+     */
+    const char magic[8] = {'O', 'A', 'T', 'A', 'R', 'E', 'A', 'S'};
+
+    inline void read_all(int fd, void* data, std::size_t size) {
+        char* ptr = static_cast<char*>(data);
+        while (size > 0) {
+            const auto got = ::read(fd, ptr, size);
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Read from area dump failed"};
+            }
+            if (got == 0) {
+                throw std::runtime_error{"Area dump is truncated"};
+            }
+            ptr += got;
+            size -= static_cast<std::size_t>(got);
+        }
+    }
+
+    inline void write_all(int fd, const void* data, std::size_t size) {
+        const char* ptr = static_cast<const char*>(data);
+        while (size > 0) {
+            const auto written = ::write(fd, ptr, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Write to area dump failed"};
+            }
+            ptr += written;
+            size -= static_cast<std::size_t>(written);
+        }
+    }
+
+} // namespace dump
+
+/**
+ * Dumps the buffers with the assembled areas. The assembling thread only
+ * queues the buffers, they are formatted and written in a separate thread.
+ *
+ * Formats are "text" (the output of the osmium Dump handler), "opl", and
+ * "buffers", the osmium buffers as they are, which is the fastest and can
+ * be read back with AreaDumpReader.
+ */
+class AreaDump {
+
+public:
+
+    enum class format {
+        text    = 0,
+        opl     = 1,
+        buffers = 2
+    };
+
+private:
+
+    format m_format;
+
+    std::ofstream m_file;
+    std::ostream* m_out = nullptr;
+    std::unique_ptr<osmium::io::Writer> m_writer{nullptr};
+    int m_fd = -1;
+
+    WorkQueue<osmium::memory::Buffer> m_buffers;
+
+    // error in the writer thread, rethrown by close()
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error{nullptr};
+
+    std::thread m_thread;
+
+    void write(osmium::memory::Buffer& buffer) {
+        switch (m_format) {
+            case format::text: {
+                    osmium::handler::Dump dump_handler{*m_out};
+                    osmium::apply(buffer, dump_handler);
+                }
+                break;
+            case format::opl:
+                (*m_writer)(std::move(buffer));
+                break;
+            case format::buffers: {
+                    const uint64_t size = buffer.committed();
+                    dump::write_all(m_fd, &size, sizeof(size));
+                    dump::write_all(m_fd, buffer.data(), buffer.committed());
+                }
+                break;
+        }
+    }
+
+    void finish() {
+        switch (m_format) {
+            case format::text:
+                m_out->flush();
+                if (!*m_out) {
+                    throw std::runtime_error{"Write to area dump failed"};
+                }
+                break;
+            case format::opl:
+                m_writer->close();
+                break;
+            case format::buffers:
+                if (m_fd > 1 && ::close(m_fd) != 0) {
+                    m_fd = -1;
+                    throw std::system_error{errno, std::system_category(), "Close of area dump failed"};
+                }
+                m_fd = -1;
+                break;
+        }
+    }
+
+    void worker() {
+        osmium::memory::Buffer buffer;
+        try {
+            while (m_buffers.pop(buffer)) {
+                write(buffer);
+            }
+            finish();
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock{m_error_mutex};
+                m_error = std::current_exception();
+            }
+            // keep taking buffers, so the assembling thread never blocks
+            while (m_buffers.pop(buffer)) {
+            }
+        }
+    }
+
+public:
+
+    /**
+     * Parse the name of a format. Returns false if there is no such format.
+     */
+    static bool parse_format(const std::string& name, format& f) noexcept {
+        if (name == "text") {
+            f = format::text;
+        } else if (name == "opl") {
+            f = format::opl;
+        } else if (name == "buffers") {
+            f = format::buffers;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Open the dump file (or stdout if filename is empty). An existing
+     * file is overwritten.
+     */
+    AreaDump(const std::string& filename, format f) :
+        m_format(f),
+        m_buffers(64) {
+        switch (f) {
+            case format::text:
+                if (filename.empty()) {
+                    m_out = &std::cout;
+                } else {
+                    m_file.open(filename);
+                    if (!m_file) {
+                        throw std::runtime_error{"Can not open area dump '" + filename + "'"};
+                    }
+                    m_out = &m_file;
+                }
+                break;
+            case format::opl: {
+                    osmium::io::Header header;
+                    header.set("generator", "oat_create_areas");
+                    m_writer.reset(new osmium::io::Writer{osmium::io::File{filename.empty() ? "-" : filename, "opl"}, header, osmium::io::overwrite::allow});
+                }
+                break;
+            case format::buffers:
+                m_fd = filename.empty() ? 1 : ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (m_fd < 0) {
+                    throw std::system_error{errno, std::system_category(), "Can not open area dump '" + filename + "'"};
+                }
+                try {
+                    dump::write_all(m_fd, dump::magic, sizeof(dump::magic));
+                } catch (...) {
+                    if (m_fd > 1) {
+                        ::close(m_fd);
+                    }
+                    throw;
+                }
+                break;
+        }
+        m_thread = std::thread{&AreaDump::worker, this};
+    }
+
+    AreaDump(const AreaDump&) = delete;
+    AreaDump& operator=(const AreaDump&) = delete;
+
+    ~AreaDump() {
+        m_buffers.close();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        if (m_fd > 1) {
+            ::close(m_fd);
+        }
+    }
+
+    /**
+     * Queue buffer with areas for writing. Blocks if the writer thread
+     * is too far behind.
+     */
+    void add(osmium::memory::Buffer&& buffer) {
+        if (buffer.committed() > 0) {
+            m_buffers.push(std::move(buffer));
+        }
+    }
+
+    /**
+     * Wait for all buffers to be written and close the file. Rethrows any
+     * error from the writer thread.
+     */
+    void close() {
+        m_buffers.close();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        std::lock_guard<std::mutex> lock{m_error_mutex};
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+}; // class AreaDump
+
+/**
+ * Read a dump in "buffers" format written by AreaDump. Can be used as a
+ * data source for osmium::apply().
+ */
+class AreaDumpReader {
+
+    int m_fd;
+
+public:
+
+    explicit AreaDumpReader(const std::string& filename) :
+        m_fd(::open(filename.c_str(), O_RDONLY)) {
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not open area dump '" + filename + "'"};
+        }
+        char magic[sizeof(dump::magic)];
+        try {
+            dump::read_all(m_fd, magic, sizeof(magic));
+        } catch (...) {
+            ::close(m_fd);
+            throw;
+        }
+        if (std::memcmp(magic, dump::magic, sizeof(magic))) {
+            ::close(m_fd);
+            throw std::runtime_error{"Not an area dump in buffers format: '" + filename + "'"};
+        }
+    }
+
+    AreaDumpReader(const AreaDumpReader&) = delete;
+    AreaDumpReader& operator=(const AreaDumpReader&) = delete;
+
+    ~AreaDumpReader() {
+        close();
+    }
+
+    /**
+     * Read the next buffer. Returns an invalid buffer at the end of the
+     * file.
+     */
+    osmium::memory::Buffer read() {
+        uint64_t size;
+        ssize_t got;
+        do {
+            got = ::read(m_fd, &size, 1);
+        } while (got < 0 && errno == EINTR);
+        if (got == 0) {
+            return osmium::memory::Buffer{};
+        }
+        if (got < 0) {
+            throw std::system_error{errno, std::system_category(), "Read from area dump failed"};
+        }
+        dump::read_all(m_fd, reinterpret_cast<char*>(&size) + 1, sizeof(size) - 1);
+        if (size % osmium::memory::align_bytes != 0) {
+            throw std::runtime_error{"Area dump is corrupt"};
+        }
+        osmium::memory::Buffer buffer{static_cast<std::size_t>(size), osmium::memory::Buffer::auto_grow::no};
+        dump::read_all(m_fd, buffer.reserve_space(static_cast<std::size_t>(size)), static_cast<std::size_t>(size));
+        buffer.commit();
+        return buffer;
+    }
+
+    void close() {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+}; // class AreaDumpReader
+
+#endif // OAT_AREA_DUMP_HPP
@@ -0,0 +1,300 @@
+#ifndef OAT_AREA_FILTER_HPP
+#define OAT_AREA_FILTER_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Select the objects areas are assembled from
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <osmium/io/reader.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/tag.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+#include <osmium/tags/filter.hpp>
+#include <osmium/tags/taglist.hpp>
+
+/**
+ * Tag filter for the areas to be assembled. The expression is a
+ * comma-separated list of KEY, KEY=*, or KEY=VALUE terms, an object
+ * matches if any of its tags matches any of the terms. An empty filter
+ * matches everything.
+ */
+class AreaFilter {
+
+    osmium::tags::KeyValueFilter m_filter{false};
+    bool m_empty = true;
+
+public:
+
+    AreaFilter() = default;
+
+    /**
+     * Add the terms from the expression. Returns false if the expression
+     * is invalid.
+     */
+    bool add(const std::string& expression) {
+        std::size_t begin = 0;
+        while (begin <= expression.size()) {
+            std::size_t end = expression.find(',', begin);
+            if (end == std::string::npos) {
+                end = expression.size();
+            }
+            const std::string term = expression.substr(begin, end - begin);
+            const std::size_t eq = term.find('=');
+            const std::string key = term.substr(0, eq);
+            if (key.empty()) {
+                return false;
+            }
+            if (eq == std::string::npos || term.substr(eq + 1) == "*") {
+                m_filter.add(true, key);
+            } else {
+                m_filter.add(true, key, term.substr(eq + 1));
+            }
+            m_empty = false;
+            begin = end + 1;
+        }
+        return true;
+    }
+
+    bool empty() const noexcept {
+        return m_empty;
+    }
+
+    bool operator()(const osmium::TagList& tags) const {
+        return m_empty || osmium::tags::match_any_of(tags, m_filter);
+    }
+
+}; // class AreaFilter
+
+/**
+ * Sorted set of ids, for instance of all ways that are members of the
+ * relations selected in the first pass.
+ */
+class IdSet {
+
+    std::vector<osmium::unsigned_object_id_type> m_ids;
+    bool m_sorted = true;
+
+public:
+
+    void add(osmium::unsigned_object_id_type id) {
+        if (!m_ids.empty() && id < m_ids.back()) {
+            m_sorted = false;
+        }
+        m_ids.push_back(id);
+    }
+
+    /**
+     * Sort the set and remove duplicates. Call after all ids are added
+     * and before using contains().
+     */
+    void sort() {
+        if (!m_sorted) {
+            std::sort(m_ids.begin(), m_ids.end());
+            m_sorted = true;
+        }
+        m_ids.erase(std::unique(m_ids.begin(), m_ids.end()), m_ids.end());
+        m_ids.shrink_to_fit();
+    }
+
+    bool contains(osmium::unsigned_object_id_type id) const noexcept {
+        return std::binary_search(m_ids.begin(), m_ids.end(), id);
+    }
+
+    std::size_t size() const noexcept {
+        return m_ids.size();
+    }
+
+    std::size_t used_memory() const noexcept {
+        return m_ids.capacity() * sizeof(osmium::unsigned_object_id_type);
+    }
+
+}; // class IdSet
+
+/**
+ * Data source for osmium::apply() and the read_relations() function of
+ * the multipolygon collector. Reads buffers from a Reader and removes all
+ * objects for which the predicate returns false before handing the
+ * buffers on, so no handler ever sees them.
+ */
+template <typename TPredicate>
+class FilteringReader {
+
+    struct no_callback {
+        void moving_in_buffer(std::size_t, std::size_t) noexcept {
+        }
+    };
+
+    osmium::io::Reader& m_reader;
+    TPredicate m_predicate;
+    uint64_t m_removed = 0;
+
+public:
+
+    FilteringReader(osmium::io::Reader& reader, const TPredicate& predicate) :
+        m_reader(reader),
+        m_predicate(predicate) {
+    }
+
+    osmium::memory::Buffer read() {
+        osmium::memory::Buffer buffer = m_reader.read();
+        if (buffer) {
+            const uint64_t removed_before = m_removed;
+            for (auto& object : buffer.select<osmium::OSMObject>()) {
+                if (!m_predicate(object)) {
+                    object.set_removed(true);
+                    ++m_removed;
+                }
+            }
+            if (m_removed != removed_before) {
+                no_callback callback;
+                buffer.purge_removed(&callback);
+            }
+        }
+        return buffer;
+    }
+
+    void close() {
+        m_reader.close();
+    }
+
+    /**
+     * The number of objects removed so far.
+     */
+    uint64_t removed() const noexcept {
+        return m_removed;
+    }
+
+}; // class FilteringReader
+
+/**
+ * Remove the areas not matching the filter from the buffer. Needed for
+ * old-style multipolygons, which get their tags from the outer ways only
+ * when they are assembled.
+ */
+inline void filter_areas(osmium::memory::Buffer& buffer, const AreaFilter& filter) {
+    struct no_callback {
+        void moving_in_buffer(std::size_t, std::size_t) noexcept {
+        }
+    };
+
+    if (filter.empty()) {
+        return;
+    }
+    bool removed = false;
+    for (auto& area : buffer.select<osmium::Area>()) {
+        if (!filter(area.tags())) {
+            area.set_removed(true);
+            removed = true;
+        }
+    }
+    if (removed) {
+        no_callback callback;
+        buffer.purge_removed(&callback);
+    }
+}
+
+/**
+ * Predicate for the first pass: Keeps multipolygon and boundary relations
+ * matching the filter (or all if the filter is empty) and remembers the
+ * ids of their member ways. Other relations are not assembled by the
+ * multipolygon collector, so their member ways are not needed. Old-style
+ * multipolygons are always kept, the areas built from them have to be
+ * checked with filter_areas().
+ */
+class SelectedRelations {
+
+    const AreaFilter* m_filter;
+    IdSet* m_member_ways;
+
+    // Like the assembler, only count tags that are not about the relation
+    // itself. Relations without any of them are old-style multipolygons.
+    static bool old_style(const osmium::TagList& tags) noexcept {
+        static const char* ignored[] = {
+            "type", "created_by", "source", "note", "fixme", "FIXME", "test:id", "test:section"
+        };
+        for (const auto& tag : tags) {
+            const auto it = std::find_if(std::begin(ignored), std::end(ignored), [&tag](const char* key) {
+                return !std::strcmp(tag.key(), key);
+            });
+            if (it == std::end(ignored)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+
+    SelectedRelations(const AreaFilter& filter, IdSet& member_ways) noexcept :
+        m_filter(&filter),
+        m_member_ways(&member_ways) {
+    }
+
+    bool operator()(const osmium::OSMObject& object) const {
+        if (object.type() != osmium::item_type::relation) {
+            return false;
+        }
+        const char* type = object.tags().get_value_by_key("type");
+        if (!type || (std::strcmp(type, "multipolygon") && std::strcmp(type, "boundary"))) {
+            return false;
+        }
+        if (!old_style(object.tags()) && !(*m_filter)(object.tags())) {
+            return false;
+        }
+        for (const auto& member : static_cast<const osmium::Relation&>(object).members()) {
+            if (member.type() == osmium::item_type::way) {
+                m_member_ways->add(member.positive_ref());
+            }
+        }
+        return true;
+    }
+
+}; // class SelectedRelations
+
+/**
+ * Predicate for the second pass: Keeps all nodes and those ways that are
+ * members of relations selected in the first pass or that are closed and
+ * match the filter. All other ways, for instance most highways, can't
+ * become part of a selected area. Put in front of the location handler,
+ * so that their node locations are never looked up.
+ */
+class SelectedWays {
+
+    const AreaFilter* m_filter;
+    const IdSet* m_member_ways;
+
+public:
+
+    SelectedWays(const AreaFilter& filter, const IdSet& member_ways) noexcept :
+        m_filter(&filter),
+        m_member_ways(&member_ways) {
+    }
+
+    bool operator()(const osmium::OSMObject& object) const {
+        if (object.type() != osmium::item_type::way) {
+            return true;
+        }
+        const auto& way = static_cast<const osmium::Way&>(object);
+        return m_member_ways->contains(way.positive_id()) ||
+               (!way.nodes().empty() && way.is_closed() && (*m_filter)(way.tags()));
+    }
+
+}; // class SelectedWays
+
+#endif // OAT_AREA_FILTER_HPP
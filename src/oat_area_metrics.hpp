@@ -0,0 +1,152 @@
+#ifndef OAT_AREA_METRICS_HPP
+#define OAT_AREA_METRICS_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Area, perimeter, and vertex count of areas
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <osmium/osm/area.hpp>
+
+#include "oat_area_rings.hpp"
+
+/**
+ * Calculates the area (in square meters), the perimeter (in meters), and
+ * the number of vertices of an osmium::Area directly from the coordinates
+ * of its rings.
+ *
+ * The area is calculated on the sphere with the formula from "Some
+ * Algorithms for Polygons on a Sphere" (Chamberlain and Duquette, 2007),
+ * the perimeter (length of all outer and inner rings) with the haversine
+ * formula. The coordinates of each ring are converted once into flat
+ * arrays of radians and sines/cosines of the latitude, which are shared
+ * by both calculations.
+ */
+class AreaMetrics {
+
+    // mean earth radius used for the haversine formula in libosmium
+    static constexpr const double earth_radius = 6372.7982 * 1000;
+
+    // from OSM coordinate units (1e-7 degrees) to radians
+    static constexpr const double to_radians = 3.14159265358979323846 / 180.0 / 10000000.0;
+
+    AreaRings m_rings;
+
+    // scratch arrays for one ring
+    std::vector<double> m_lon;
+    std::vector<double> m_lat;
+    std::vector<double> m_sin_lat;
+    std::vector<double> m_cos_lat;
+
+    double m_area = 0.0;
+    double m_perimeter = 0.0;
+    uint64_t m_vertices = 0;
+
+    void prepare_ring(const AreaRings::ring& r) {
+        const std::size_t count = r.size();
+        m_lon.resize(count);
+        m_lat.resize(count);
+        m_sin_lat.resize(count);
+        m_cos_lat.resize(count);
+
+        const int32_t* x = m_rings.x() + r.first;
+        const int32_t* y = m_rings.y() + r.first;
+        double* lon = m_lon.data();
+        double* lat = m_lat.data();
+        for (std::size_t i = 0; i < count; ++i) {
+            lon[i] = x[i] * to_radians;
+            lat[i] = y[i] * to_radians;
+        }
+
+        double* sin_lat = m_sin_lat.data();
+        double* cos_lat = m_cos_lat.data();
+        for (std::size_t i = 0; i < count; ++i) {
+            sin_lat[i] = std::sin(lat[i]);
+            cos_lat[i] = std::cos(lat[i]);
+        }
+    }
+
+    // Absolute area of the ring prepared last. The ring is closed, so the
+    // segments are from point i to point i+1.
+    double ring_area(std::size_t count) const noexcept {
+        const double* lon = m_lon.data();
+        const double* sin_lat = m_sin_lat.data();
+        double sum = 0.0;
+        for (std::size_t i = 0; i + 1 < count; ++i) {
+            sum += (lon[i + 1] - lon[i]) * (2.0 + sin_lat[i] + sin_lat[i + 1]);
+        }
+        return std::abs(sum * earth_radius * earth_radius / 2.0);
+    }
+
+    // Length of the ring prepared last.
+    double ring_length(std::size_t count) const noexcept {
+        const double* lon = m_lon.data();
+        const double* lat = m_lat.data();
+        const double* cos_lat = m_cos_lat.data();
+        double sum = 0.0;
+        for (std::size_t i = 0; i + 1 < count; ++i) {
+            const double sin_dlat = std::sin((lat[i + 1] - lat[i]) / 2.0);
+            const double sin_dlon = std::sin((lon[i + 1] - lon[i]) / 2.0);
+            const double h = sin_dlat * sin_dlat + cos_lat[i] * cos_lat[i + 1] * sin_dlon * sin_dlon;
+            sum += std::asin(std::sqrt(h));
+        }
+        return 2.0 * earth_radius * sum;
+    }
+
+public:
+
+    /**
+     * Calculate the metrics for the area. Returns false if the area has
+     * invalid locations, in that case all metrics are 0.
+     */
+    bool operator()(const osmium::Area& area) {
+        m_area = 0.0;
+        m_perimeter = 0.0;
+        m_vertices = 0;
+
+        if (!m_rings.assign(area)) {
+            return false;
+        }
+
+        for (const auto& r : m_rings.rings()) {
+            const std::size_t count = r.size();
+            if (count < 2) {
+                continue;
+            }
+            prepare_ring(r);
+            const double a = ring_area(count);
+            m_area += r.is_outer ? a : -a;
+            m_perimeter += ring_length(count);
+            m_vertices += count - 1;
+        }
+
+        if (m_area < 0.0) {
+            m_area = 0.0;
+        }
+
+        return true;
+    }
+
+    double area() const noexcept {
+        return m_area;
+    }
+
+    double perimeter() const noexcept {
+        return m_perimeter;
+    }
+
+    uint64_t vertices() const noexcept {
+        return m_vertices;
+    }
+
+}; // class AreaMetrics
+
+#endif // OAT_AREA_METRICS_HPP
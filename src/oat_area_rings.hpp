@@ -0,0 +1,328 @@
+#ifndef OAT_AREA_RINGS_HPP
+#define OAT_AREA_RINGS_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Flat copy of the rings of an area
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/types.hpp>
+
+namespace detail {
+
+#ifdef __SIZEOF_INT128__
+    using wide_int_type = __int128;
+#else
+    using wide_int_type = long double;
+#endif
+
+    inline int orientation(int64_t ax, int64_t ay, int64_t bx, int64_t by, int64_t cx, int64_t cy) noexcept {
+        const wide_int_type det = static_cast<wide_int_type>(bx - ax) * (cy - ay) -
+                                  static_cast<wide_int_type>(by - ay) * (cx - ax);
+        return (det > 0) - (det < 0);
+    }
+
+} // namespace detail
+
+/**
+ * Exact orientation of point c relative to the line from a to b. Returns
+ * 1 if c is to the left, -1 if it is to the right and 0 if the points are
+ * collinear. All arithmetic is done in integers, so this is exact for all
+ * OSM coordinates.
+ */
+inline int orientation(int32_t ax, int32_t ay, int32_t bx, int32_t by, int32_t cx, int32_t cy) noexcept {
+    return detail::orientation(ax, ay, bx, by, cx, cy);
+}
+
+enum class point_position {
+    outside  = 0,
+    inside   = 1,
+    boundary = 2
+};
+
+namespace detail {
+
+    // Contribution of the segment from a to b to the winding number of
+    // the ring around p. Returns false if p is on the segment.
+    inline bool winding_step(int64_t ax, int64_t ay, int64_t bx, int64_t by, int64_t px, int64_t py, int& winding) noexcept {
+        if (ay <= py) {
+            if (by > py) {
+                const int o = orientation(ax, ay, bx, by, px, py);
+                if (o > 0) {
+                    ++winding;
+                } else if (o == 0) {
+                    return false;
+                }
+            } else if (by == py && ay == py) {
+                // horizontal segment on the same height
+                if ((ax <= px && px <= bx) || (bx <= px && px <= ax)) {
+                    return false;
+                }
+            } else if (by == py && bx == px) {
+                return false;
+            }
+        } else if (by <= py) {
+            const int o = orientation(ax, ay, bx, by, px, py);
+            if (o < 0) {
+                --winding;
+            } else if (o == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+} // namespace detail
+
+/**
+ * Position of a point relative to a closed ring given as coordinate arrays
+ * (last point equal to the first). The coordinates of the point are given
+ * in units of 1/scale of the ring coordinates, so that points in between
+ * the ring coordinates, for instance midpoints of segments, can be tested
+ * exactly.
+ */
+inline point_position point_in_ring(const int32_t* xs, const int32_t* ys, std::size_t count, int64_t px, int64_t py, int64_t scale = 1) noexcept {
+    int winding = 0;
+    for (std::size_t i = 0; i + 1 < count; ++i) {
+        if (!detail::winding_step(xs[i] * scale, ys[i] * scale, xs[i + 1] * scale, ys[i + 1] * scale, px, py, winding)) {
+            return point_position::boundary;
+        }
+    }
+    return winding != 0 ? point_position::inside : point_position::outside;
+}
+
+/**
+ * Index for point_in_ring() on rings with many points. The bounding box
+ * of the ring is cut into horizontal slabs and each slab gets a list of
+ * the segments reaching into it. Only segments reaching the height of the
+ * point can change the winding number or have the point on them, and they
+ * are all in the slab of the point, so the results are the same as from
+ * point_in_ring(). The coordinate arrays are not copied, they must stay
+ * valid while the index is used. The lists are kept when another ring is
+ * assigned.
+ */
+class RingSlabIndex {
+
+    const int32_t* m_x = nullptr;
+    const int32_t* m_y = nullptr;
+
+    int32_t m_min_y = 0;
+    int32_t m_max_y = 0;
+    int64_t m_slab_height = 1;
+
+    // start of the segments of each slab in m_segments, plus end of the
+    // last slab
+    std::vector<uint32_t> m_offsets;
+
+    // index of the first point of each segment
+    std::vector<uint32_t> m_segments;
+
+    uint32_t slab(int64_t y) const noexcept {
+        return static_cast<uint32_t>((y - m_min_y) / m_slab_height);
+    }
+
+    template <typename TFunc>
+    void for_each_segment(std::size_t count, TFunc&& func) const {
+        for (uint32_t i = 0; i + 1 < count; ++i) {
+            func(i, slab(std::min(m_y[i], m_y[i + 1])), slab(std::max(m_y[i], m_y[i + 1])));
+        }
+    }
+
+public:
+
+    void assign(const int32_t* xs, const int32_t* ys, std::size_t count, std::size_t segments_per_slab = 8) {
+        m_x = xs;
+        m_y = ys;
+        m_min_y = *std::min_element(ys, ys + count);
+        m_max_y = *std::max_element(ys, ys + count);
+
+        const std::size_t num_segments = count > 0 ? count - 1 : 0;
+        const std::size_t num_slabs = std::max<std::size_t>(1, num_segments / segments_per_slab);
+        m_slab_height = (static_cast<int64_t>(m_max_y) - m_min_y) / static_cast<int64_t>(num_slabs) + 1;
+
+        m_offsets.assign(num_slabs + 2, 0);
+        for_each_segment(count, [this](uint32_t, uint32_t first, uint32_t last) {
+            for (uint32_t s = first; s <= last; ++s) {
+                ++m_offsets[s + 2];
+            }
+        });
+        for (std::size_t s = 2; s < m_offsets.size(); ++s) {
+            m_offsets[s] += m_offsets[s - 1];
+        }
+
+        m_segments.resize(m_offsets.back());
+        for_each_segment(count, [this](uint32_t i, uint32_t first, uint32_t last) {
+            for (uint32_t s = first; s <= last; ++s) {
+                m_segments[m_offsets[s + 1]++] = i;
+            }
+        });
+        m_offsets.pop_back();
+    }
+
+    /**
+     * Position of the point relative to the ring, same as point_in_ring()
+     * with the same arguments.
+     */
+    point_position position(int64_t px, int64_t py, int64_t scale = 1) const noexcept {
+        // row of the ring coordinates at or below the point
+        const int64_t row = py >= 0 ? py / scale : -((-py + scale - 1) / scale);
+        if (row < m_min_y || row > m_max_y) {
+            return point_position::outside;
+        }
+        const uint32_t s = slab(row);
+        int winding = 0;
+        for (uint32_t n = m_offsets[s]; n < m_offsets[s + 1]; ++n) {
+            const uint32_t i = m_segments[n];
+            if (!detail::winding_step(m_x[i] * scale, m_y[i] * scale, m_x[i + 1] * scale, m_y[i + 1] * scale, px, py, winding)) {
+                return point_position::boundary;
+            }
+        }
+        return winding != 0 ? point_position::inside : point_position::outside;
+    }
+
+}; // class RingSlabIndex
+
+/**
+ * A copy of all rings of an osmium::Area in flat arrays of coordinates and
+ * node ids, as needed by the algorithms working on areas. The arrays are
+ * kept when a new area is assigned, so once they are large enough no more
+ * memory is allocated.
+ */
+class AreaRings {
+
+public:
+
+    struct ring {
+        // index of the first point of the ring in the coordinate arrays
+        uint32_t first;
+
+        // index one past the last point of the ring (the last point is
+        // the same as the first)
+        uint32_t last;
+
+        // index of the outer ring this ring belongs to (for outer rings
+        // this is the index of the ring itself)
+        uint32_t outer;
+
+        bool is_outer;
+
+        uint32_t size() const noexcept {
+            return last - first;
+        }
+
+    }; // struct ring
+
+private:
+
+    std::vector<int32_t> m_x;
+    std::vector<int32_t> m_y;
+    std::vector<osmium::object_id_type> m_ids;
+    std::vector<ring> m_rings;
+
+    bool m_locations_valid = true;
+
+    template <typename TRing>
+    void add_ring(const TRing& nodes, bool is_outer) {
+        ring r;
+        r.first = static_cast<uint32_t>(m_x.size());
+        r.is_outer = is_outer;
+        if (is_outer) {
+            r.outer = static_cast<uint32_t>(m_rings.size());
+        } else {
+            r.outer = m_rings.empty() ? 0 : m_rings.back().outer;
+        }
+        for (const auto& node_ref : nodes) {
+            const osmium::Location location = node_ref.location();
+            if (!location.valid()) {
+                m_locations_valid = false;
+            }
+            m_x.push_back(location.x());
+            m_y.push_back(location.y());
+            m_ids.push_back(node_ref.ref());
+        }
+        r.last = static_cast<uint32_t>(m_x.size());
+        m_rings.push_back(r);
+    }
+
+public:
+
+    AreaRings() = default;
+
+    explicit AreaRings(const osmium::Area& area) {
+        assign(area);
+    }
+
+    void clear() noexcept {
+        m_x.clear();
+        m_y.clear();
+        m_ids.clear();
+        m_rings.clear();
+        m_locations_valid = true;
+    }
+
+    /**
+     * Copy the rings from the area, replacing any rings stored before.
+     * Returns false if any of the locations is invalid.
+     */
+    bool assign(const osmium::Area& area) {
+        clear();
+        for (auto it = area.cbegin(); it != area.cend(); ++it) {
+            if (it->type() == osmium::item_type::outer_ring) {
+                add_ring(static_cast<const osmium::OuterRing&>(*it), true);
+            } else if (it->type() == osmium::item_type::inner_ring) {
+                add_ring(static_cast<const osmium::InnerRing&>(*it), false);
+            }
+        }
+        return m_locations_valid;
+    }
+
+    bool locations_valid() const noexcept {
+        return m_locations_valid;
+    }
+
+    bool empty() const noexcept {
+        return m_rings.empty();
+    }
+
+    std::size_t num_rings() const noexcept {
+        return m_rings.size();
+    }
+
+    std::size_t num_points() const noexcept {
+        return m_x.size();
+    }
+
+    const std::vector<ring>& rings() const noexcept {
+        return m_rings;
+    }
+
+    const int32_t* x() const noexcept {
+        return m_x.data();
+    }
+
+    const int32_t* y() const noexcept {
+        return m_y.data();
+    }
+
+    const osmium::object_id_type* ids() const noexcept {
+        return m_ids.data();
+    }
+
+    point_position point_in(const ring& r, int64_t px, int64_t py, int64_t scale = 1) const noexcept {
+        return point_in_ring(x() + r.first, y() + r.first, r.size(), px, py, scale);
+    }
+
+}; // class AreaRings
+
+#endif // OAT_AREA_RINGS_HPP
@@ -0,0 +1,492 @@
+#ifndef OAT_AREA_STORE_HPP
+#define OAT_AREA_STORE_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Memory mappable store for assembled areas
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/types.hpp>
+
+#include "oat_area_rings.hpp"
+#include "oat_rtree.hpp"
+
+/*
+ * File format of the area store (all numbers in native byte order):
+ *
+ *   store::header
+ *   area records, one after the other, each consisting of
+ *     store::area_record_header
+ *     uint32_t ring_ends[num_rings]  (index one past the last point of each
+ *                                     ring, highest bit set for inner rings)
+ *     int32_t x[num_points]
+ *     int32_t y[num_points]
+ *     padding to a multiple of 8 bytes
+ *   offset table: store::index_entry[num_areas], sorted by id
+ *   R-tree: rtree_box[tree_num_boxes], uint32_t[tree_num_boxes] indexes,
+ *           uint32_t[tree_num_levels] level ends
+ *
+ * The R-tree returns positions in the offset table. The header is written
+ * last, a store that was not closed properly has no valid magic.
+ */
+
+namespace store {
+
+    constexpr const char magic[8] = {'O', 'A', 'T', 'S', 'T', 'O', 'R', 'E'};
+    constexpr const uint32_t version = 1;
+    constexpr const uint32_t inner_ring_flag = 0x80000000;
+
+    struct header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t num_areas;
+        uint64_t index_offset;
+        uint64_t tree_boxes_offset;
+        uint64_t tree_indexes_offset;
+        uint64_t tree_level_ends_offset;
+        uint64_t tree_num_boxes;
+        uint64_t tree_num_levels;
+    };
+
+    struct area_record_header {
+        int64_t id;
+        rtree_box box;
+        uint32_t num_rings;
+        uint32_t num_points;
+    };
+
+    struct index_entry {
+        int64_t id;
+        uint64_t offset;
+    };
+
+    inline std::size_t padded(std::size_t size) noexcept {
+        return (size + 7) & ~static_cast<std::size_t>(7);
+    }
+
+} // namespace store
+
+/**
+ * Writes areas into a store file. Areas are appended as they come in, the
+ * offset table and the spatial index are written in close().
+ */
+class AreaStoreWriter {
+
+    int m_fd = -1;
+    uint64_t m_offset = sizeof(store::header);
+
+    std::vector<store::index_entry> m_index;
+    std::vector<rtree_box> m_boxes;
+
+    AreaRings m_rings;
+    std::vector<char> m_buffer;
+
+    void write(const void* data, std::size_t size) {
+        const char* ptr = static_cast<const char*>(data);
+        while (size > 0) {
+            const auto written = ::write(m_fd, ptr, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Write to area store failed"};
+            }
+            ptr += written;
+            size -= static_cast<std::size_t>(written);
+        }
+        m_offset += static_cast<uint64_t>(ptr - static_cast<const char*>(data));
+    }
+
+    template <typename T>
+    void write_vector(const std::vector<T>& data) {
+        write(data.data(), data.size() * sizeof(T));
+        const std::size_t padding = store::padded(m_offset) - m_offset;
+        if (padding > 0) {
+            const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            write(zeros, padding);
+        }
+    }
+
+    template <typename T>
+    void append(const T* data, std::size_t count) {
+        const auto* ptr = reinterpret_cast<const char*>(data);
+        m_buffer.insert(m_buffer.end(), ptr, ptr + count * sizeof(T));
+    }
+
+public:
+
+    /**
+     * Create the store file with the given name. An existing file is
+     * overwritten.
+     */
+    explicit AreaStoreWriter(const std::string& filename) :
+        m_fd(::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) {
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not open area store '" + filename + "'"};
+        }
+        if (::lseek(m_fd, sizeof(store::header), SEEK_SET) < 0) {
+            throw std::system_error{errno, std::system_category(), "Seek in area store failed"};
+        }
+    }
+
+    AreaStoreWriter(const AreaStoreWriter&) = delete;
+    AreaStoreWriter& operator=(const AreaStoreWriter&) = delete;
+
+    ~AreaStoreWriter() {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+
+    /**
+     * Append area to the store. Areas with invalid locations or without
+     * rings are not stored.
+     */
+    void add(const osmium::Area& area) {
+        if (!m_rings.assign(area) || m_rings.empty()) {
+            return;
+        }
+
+        store::area_record_header record;
+        record.id = area.id();
+        record.num_rings = static_cast<uint32_t>(m_rings.num_rings());
+        record.num_points = static_cast<uint32_t>(m_rings.num_points());
+        for (std::size_t i = 0; i < m_rings.num_points(); ++i) {
+            record.box.extend(m_rings.x()[i], m_rings.y()[i]);
+        }
+
+        m_buffer.clear();
+        append(&record, 1);
+        for (const auto& r : m_rings.rings()) {
+            const uint32_t end = r.last | (r.is_outer ? 0 : store::inner_ring_flag);
+            append(&end, 1);
+        }
+        append(m_rings.x(), m_rings.num_points());
+        append(m_rings.y(), m_rings.num_points());
+        m_buffer.resize(store::padded(m_buffer.size()), 0);
+
+        m_index.push_back(store::index_entry{record.id, m_offset});
+        m_boxes.push_back(record.box);
+        write(m_buffer.data(), m_buffer.size());
+    }
+
+    std::size_t size() const noexcept {
+        return m_index.size();
+    }
+
+    /**
+     * Write offset table, spatial index, and header and close the file.
+     */
+    void close() {
+        if (m_fd < 0) {
+            return;
+        }
+
+        store::header header;
+        std::memcpy(header.magic, store::magic, sizeof(header.magic));
+        header.version = store::version;
+        header.reserved = 0;
+        header.num_areas = m_index.size();
+
+        // sort offset table (and boxes in the same order) by id
+        std::vector<uint32_t> order(m_index.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+            return m_index[a].id < m_index[b].id;
+        });
+        std::vector<store::index_entry> index;
+        std::vector<rtree_box> boxes;
+        index.reserve(m_index.size());
+        boxes.reserve(m_index.size());
+        for (const uint32_t i : order) {
+            index.push_back(m_index[i]);
+            boxes.push_back(m_boxes[i]);
+        }
+
+        header.index_offset = m_offset;
+        write_vector(index);
+
+        const PackedRTree tree{boxes};
+        header.tree_num_boxes = tree.boxes().size();
+        header.tree_num_levels = tree.level_ends().size();
+        header.tree_boxes_offset = m_offset;
+        write_vector(tree.boxes());
+        header.tree_indexes_offset = m_offset;
+        write_vector(tree.indexes());
+        header.tree_level_ends_offset = m_offset;
+        write_vector(tree.level_ends());
+
+        if (::pwrite(m_fd, &header, sizeof(header), 0) != sizeof(header)) {
+            throw std::system_error{errno, std::system_category(), "Write to area store failed"};
+        }
+
+        const int fd = m_fd;
+        m_fd = -1;
+        if (::close(fd) != 0) {
+            throw std::system_error{errno, std::system_category(), "Close of area store failed"};
+        }
+    }
+
+}; // class AreaStoreWriter
+
+/**
+ * Read access to an area store file through a read-only memory mapping.
+ * Areas are accessed in place, nothing is copied.
+ */
+class AreaStore {
+
+public:
+
+    /**
+     * One ring of an area in the store.
+     */
+    class ring_view {
+
+        const int32_t* m_x;
+        const int32_t* m_y;
+        uint32_t m_size;
+        bool m_is_outer;
+
+    public:
+
+        ring_view(const int32_t* x, const int32_t* y, uint32_t size, bool is_outer) noexcept :
+            m_x(x),
+            m_y(y),
+            m_size(size),
+            m_is_outer(is_outer) {
+        }
+
+        const int32_t* x() const noexcept {
+            return m_x;
+        }
+
+        const int32_t* y() const noexcept {
+            return m_y;
+        }
+
+        // number of points including the closing point
+        uint32_t size() const noexcept {
+            return m_size;
+        }
+
+        bool is_outer() const noexcept {
+            return m_is_outer;
+        }
+
+        point_position point_in(int64_t px, int64_t py, int64_t scale = 1) const noexcept {
+            return point_in_ring(m_x, m_y, m_size, px, py, scale);
+        }
+
+    }; // class ring_view
+
+    /**
+     * An area in the store.
+     */
+    class area_view {
+
+        const store::area_record_header* m_header = nullptr;
+
+        const uint32_t* ring_ends() const noexcept {
+            return reinterpret_cast<const uint32_t*>(m_header + 1);
+        }
+
+        const int32_t* xs() const noexcept {
+            return reinterpret_cast<const int32_t*>(ring_ends() + m_header->num_rings);
+        }
+
+        const int32_t* ys() const noexcept {
+            return xs() + m_header->num_points;
+        }
+
+    public:
+
+        area_view() = default;
+
+        explicit area_view(const store::area_record_header* header) noexcept :
+            m_header(header) {
+        }
+
+        // false for the empty view returned if an area is not found
+        explicit operator bool() const noexcept {
+            return m_header != nullptr;
+        }
+
+        osmium::object_id_type id() const noexcept {
+            return m_header->id;
+        }
+
+        const rtree_box& box() const noexcept {
+            return m_header->box;
+        }
+
+        uint32_t num_rings() const noexcept {
+            return m_header->num_rings;
+        }
+
+        uint32_t num_points() const noexcept {
+            return m_header->num_points;
+        }
+
+        ring_view ring(uint32_t n) const noexcept {
+            const uint32_t first = n == 0 ? 0 : (ring_ends()[n - 1] & ~store::inner_ring_flag);
+            const uint32_t end = ring_ends()[n];
+            const uint32_t last = end & ~store::inner_ring_flag;
+            return ring_view{xs() + first, ys() + first, last - first, (end & store::inner_ring_flag) == 0};
+        }
+
+        /**
+         * Is the point inside the area? Uses the even-odd rule over all
+         * rings, points on the boundary are counted as inside.
+         */
+        bool contains(int64_t px, int64_t py, int64_t scale = 1) const noexcept {
+            bool inside = false;
+            for (uint32_t n = 0; n < num_rings(); ++n) {
+                const auto pos = ring(n).point_in(px, py, scale);
+                if (pos == point_position::boundary) {
+                    return true;
+                }
+                if (pos == point_position::inside) {
+                    inside = !inside;
+                }
+            }
+            return inside;
+        }
+
+    }; // class area_view
+
+private:
+
+    const char* m_data = nullptr;
+    std::size_t m_size = 0;
+
+    const store::header* m_header = nullptr;
+    const store::index_entry* m_index = nullptr;
+    PackedRTreeView m_tree;
+
+    template <typename T>
+    const T* section(uint64_t offset, uint64_t count) const {
+        if (offset + count * sizeof(T) > m_size) {
+            throw std::runtime_error{"Area store is truncated"};
+        }
+        return reinterpret_cast<const T*>(m_data + offset);
+    }
+
+public:
+
+    explicit AreaStore(const std::string& filename) {
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not open area store '" + filename + "'"};
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::system_error{errno, std::system_category(), "Can not stat area store '" + filename + "'"};
+        }
+        m_size = static_cast<std::size_t>(st.st_size);
+        if (m_size < sizeof(store::header)) {
+            ::close(fd);
+            throw std::runtime_error{"Area store '" + filename + "' is truncated"};
+        }
+        void* data = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::system_error{errno, std::system_category(), "Can not map area store '" + filename + "'"};
+        }
+        m_data = static_cast<const char*>(data);
+
+        try {
+            m_header = section<store::header>(0, 1);
+            if (std::memcmp(m_header->magic, store::magic, sizeof(store::magic)) || m_header->version != store::version) {
+                throw std::runtime_error{"File '" + filename + "' is not an area store or was not closed properly"};
+            }
+            m_index = section<store::index_entry>(m_header->index_offset, m_header->num_areas);
+            if (m_header->tree_num_levels > PackedRTreeView::max_levels) {
+                throw std::runtime_error{"Area store '" + filename + "' has a broken spatial index"};
+            }
+            m_tree = PackedRTreeView{
+                section<rtree_box>(m_header->tree_boxes_offset, m_header->tree_num_boxes),
+                m_header->tree_num_boxes,
+                section<uint32_t>(m_header->tree_indexes_offset, m_header->tree_num_boxes),
+                section<uint32_t>(m_header->tree_level_ends_offset, m_header->tree_num_levels),
+                m_header->tree_num_levels
+            };
+        } catch (...) {
+            ::munmap(const_cast<char*>(m_data), m_size);
+            throw;
+        }
+    }
+
+    AreaStore(const AreaStore&) = delete;
+    AreaStore& operator=(const AreaStore&) = delete;
+
+    ~AreaStore() {
+        ::munmap(const_cast<char*>(m_data), m_size);
+    }
+
+    std::size_t size() const noexcept {
+        return m_header->num_areas;
+    }
+
+    /**
+     * Get area by its position in the store (areas are sorted by id).
+     */
+    area_view at(std::size_t n) const noexcept {
+        return area_view{reinterpret_cast<const store::area_record_header*>(m_data + m_index[n].offset)};
+    }
+
+    /**
+     * Find area by id. Returns an empty view if there is no such area.
+     */
+    area_view find(osmium::object_id_type id) const noexcept {
+        const auto* end = m_index + m_header->num_areas;
+        const auto* it = std::lower_bound(m_index, end, id, [](const store::index_entry& entry, osmium::object_id_type value) {
+            return entry.id < value;
+        });
+        if (it == end || it->id != id) {
+            return area_view{};
+        }
+        return at(static_cast<std::size_t>(it - m_index));
+    }
+
+    /**
+     * Call func(area_view) for all areas with a bounding box intersecting
+     * the given box.
+     */
+    template <typename TFunc>
+    void search(const rtree_box& box, TFunc&& func) const {
+        m_tree.search(box, [this, &func](uint32_t n) {
+            func(at(n));
+        });
+    }
+
+    const PackedRTreeView& tree() const noexcept {
+        return m_tree;
+    }
+
+}; // class AreaStore
+
+#endif // OAT_AREA_STORE_HPP
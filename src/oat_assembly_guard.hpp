@@ -0,0 +1,355 @@
+#ifndef OAT_ASSEMBLY_GUARD_HPP
+#define OAT_ASSEMBLY_GUARD_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Time limit for assembling multipolygon relations
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <osmium/area/assembler.hpp>
+#include <osmium/area/stats.hpp>
+#include <osmium/builder/attr.hpp>
+#include <osmium/io/header.hpp>
+#include <osmium/io/pbf_output.hpp>
+#include <osmium/io/writer.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "oat_problem_sink.hpp"
+#include "oat_work_queue.hpp"
+
+/**
+ * Runs the assembler for relations on a separate thread and waits at most
+ * the given time for it. If the assembler takes longer, the relation is
+ * skipped and reported as a problem, and the relation with its member ways
+ * and their nodes is written to the file "timeout-r<ID>.osm.pbf" in the
+ * current directory, so the case can be reproduced.
+ *
+ * A running assembler can not be stopped. Its thread is left to finish
+ * on its own, working on copies of the data, and a new thread takes over
+ * for the next relations. At most max_stuck of these threads are kept
+ * running, for the next timeout the oldest one is waited for. All threads
+ * are joined when the guard is destroyed.
+ *
+ * Copying the relation and its members and handing them to the other
+ * thread costs more than assembling most relations. So only relations
+ * for which may_be_slow() is true should be given to the guard.
+ */
+class AssemblyGuard {
+
+    struct job {
+        osmium::memory::Buffer input{1024 * 64, osmium::memory::Buffer::auto_grow::yes};
+        osmium::memory::Buffer output{1024 * 64, osmium::memory::Buffer::auto_grow::yes};
+        osmium::area::AssemblerConfig config;
+        std::unique_ptr<ProblemSink::buffer> problems{nullptr};
+        osmium::area::area_stats stats;
+        std::promise<void> done;
+
+        const osmium::Relation& relation() const {
+            return input.get<osmium::Relation>(0);
+        }
+
+        std::vector<const osmium::Way*> members() const {
+            std::vector<const osmium::Way*> ways;
+            for (const auto& way : input.select<osmium::Way>()) {
+                ways.push_back(&way);
+            }
+            return ways;
+        }
+    };
+
+    struct worker_state {
+        WorkQueue<std::shared_ptr<job>> queue{1};
+        std::atomic<bool> finished{false};
+    };
+
+    struct worker_thread {
+        std::shared_ptr<worker_state> state;
+        std::thread thread;
+    };
+
+    std::chrono::milliseconds m_max_time;
+    ProblemSink* m_problems;
+
+    worker_thread m_worker;
+
+    // threads still working on a relation that took too long
+    std::vector<worker_thread> m_stuck;
+
+    // problem buffers of finished jobs, used again for the next jobs
+    std::vector<std::unique_ptr<ProblemSink::buffer>> m_free_buffers;
+
+    uint64_t m_timeouts = 0;
+
+    static void worker(std::shared_ptr<worker_state> state) {
+        std::shared_ptr<job> j;
+        while (state->queue.pop(j)) {
+            try {
+                osmium::area::Assembler assembler{j->config};
+                assembler(j->relation(), j->members(), j->output);
+                j->stats = assembler.stats();
+                j->done.set_value();
+            } catch (...) {
+                j->done.set_exception(std::current_exception());
+            }
+            j.reset();
+        }
+        state->finished = true;
+    }
+
+    void start_worker() {
+        m_worker.state = std::make_shared<worker_state>();
+        m_worker.thread = std::thread{&AssemblyGuard::worker, m_worker.state};
+    }
+
+    // Leave the current worker to finish its job and start a new one.
+    void replace_worker() {
+        m_worker.state->queue.close();
+        m_stuck.push_back(std::move(m_worker));
+
+        const auto finished = std::partition(m_stuck.begin(), m_stuck.end(), [](const worker_thread& w) {
+            return !w.state->finished;
+        });
+        for (auto it = finished; it != m_stuck.end(); ++it) {
+            it->thread.join();
+        }
+        m_stuck.erase(finished, m_stuck.end());
+
+        if (m_stuck.size() > max_stuck) {
+            std::cerr << "Too many assemblers running after timeout, waiting for one of them.\n";
+            m_stuck.front().thread.join();
+            m_stuck.erase(m_stuck.begin());
+        }
+
+        start_worker();
+    }
+
+    static void write_repro(const job& j) {
+        osmium::memory::Buffer buffer{1024 * 64, osmium::memory::Buffer::auto_grow::yes};
+
+        std::vector<std::pair<osmium::object_id_type, osmium::Location>> nodes;
+        std::vector<const osmium::Way*> ways = j.members();
+        for (const auto* way : ways) {
+            for (const auto& node_ref : way->nodes()) {
+                nodes.emplace_back(node_ref.ref(), node_ref.location());
+            }
+        }
+        std::sort(nodes.begin(), nodes.end(), [](const std::pair<osmium::object_id_type, osmium::Location>& a, const std::pair<osmium::object_id_type, osmium::Location>& b) {
+            return a.first < b.first;
+        });
+        nodes.erase(std::unique(nodes.begin(), nodes.end(), [](const std::pair<osmium::object_id_type, osmium::Location>& a, const std::pair<osmium::object_id_type, osmium::Location>& b) {
+            return a.first == b.first;
+        }), nodes.end());
+
+        using namespace osmium::builder::attr;
+        for (const auto& node : nodes) {
+            osmium::builder::add_node(buffer, _id(node.first), _version(1), _location(node.second));
+        }
+
+        std::sort(ways.begin(), ways.end(), [](const osmium::Way* a, const osmium::Way* b) {
+            return a->id() < b->id();
+        });
+        ways.erase(std::unique(ways.begin(), ways.end(), [](const osmium::Way* a, const osmium::Way* b) {
+            return a->id() == b->id();
+        }), ways.end());
+        for (const auto* way : ways) {
+            buffer.add_item(*way);
+            buffer.commit();
+        }
+
+        buffer.add_item(j.relation());
+        buffer.commit();
+
+        const std::string filename{"timeout-r" + std::to_string(j.relation().id()) + ".osm.pbf"};
+        osmium::io::Header header;
+        header.set("generator", "oat_create_areas");
+        osmium::io::Writer writer{filename, header, osmium::io::overwrite::allow};
+        writer(std::move(buffer));
+        writer.close();
+    }
+
+    void timed_out(const job& j) {
+        ++m_timeouts;
+        const auto id = j.relation().id();
+        std::cerr << "Assembling relation " << id << " took more than " << m_max_time.count() << "ms, skipped it.\n";
+        if (m_problems) {
+            m_problems->report_timeout(id, static_cast<uint64_t>(m_max_time.count()));
+        }
+        try {
+            write_repro(j);
+        } catch (const std::exception& e) {
+            std::cerr << "Can not write repro file for relation " << id << ": " << e.what() << '\n';
+        }
+    }
+
+public:
+
+    enum : std::size_t {
+        // relations with fewer nodes in their member ways are fast enough
+        // to be assembled without a guard
+        min_guarded_nodes = 10000,
+
+        // threads left running after a timeout
+        max_stuck = 4
+    };
+
+    static bool may_be_slow(const std::vector<const osmium::Way*>& members) noexcept {
+        std::size_t nodes = 0;
+        for (const auto* way : members) {
+            nodes += way->nodes().size();
+            if (nodes >= min_guarded_nodes) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * If problems is not nullptr, the problems found by the assembler are
+     * reported to the sink (from the calling thread).
+     */
+    AssemblyGuard(uint64_t max_ms, ProblemSink* problems) :
+        m_max_time(static_cast<std::chrono::milliseconds::rep>(max_ms)),
+        m_problems(problems) {
+        start_worker();
+    }
+
+    AssemblyGuard(const AssemblyGuard&) = delete;
+    AssemblyGuard& operator=(const AssemblyGuard&) = delete;
+
+    ~AssemblyGuard() {
+        m_worker.state->queue.close();
+        m_worker.thread.join();
+        if (!m_stuck.empty()) {
+            std::cerr << "Waiting for " << m_stuck.size() << " assemblers still running after timeout...\n";
+        }
+        for (auto& w : m_stuck) {
+            w.thread.join();
+        }
+    }
+
+    /**
+     * Assemble the relation on the worker thread and add the result to
+     * the out_buffer and stats. Rethrows exceptions from the assembler.
+     */
+    void operator()(const osmium::area::AssemblerConfig& config, const osmium::Relation& relation, const std::vector<const osmium::Way*>& members, osmium::memory::Buffer& out_buffer, osmium::area::area_stats& stats) {
+        auto j = std::make_shared<job>();
+        j->input.add_item(relation);
+        j->input.commit();
+        for (const auto* way : members) {
+            j->input.add_item(*way);
+            j->input.commit();
+        }
+
+        j->config = config;
+        if (m_problems) {
+            if (m_free_buffers.empty()) {
+                j->problems = m_problems->make_buffer();
+            } else {
+                j->problems = std::move(m_free_buffers.back());
+                m_free_buffers.pop_back();
+            }
+            j->config.problem_reporter = j->problems->reporter();
+        } else {
+            j->config.problem_reporter = nullptr;
+        }
+
+        auto done = j->done.get_future();
+        m_worker.state->queue.push(std::shared_ptr<job>{j});
+
+        if (done.wait_for(m_max_time) == std::future_status::timeout) {
+            // the old worker ends after this job, the job is kept alive
+            // by the worker thread until then
+            replace_worker();
+            timed_out(*j);
+            return;
+        }
+
+        if (j->problems) {
+            m_problems->append(*j->problems);
+            m_free_buffers.push_back(std::move(j->problems));
+        }
+        done.get();
+        out_buffer.add_buffer(j->output);
+        out_buffer.commit();
+        stats += j->stats;
+    }
+
+    uint64_t timeouts() const noexcept {
+        return m_timeouts;
+    }
+
+}; // class AssemblyGuard
+
+/**
+ * Assembler for the MultipolygonCollector that works like the normal
+ * assembler, but hands relations that may be slow to the AssemblyGuard in
+ * its config, if there is one.
+ */
+class TimedAssembler {
+
+public:
+
+    struct config_type : public osmium::area::AssemblerConfig {
+        AssemblyGuard* guard = nullptr;
+
+        config_type(const osmium::area::AssemblerConfig& config, AssemblyGuard* g) :
+            osmium::area::AssemblerConfig(config),
+            guard(g) {
+        }
+    };
+
+private:
+
+    const config_type& m_config;
+    osmium::area::area_stats m_stats;
+
+public:
+
+    explicit TimedAssembler(const config_type& config) :
+        m_config(config) {
+    }
+
+    void operator()(const osmium::Way& way, osmium::memory::Buffer& out_buffer) {
+        osmium::area::Assembler assembler{m_config};
+        assembler(way, out_buffer);
+        m_stats += assembler.stats();
+    }
+
+    void operator()(const osmium::Relation& relation, const std::vector<const osmium::Way*>& members, osmium::memory::Buffer& out_buffer) {
+        if (m_config.guard && AssemblyGuard::may_be_slow(members)) {
+            (*m_config.guard)(m_config, relation, members, out_buffer, m_stats);
+        } else {
+            osmium::area::Assembler assembler{m_config};
+            assembler(relation, members, out_buffer);
+            m_stats += assembler.stats();
+        }
+    }
+
+    const osmium::area::area_stats& stats() const noexcept {
+        return m_stats;
+    }
+
+}; // class TimedAssembler
+
+#endif // OAT_ASSEMBLY_GUARD_HPP
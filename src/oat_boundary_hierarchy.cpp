@@ -0,0 +1,472 @@
+/*****************************************************************************
+
+  OSM Area Tools - Boundary hierarchy
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <sqlite.hpp>
+
+#include <osmium/area/assembler.hpp>
+#include <osmium/area/multipolygon_collector.hpp>
+#include <osmium/index/map/dense_mem_array.hpp>
+#include <osmium/index/map/dense_mmap_array.hpp>
+#include <osmium/index/map/dummy.hpp>
+#include <osmium/index/map/sparse_mem_array.hpp>
+#include <osmium/index/map/sparse_mmap_array.hpp>
+#include <osmium/index/node_locations_map.hpp>
+#include <osmium/handler/node_locations_for_ways.hpp>
+#include <osmium/io/any_input.hpp>
+#include <osmium/util/memory.hpp>
+#include <osmium/util/verbose_output.hpp>
+#include <osmium/visitor.hpp>
+
+#include "oat.hpp"
+#include "oat_area_filter.hpp"
+#include "oat_area_metrics.hpp"
+#include "oat_area_rings.hpp"
+#include "oat_rtree.hpp"
+
+using index_type = osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>;
+using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
+
+REGISTER_MAP(osmium::unsigned_object_id_type, osmium::Location, osmium::index::map::Dummy, none)
+
+/**
+ * All administrative boundary areas with their rings in flat arrays.
+ */
+class BoundaryList {
+
+public:
+
+    struct boundary {
+        osmium::object_id_type id;
+        osmium::object_id_type orig_id;
+        bool from_way;
+        int admin_level;
+        std::string name;
+
+        // range of rings in m_rings
+        uint32_t first_ring;
+        uint32_t last_ring;
+
+        rtree_box box;
+
+        // area in m², used to find the smallest parent
+        double area;
+
+        // a point inside the area in units of half the OSM coordinate
+        // units, see representative_point()
+        int64_t point_x;
+        int64_t point_y;
+    };
+
+private:
+
+    std::vector<int32_t> m_x;
+    std::vector<int32_t> m_y;
+    std::vector<AreaRings::ring> m_rings;
+    std::vector<boundary> m_boundaries;
+
+    AreaRings m_area_rings;
+    AreaMetrics m_metrics;
+
+    // Find a point inside the area. A horizontal line half way between two
+    // coordinate rows through the middle of the first outer ring can not go
+    // through any vertex. The midpoint of the widest piece of this line that
+    // is inside the area is used. Coordinates are returned in units of half
+    // the OSM coordinate units, so they are exact.
+    bool representative_point(boundary& b) const {
+        const auto& outer = m_rings[b.first_ring];
+        int32_t min_y = std::numeric_limits<int32_t>::max();
+        int32_t max_y = std::numeric_limits<int32_t>::min();
+        for (uint32_t i = outer.first; i < outer.last; ++i) {
+            min_y = std::min(min_y, m_y[i]);
+            max_y = std::max(max_y, m_y[i]);
+        }
+        if (min_y == max_y) {
+            return false;
+        }
+        const int64_t line_y = static_cast<int64_t>(min_y) + max_y; // doubled
+        const int64_t y = line_y | 1; // half way between two rows
+
+        std::vector<double> crossings;
+        for (uint32_t r = b.first_ring; r < b.last_ring; ++r) {
+            for (uint32_t i = m_rings[r].first; i + 1 < m_rings[r].last; ++i) {
+                const int64_t y1 = 2 * static_cast<int64_t>(m_y[i]);
+                const int64_t y2 = 2 * static_cast<int64_t>(m_y[i + 1]);
+                if ((y1 < y) != (y2 < y)) {
+                    const double x1 = 2.0 * m_x[i];
+                    const double x2 = 2.0 * m_x[i + 1];
+                    crossings.push_back(x1 + (x2 - x1) * (y - y1) / (y2 - y1));
+                }
+            }
+        }
+        std::sort(crossings.begin(), crossings.end());
+
+        double best_width = 0.0;
+        for (std::size_t i = 0; i + 1 < crossings.size(); i += 2) {
+            const double width = crossings[i + 1] - crossings[i];
+            if (width > best_width) {
+                best_width = width;
+                b.point_x = static_cast<int64_t>((crossings[i] + crossings[i + 1]) / 2);
+                b.point_y = y;
+            }
+        }
+
+        // the piece must be wide enough that rounding can't move the point
+        // out of the area
+        return best_width > 2.0;
+    }
+
+public:
+
+    /**
+     * Add area if it is an administrative boundary with a numeric
+     * admin_level.
+     */
+    void add(const osmium::Area& area) {
+        const char* boundary_tag = area.tags().get_value_by_key("boundary");
+        const char* admin_level = area.tags().get_value_by_key("admin_level");
+        if (!boundary_tag || std::strcmp(boundary_tag, "administrative") || !admin_level) {
+            return;
+        }
+
+        char* end = nullptr;
+        const long level = std::strtol(admin_level, &end, 10);
+        if (end == admin_level || *end != '\0' || level < 0 || level > 100) {
+            return;
+        }
+
+        if (!m_area_rings.assign(area) || m_area_rings.empty()) {
+            return;
+        }
+
+        boundary b;
+        b.id = area.id();
+        b.orig_id = area.orig_id();
+        b.from_way = area.from_way();
+        b.admin_level = static_cast<int>(level);
+        b.name = area.tags().get_value_by_key("name", "");
+        b.first_ring = static_cast<uint32_t>(m_rings.size());
+
+        const uint32_t offset = static_cast<uint32_t>(m_x.size());
+        m_x.insert(m_x.end(), m_area_rings.x(), m_area_rings.x() + m_area_rings.num_points());
+        m_y.insert(m_y.end(), m_area_rings.y(), m_area_rings.y() + m_area_rings.num_points());
+        for (auto r : m_area_rings.rings()) {
+            r.first += offset;
+            r.last += offset;
+            r.outer += b.first_ring;
+            m_rings.push_back(r);
+        }
+        b.last_ring = static_cast<uint32_t>(m_rings.size());
+
+        for (uint32_t i = offset; i < m_x.size(); ++i) {
+            b.box.extend(m_x[i], m_y[i]);
+        }
+
+        m_metrics(area);
+        b.area = m_metrics.area();
+
+        if (!representative_point(b)) {
+            std::cerr << "Can not find point inside area " << b.id << ", ignoring it.\n";
+            m_x.resize(offset);
+            m_y.resize(offset);
+            m_rings.resize(b.first_ring);
+            return;
+        }
+
+        m_boundaries.push_back(std::move(b));
+    }
+
+    const std::vector<boundary>& boundaries() const noexcept {
+        return m_boundaries;
+    }
+
+    /**
+     * Is the point (given in half OSM coordinate units) inside the
+     * boundary area? Uses the even-odd rule over all rings, points on the
+     * boundary are counted as inside.
+     */
+    bool contains(const boundary& b, int64_t px, int64_t py) const noexcept {
+        bool inside = false;
+        for (uint32_t r = b.first_ring; r < b.last_ring; ++r) {
+            const auto& ring = m_rings[r];
+            const auto pos = point_in_ring(m_x.data() + ring.first, m_y.data() + ring.first, ring.size(), px, py, 2);
+            if (pos == point_position::boundary) {
+                return true;
+            }
+            if (pos == point_position::inside) {
+                inside = !inside;
+            }
+        }
+        return inside;
+    }
+
+    std::size_t num_points() const noexcept {
+        return m_x.size();
+    }
+
+}; // class BoundaryList
+
+/**
+ * Find the parent of each boundary: the boundary with the next lower
+ * admin_level that contains a point inside the boundary. If several
+ * boundaries with the same admin_level contain the point, the smallest
+ * one is used.
+ */
+std::vector<int64_t> find_parents(const BoundaryList& list, const PackedRTree& tree, unsigned int num_threads) {
+    const auto& boundaries = list.boundaries();
+    std::vector<int64_t> parents(boundaries.size(), -1);
+
+    std::atomic<std::size_t> next{0};
+    const std::size_t chunk_size = 1000;
+
+    auto worker = [&]() {
+        std::vector<uint32_t> candidates;
+        while (true) {
+            const std::size_t begin = next.fetch_add(chunk_size);
+            if (begin >= boundaries.size()) {
+                break;
+            }
+            const std::size_t end = std::min(begin + chunk_size, boundaries.size());
+            for (std::size_t n = begin; n < end; ++n) {
+                const auto& child = boundaries[n];
+                const int32_t x = static_cast<int32_t>(child.point_x / 2);
+                const int32_t y = static_cast<int32_t>(child.point_y / 2);
+                candidates.clear();
+                tree.search(rtree_box{x - 1, y - 1, x + 1, y + 1}, [&candidates](uint32_t index) {
+                    candidates.push_back(index);
+                });
+
+                int64_t best = -1;
+                for (const uint32_t c : candidates) {
+                    const auto& parent = boundaries[c];
+                    if (parent.admin_level >= child.admin_level) {
+                        continue;
+                    }
+                    if (best >= 0) {
+                        const auto& current = boundaries[best];
+                        if (parent.admin_level < current.admin_level ||
+                            (parent.admin_level == current.admin_level && parent.area >= current.area)) {
+                            continue;
+                        }
+                    }
+                    if (list.contains(parent, child.point_x, child.point_y)) {
+                        best = c;
+                    }
+                }
+                parents[n] = best;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < num_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    return parents;
+}
+
+void write_parents(const std::string& filename, const BoundaryList& list, const std::vector<int64_t>& parents) {
+    Sqlite::Database db{filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE};
+    db.exec("CREATE TABLE parents (id INTEGER, source TEXT, orig_id INTEGER, admin_level INTEGER, name TEXT, parent_id INTEGER, parent_admin_level INTEGER);");
+
+    db.begin_transaction();
+    Sqlite::Statement statement{db, "INSERT INTO parents (id, source, orig_id, admin_level, name, parent_id, parent_admin_level) VALUES (?, ?, ?, ?, ?, ?, ?);"};
+    const auto& boundaries = list.boundaries();
+    for (std::size_t n = 0; n < boundaries.size(); ++n) {
+        const auto& b = boundaries[n];
+        statement.bind_int64(b.id);
+        statement.bind_text(b.from_way ? "w" : "r");
+        statement.bind_int64(b.orig_id);
+        statement.bind_int(b.admin_level);
+        statement.bind_text(b.name);
+        if (parents[n] >= 0) {
+            statement.bind_int64(boundaries[parents[n]].id);
+            statement.bind_int(boundaries[parents[n]].admin_level);
+        } else {
+            statement.bind_null();
+            statement.bind_null();
+        }
+        statement.execute();
+    }
+    db.commit();
+}
+
+void print_help() {
+    std::cout << "oat_boundary_hierarchy [OPTIONS] OSMFILE\n\n"
+              << "Build administrative boundary areas from OSMFILE and find the parent\n"
+              << "boundary of each of them.\n"
+              << "\nOptions:\n"
+              << "  -h, --help                   This help message\n"
+              << "  -i, --index=INDEX_TYPE       Set index type for location index (default: sparse_mmap_array)\n"
+              << "  -I, --show-index-types       Show available index types for location index\n"
+              << "  -o, --output=DBNAME          Output database name (default: boundaries.db)\n"
+              << "  -O, --overwrite              Overwrite existing database\n"
+              << "  -t, --threads=NUM            Number of threads (default: number of cores)\n"
+              ;
+}
+
+using collector_type = osmium::area::MultipolygonCollector<osmium::area::Assembler>;
+
+osmium::osm_entity_bits::type entity_bits(const std::string& location_index_type) {
+    if (location_index_type == "none") {
+        return osmium::osm_entity_bits::way;
+    } else {
+        return osmium::osm_entity_bits::way | osmium::osm_entity_bits::node;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    osmium::util::VerboseOutput vout{true};
+
+    static const struct option long_options[] = {
+        {"help",       no_argument,       0, 'h'},
+        {"index",      required_argument, 0, 'i'},
+        {"show-index", no_argument,       0, 'I'},
+        {"output",     required_argument, 0, 'o'},
+        {"overwrite",  no_argument,       0, 'O'},
+        {"threads",    required_argument, 0, 't'},
+        {0, 0, 0, 0}
+    };
+
+    std::string location_index_type = "sparse_mmap_array";
+    const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance();
+
+    std::string output{"boundaries.db"};
+    bool overwrite = false;
+    unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    while (true) {
+        int c = getopt_long(argc, argv, "hi:Io:Ot:", long_options, 0);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+            case 'h':
+                print_help();
+                exit(exit_code_ok);
+            case 'i':
+                location_index_type = optarg;
+                break;
+            case 'I':
+                std::cout << "Available index types:\n";
+                for (const auto& map_type : map_factory.map_types()) {
+                    std::cout << "  " << map_type;
+                    if (map_type == location_index_type) {
+                        std::cout << " (default)";
+                    }
+                    std::cout << '\n';
+                }
+                exit(exit_code_ok);
+            case 'o':
+                output = optarg;
+                break;
+            case 'O':
+                overwrite = true;
+                break;
+            case 't':
+                num_threads = std::max(1, std::atoi(optarg));
+                break;
+            default:
+                exit(exit_code_cmdline_error);
+        }
+    }
+
+    int remaining_args = argc - optind;
+    if (remaining_args != 1) {
+        std::cerr << "Usage: " << argv[0] << " [OPTIONS] OSMFILE\n";
+        exit(exit_code_cmdline_error);
+    }
+
+    if (overwrite) {
+        unlink(output.c_str());
+    }
+
+    auto location_index = map_factory.create_map(location_index_type);
+    location_handler_type location_handler(*location_index);
+    location_handler.ignore_errors();
+
+    const osmium::io::File input_file(argv[optind]);
+
+    osmium::area::Assembler::config_type assembler_config;
+    collector_type collector(assembler_config);
+
+    // only boundary relations and their member ways and closed boundary
+    // ways are read, so nothing else is ever assembled
+    AreaFilter filter;
+    filter.add("boundary=administrative");
+    IdSet member_ways;
+
+    vout << "Starting first pass (reading relations)...\n";
+    osmium::io::Reader reader1(input_file, osmium::osm_entity_bits::relation);
+    FilteringReader<SelectedRelations> source1{reader1, SelectedRelations{filter, member_ways}};
+    collector.read_relations(source1);
+    reader1.close();
+    member_ways.sort();
+    vout << "First pass done.\n";
+
+    BoundaryList list;
+
+    vout << "Starting second pass (reading nodes and ways and assembling areas)...\n";
+    osmium::io::Reader reader2(input_file, entity_bits(location_index_type));
+    FilteringReader<SelectedWays> source2{reader2, SelectedWays{filter, member_ways}};
+    auto handler = collector.handler([&list](osmium::memory::Buffer&& buffer) {
+        for (const auto& area : buffer.select<osmium::Area>()) {
+            list.add(area);
+        }
+    });
+    if (location_index_type == "none") {
+        osmium::apply(source2, handler);
+    } else {
+        osmium::apply(source2, location_handler, handler);
+    }
+    reader2.close();
+    vout << "Second pass done.\n";
+
+    vout << "Found " << list.boundaries().size() << " boundaries with " << list.num_points() << " points.\n";
+
+    vout << "Building spatial index...\n";
+    std::vector<rtree_box> boxes;
+    boxes.reserve(list.boundaries().size());
+    for (const auto& b : list.boundaries()) {
+        boxes.push_back(b.box);
+    }
+    const PackedRTree tree{boxes};
+
+    vout << "Finding parents with " << num_threads << " threads...\n";
+    const auto parents = find_parents(list, tree, num_threads);
+
+    vout << "Writing parents to database...\n";
+    write_parents(output, list, parents);
+
+    osmium::MemoryUsage mcheck;
+    vout << "Actual memory usage:\n"
+         << "  current: " << mcheck.current() << "MB\n"
+         << "  peak:    " << mcheck.peak() << "MB\n";
+
+    vout << "Done.\n";
+
+    return exit_code_ok;
+}
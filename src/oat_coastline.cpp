@@ -0,0 +1,360 @@
+/*****************************************************************************
+
+  OSM Area Tools - Coastline
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <gdalcpp.hpp>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/geom/ogr.hpp>
+#include <osmium/index/map/dummy.hpp>
+#include <osmium/index/node_locations_map.hpp>
+#include <osmium/io/any_input.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/area.hpp>
+#include <osmium/util/memory.hpp>
+#include <osmium/util/verbose_output.hpp>
+
+#include "oat.hpp"
+#include "oat_area_filter.hpp"
+#include "oat_area_store.hpp"
+#include "oat_coastline.hpp"
+#include "oat_index_tuning.hpp"
+#include "oat_second_pass.hpp"
+
+REGISTER_MAP(osmium::unsigned_object_id_type, osmium::Location, osmium::index::map::Dummy, none)
+
+void print_help() {
+    std::cout << "oat_coastline [OPTIONS] OSMFILE\n\n"
+              << "Read OSMFILE and build land polygons from the natural=coastline ways in it.\n"
+              << "\nOptions:\n"
+              << "  -a, --index-advice=SPEC      Set paging advice for location index (see below)\n"
+              << "  -b, --output-store=DIR       Write land polygons to memory mappable store in DIR\n"
+              << "  -g, --grid-size=DEGREES      Split polygons along a grid of this size (default: 1)\n"
+              << "  -h, --help                   This help message\n"
+              << "  -i, --index=INDEX_TYPE       Set index type for location index (default: sparse_mmap_array)\n"
+              << "  -I, --show-index-types       Show available index types for location index\n"
+              << "  -L, --lock-index[=MB]        Lock (MB of) location index into memory for lookups\n"
+              << "  -n, --max-points=N           Split polygons with more than N points (default: 1000)\n"
+              << "  -o, --output=DBNAME          Database name\n"
+              << "  -O, --overwrite              Overwrite existing database\n"
+              << "\nIndex advice SPEC is a comma-separated list of [PHASE:]ADVICE with PHASE\n"
+              << "'fill' or 'lookup' and ADVICE one of 'normal', 'random', 'sequential',\n"
+              << "'willneed', 'hugepage', or 'nohugepage'.\n"
+              ;
+}
+
+osmium::osm_entity_bits::type entity_bits(const std::string& location_index_type) {
+    if (location_index_type == "none") {
+        return osmium::osm_entity_bits::way;
+    } else {
+        return osmium::osm_entity_bits::way | osmium::osm_entity_bits::node;
+    }
+}
+
+template <typename TBuilder>
+void add_ring(TBuilder& builder, const CoastlineAssembler::ring& ring) {
+    for (std::size_t i = 0; i < ring.x.size(); ++i) {
+        builder.add_node_ref(0, osmium::Location{ring.x[i], ring.y[i]});
+    }
+}
+
+/**
+ * Build an area from the land polygon. It gets the id an area created from
+ * the first way of the outer ring would get.
+ */
+const osmium::Area& build_area(osmium::memory::Buffer& buffer, const CoastlineAssembler& assembler, const CoastlineAssembler::polygon& polygon) {
+    const auto& outer = assembler.rings()[polygon.outer];
+    buffer.clear();
+    {
+        osmium::builder::AreaBuilder builder{buffer};
+        builder.set_id(osmium::object_id_to_area_id(outer.way_id, osmium::item_type::way));
+        {
+            osmium::builder::OuterRingBuilder ring_builder{builder};
+            add_ring(ring_builder, outer);
+        }
+        for (const uint32_t inner : polygon.inners) {
+            osmium::builder::InnerRingBuilder ring_builder{builder};
+            add_ring(ring_builder, assembler.rings()[inner]);
+        }
+    }
+    return buffer.get<osmium::Area>(buffer.commit());
+}
+
+int main(int argc, char* argv[]) {
+    osmium::util::VerboseOutput vout{true};
+
+    static const struct option long_options[] = {
+        {"index-advice",    required_argument, 0, 'a'},
+        {"output-store",    required_argument, 0, 'b'},
+        {"grid-size",       required_argument, 0, 'g'},
+        {"help",            no_argument,       0, 'h'},
+        {"index",           required_argument, 0, 'i'},
+        {"show-index",      no_argument,       0, 'I'},
+        {"lock-index",      optional_argument, 0, 'L'},
+        {"max-points",      required_argument, 0, 'n'},
+        {"output",          required_argument, 0, 'o'},
+        {"overwrite",       no_argument,       0, 'O'},
+        {0, 0, 0, 0}
+    };
+
+    std::string database_name;
+    std::string store_directory;
+
+    std::string location_index_type = "sparse_mmap_array";
+    const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance();
+
+    IndexTuning index_tuning;
+
+    double grid_size = 1.0;
+    std::size_t max_points = 1000;
+    bool overwrite = false;
+
+    while (true) {
+        int c = getopt_long(argc, argv, "a:b:g:hi:IL::n:o:O", long_options, 0);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+            case 'a':
+                try {
+                    index_tuning.set_advice(optarg);
+                } catch (const std::runtime_error& e) {
+                    std::cerr << e.what() << '\n';
+                    exit(exit_code_cmdline_error);
+                }
+                break;
+            case 'b':
+                store_directory = optarg;
+                break;
+            case 'g': {
+                char* end = nullptr;
+                grid_size = std::strtod(optarg, &end);
+                if (*end != '\0' || !(grid_size > 0)) {
+                    std::cerr << "Invalid grid size '" << optarg << "' (use number of degrees > 0)\n";
+                    exit(exit_code_cmdline_error);
+                }
+                break;
+            }
+            case 'h':
+                print_help();
+                exit(exit_code_ok);
+            case 'i':
+                location_index_type = optarg;
+                break;
+            case 'I':
+                std::cout << "Available index types:\n";
+                for (const auto& map_type : map_factory.map_types()) {
+                    std::cout << "  " << map_type;
+                    if (map_type == location_index_type) {
+                        std::cout << " (default)";
+                    }
+                    std::cout << '\n';
+                }
+                exit(exit_code_ok);
+            case 'L':
+                if (optarg) {
+                    if (!index_tuning.parse_mlock(optarg)) {
+                        std::cerr << "Invalid lock size '" << optarg << "' (use number of megabytes > 0)\n";
+                        exit(exit_code_cmdline_error);
+                    }
+                } else {
+                    index_tuning.set_mlock_all();
+                }
+                break;
+            case 'n': {
+                char* end = nullptr;
+                max_points = std::strtoul(optarg, &end, 10);
+                if (!std::isdigit(static_cast<unsigned char>(*optarg)) || *end != '\0' || max_points < 4) {
+                    std::cerr << "Invalid number of points '" << optarg << "' (use number >= 4)\n";
+                    exit(exit_code_cmdline_error);
+                }
+                break;
+            }
+            case 'o':
+                database_name = optarg;
+                break;
+            case 'O':
+                overwrite = true;
+                break;
+            default:
+                exit(exit_code_cmdline_error);
+        }
+    }
+
+    int remaining_args = argc - optind;
+    if (remaining_args != 1) {
+        std::cerr << "Usage: " << argv[0] << " [OPTIONS] OSMFILE\n";
+        exit(exit_code_cmdline_error);
+    }
+
+    if (!map_factory.has_map_type(location_index_type)) {
+        std::cerr << "Unknown index type '" << location_index_type << "' (use --show-index-types to list them)\n";
+        exit(exit_code_cmdline_error);
+    }
+
+    const unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    SecondPass second_pass{location_index_type, index_tuning, vout, num_threads};
+
+    const osmium::io::File input_file(argv[optind]);
+
+    std::unique_ptr<AreaStoreWriter> store{nullptr};
+    if (!store_directory.empty()) {
+        if (::mkdir(store_directory.c_str(), 0777) != 0 && errno != EEXIST) {
+            std::cerr << "Can not create directory '" << store_directory << "': " << std::strerror(errno) << '\n';
+            exit(exit_code_error);
+        }
+        try {
+            store.reset(new AreaStoreWriter{store_directory + "/areas.store"});
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            exit(exit_code_error);
+        }
+    }
+
+    CoastlineAssembler assembler;
+    {
+        CoastlineCollector collector;
+
+        vout << "Reading nodes and coastline ways...\n";
+        osmium::io::Reader reader(input_file, entity_bits(location_index_type));
+        FilteringReader<CoastlineWays> source{reader, CoastlineWays{}};
+        second_pass(source, collector);
+        reader.close();
+        vout << "Found " << collector.ways().size() << " coastline ways with "
+             << collector.locations().size() << " nodes.\n";
+        vout << "Ways ignored because of missing node locations: " << collector.invalid() << '\n';
+
+        vout << "Memory:\n";
+        vout << "  coastline ways: " << (collector.used_memory() / 1024) << "kB\n";
+
+        vout << "Joining ways and assembling land polygons...\n";
+        assembler(collector, num_threads);
+    }
+
+    vout << "Closed rings: " << assembler.rings().size() << '\n';
+    vout << "Rings ignored because they have no area: " << assembler.degenerate() << '\n';
+    vout << "Land polygons: " << assembler.polygons().size() << '\n';
+    vout << "Water rings not inside land: " << assembler.water_outside() << '\n';
+    vout << "Open ends: " << assembler.open_ends().size() << '\n';
+
+    osmium::memory::Buffer buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+
+    if (database_name.empty()) {
+        for (const auto& open_end : assembler.open_ends()) {
+            std::cerr << "Warning! Coastline not closed at node " << open_end.node_id
+                      << " (" << (open_end.is_start ? "start" : "end") << " of way " << open_end.way_id
+                      << ") at " << open_end.location << '\n';
+        }
+        if (store) {
+            for (const auto& polygon : assembler.polygons()) {
+                store->add(build_area(buffer, assembler, polygon));
+            }
+        }
+    } else {
+        if (overwrite) {
+            unlink(database_name.c_str());
+        }
+
+        CPLSetConfigOption("OGR_SQLITE_SYNCHRONOUS", "OFF");
+        osmium::geom::OGRFactory<> factory;
+
+        gdalcpp::Dataset dataset{"SQLite", database_name, gdalcpp::SRS{factory.proj_string()}, { "SPATIALITE=TRUE", "INIT_WITH_EPSG=NO" }};
+        dataset.enable_auto_transactions();
+
+        dataset.exec("PRAGMA journal_mode = OFF;");
+
+        gdalcpp::Layer layer_land{dataset, "land_polygons", wkbPolygon};
+        layer_land.add_field("way_id", OFTInteger, 10);
+
+        gdalcpp::Layer layer_open_ends{dataset, "open_ends", wkbPoint};
+        layer_open_ends.add_field("node_id", OFTReal, 12, 1);
+        layer_open_ends.add_field("way_id", OFTInteger, 10);
+        layer_open_ends.add_field("end", OFTString, 5);
+
+        for (const auto& open_end : assembler.open_ends()) {
+            gdalcpp::Feature feature{layer_open_ends, factory.create_point(open_end.location)};
+            feature.set_field("node_id", static_cast<double>(open_end.node_id));
+            feature.set_field("way_id", static_cast<int32_t>(open_end.way_id));
+            feature.set_field("end", open_end.is_start ? "start" : "end");
+            feature.add_to_layer();
+        }
+
+        vout << "Splitting land polygons...\n";
+        std::size_t pieces = 0;
+        const auto write_piece = [&layer_land, &pieces](LandSplitter::result& result) {
+            gdalcpp::Feature feature{layer_land, std::move(result.polygon)};
+            feature.set_field("way_id", static_cast<int32_t>(result.id));
+            feature.add_to_layer();
+            ++pieces;
+        };
+
+        try {
+            LandSplitter splitter{grid_size, max_points, num_threads};
+            for (const auto& polygon : assembler.polygons()) {
+                const osmium::Area& area = build_area(buffer, assembler, polygon);
+                if (store) {
+                    store->add(area);
+                }
+                try {
+                    const auto geometry = factory.create_multipolygon(area);
+                    splitter.add(assembler.rings()[polygon.outer].way_id, *geometry);
+                } catch (const osmium::geometry_error& e) {
+                    std::cerr << "Ignoring illegal geometry for land polygon with way " << assembler.rings()[polygon.outer].way_id << ": " << e.what() << '\n';
+                }
+                splitter.drain(write_piece);
+            }
+            splitter.finish(write_piece);
+            vout << "Pieces that could not be split: " << splitter.failed() << '\n';
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            exit(exit_code_error);
+        }
+        vout << "Wrote " << pieces << " land polygon pieces.\n";
+    }
+
+    if (store) {
+        vout << "Writing index of area store...\n";
+        try {
+            store->close();
+        } catch (const std::system_error& e) {
+            std::cerr << e.what() << '\n';
+            exit(exit_code_error);
+        }
+        vout << "Wrote " << store->size() << " land polygons to store.\n";
+    }
+
+    vout << "Estimated memory usage:\n";
+    vout << "  location index: " << (second_pass.index_memory() / 1024) << "kB\n";
+
+    osmium::MemoryUsage mcheck;
+    vout << "Actual memory usage:\n"
+         << "  current: " << mcheck.current() << "MB\n"
+         << "  peak:    " << mcheck.peak() << "MB\n";
+
+    vout << "Done.\n";
+
+    return exit_code_ok;
+}
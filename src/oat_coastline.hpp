@@ -0,0 +1,641 @@
+#ifndef OAT_COASTLINE_HPP
+#define OAT_COASTLINE_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Assemble land polygons from coastline ways
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <ogr_geometry.h>
+
+#include <osmium/handler.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "oat_area_rings.hpp"
+#include "oat_rtree.hpp"
+#include "oat_work_queue.hpp"
+
+/**
+ * Predicate for FilteringReader: Keeps all nodes and the ways tagged
+ * natural=coastline.
+ */
+class CoastlineWays {
+
+public:
+
+    bool operator()(const osmium::OSMObject& object) const {
+        if (object.type() != osmium::item_type::way) {
+            return true;
+        }
+        const char* natural = object.tags().get_value_by_key("natural");
+        return natural && !std::strcmp(natural, "coastline");
+    }
+
+}; // class CoastlineWays
+
+/**
+ * Handler collecting the node locations of all coastline ways. Only the
+ * ids of the first and last node of each way are kept, they are all that
+ * is needed to join the ways.
+ */
+class CoastlineCollector : public osmium::handler::Handler {
+
+public:
+
+    struct way_info {
+        osmium::object_id_type id;
+        osmium::object_id_type first_node;
+        osmium::object_id_type last_node;
+
+        // range of the locations of this way in locations()
+        std::size_t begin;
+        std::size_t end;
+    };
+
+private:
+
+    std::vector<way_info> m_ways;
+    std::vector<osmium::Location> m_locations;
+    std::size_t m_invalid = 0;
+
+public:
+
+    void way(const osmium::Way& way) {
+        const auto& nodes = way.nodes();
+        if (nodes.size() < 2) {
+            ++m_invalid;
+            return;
+        }
+        const std::size_t begin = m_locations.size();
+        for (const auto& node_ref : nodes) {
+            if (!node_ref.location().valid()) {
+                m_locations.resize(begin);
+                ++m_invalid;
+                return;
+            }
+            m_locations.push_back(node_ref.location());
+        }
+        m_ways.push_back(way_info{way.id(), nodes.front().ref(), nodes.back().ref(), begin, m_locations.size()});
+    }
+
+    const std::vector<way_info>& ways() const noexcept {
+        return m_ways;
+    }
+
+    const std::vector<osmium::Location>& locations() const noexcept {
+        return m_locations;
+    }
+
+    /**
+     * The number of ways ignored because they have less than two nodes
+     * or nodes without locations.
+     */
+    std::size_t invalid() const noexcept {
+        return m_invalid;
+    }
+
+    std::size_t used_memory() const noexcept {
+        return m_ways.capacity() * sizeof(way_info) +
+               m_locations.capacity() * sizeof(osmium::Location);
+    }
+
+}; // class CoastlineCollector
+
+/**
+ * Joins the coastline ways into rings and assembles land polygons from
+ * them.
+ *
+ * Ways are joined at their end nodes using a hash map from the id of the
+ * first node of each way to the way. Coastline ways have the land on
+ * their left side, so closed rings running counterclockwise are the outer
+ * rings of land polygons. Clockwise rings are water enclosed by land, they
+ * become inner rings of the smallest land ring they are in. Chains of ways
+ * that don't close are not used, their ends are reported as open ends.
+ */
+class CoastlineAssembler {
+
+public:
+
+    struct ring {
+        std::vector<int32_t> x;
+        std::vector<int32_t> y;
+        rtree_box box;
+
+        // twice the signed area, positive for counterclockwise rings
+        double area = 0.0;
+
+        // id of the first way of the ring and the number of ways in it
+        osmium::object_id_type way_id = 0;
+        std::size_t num_ways = 0;
+    };
+
+    struct polygon {
+        uint32_t outer;
+        std::vector<uint32_t> inners;
+    };
+
+    struct open_end {
+        osmium::Location location;
+        osmium::object_id_type node_id;
+        osmium::object_id_type way_id;
+
+        // true for the first node of a chain, false for the last
+        bool is_start;
+    };
+
+private:
+
+    enum : uint32_t {
+        no_way = static_cast<uint32_t>(-1)
+    };
+
+    std::vector<ring> m_rings;
+    std::vector<polygon> m_polygons;
+    std::vector<open_end> m_open_ends;
+    std::size_t m_degenerate = 0;
+    std::size_t m_water_outside = 0;
+
+    static double twice_area(const ring& r) noexcept {
+        double sum = 0.0;
+        const int64_t x0 = r.x.front();
+        const int64_t y0 = r.y.front();
+        for (std::size_t i = 1; i + 1 < r.x.size(); ++i) {
+            sum += double(r.x[i] - x0) * double(r.y[i + 1] - y0) -
+                   double(r.x[i + 1] - x0) * double(r.y[i] - y0);
+        }
+        return sum;
+    }
+
+    void add_ring(const CoastlineCollector& collector, const std::vector<uint32_t>& chain) {
+        ring r;
+        r.way_id = collector.ways()[chain.front()].id;
+        r.num_ways = chain.size();
+        for (const uint32_t w : chain) {
+            const auto& way = collector.ways()[w];
+            // the first node of each way is the last node of the one before
+            for (std::size_t i = way.begin + (r.x.empty() ? 0 : 1); i < way.end; ++i) {
+                const auto& location = collector.locations()[i];
+                r.x.push_back(location.x());
+                r.y.push_back(location.y());
+                r.box.extend(location.x(), location.y());
+            }
+        }
+        r.area = r.x.size() < 4 ? 0.0 : twice_area(r);
+        if (r.area == 0.0) {
+            ++m_degenerate;
+            return;
+        }
+        m_rings.push_back(std::move(r));
+    }
+
+    void add_open_chain(const CoastlineCollector& collector, const std::vector<uint32_t>& chain) {
+        const auto& first = collector.ways()[chain.front()];
+        const auto& last = collector.ways()[chain.back()];
+        m_open_ends.push_back(open_end{collector.locations()[first.begin], first.first_node, first.id, true});
+        m_open_ends.push_back(open_end{collector.locations()[last.end - 1], last.last_node, last.id, false});
+    }
+
+    // is the inner ring inside the outer ring? The rings don't cross, so
+    // the first point not on the outer ring decides.
+    static bool is_inside(const ring& outer, const ring& inner) noexcept {
+        for (std::size_t i = 0; i < inner.x.size(); ++i) {
+            const auto position = point_in_ring(outer.x.data(), outer.y.data(), outer.x.size(), inner.x[i], inner.y[i]);
+            if (position != point_position::boundary) {
+                return position == point_position::inside;
+            }
+        }
+        return true;
+    }
+
+    void join(const CoastlineCollector& collector) {
+        const auto& ways = collector.ways();
+
+        std::unordered_map<osmium::object_id_type, uint32_t> starts;
+        starts.reserve(ways.size());
+        for (uint32_t w = 0; w < ways.size(); ++w) {
+            starts.emplace(ways[w].first_node, w);
+        }
+
+        std::vector<uint32_t> next(ways.size(), no_way);
+        std::vector<bool> has_predecessor(ways.size(), false);
+        for (uint32_t w = 0; w < ways.size(); ++w) {
+            const auto it = starts.find(ways[w].last_node);
+            if (it != starts.end()) {
+                next[w] = it->second;
+                has_predecessor[it->second] = true;
+            }
+        }
+
+        std::vector<bool> used(ways.size(), false);
+        std::vector<uint32_t> chain;
+        const auto follow = [&](uint32_t start) {
+            chain.clear();
+            uint32_t w = start;
+            do {
+                used[w] = true;
+                chain.push_back(w);
+                w = next[w];
+            } while (w != no_way && !used[w]);
+            if (w == start) {
+                add_ring(collector, chain);
+            } else {
+                add_open_chain(collector, chain);
+            }
+        };
+
+        // chains starting with a way nothing connects to are open, all
+        // others are rings (unless several ways end at the same node)
+        for (uint32_t w = 0; w < ways.size(); ++w) {
+            if (!has_predecessor[w] && !used[w]) {
+                follow(w);
+            }
+        }
+        for (uint32_t w = 0; w < ways.size(); ++w) {
+            if (!used[w]) {
+                follow(w);
+            }
+        }
+    }
+
+    void assign_inner_rings(unsigned int num_threads) {
+        std::vector<uint32_t> outers;
+        std::vector<uint32_t> inners;
+        std::vector<rtree_box> boxes;
+        for (uint32_t n = 0; n < m_rings.size(); ++n) {
+            if (m_rings[n].area > 0) {
+                outers.push_back(n);
+                boxes.push_back(m_rings[n].box);
+            } else {
+                inners.push_back(n);
+            }
+        }
+        const PackedRTree tree{boxes};
+
+        // testing the points of an inner ring against a continent is slow,
+        // so the inner rings are distributed over several threads
+        std::vector<uint32_t> containing(inners.size(), no_way);
+        std::atomic<std::size_t> next_inner{0};
+        const auto worker = [&]() {
+            std::size_t i;
+            while ((i = next_inner++) < inners.size()) {
+                const ring& inner = m_rings[inners[i]];
+                uint32_t best = no_way;
+                tree.search(inner.box, [&](uint32_t index) {
+                    const ring& outer = m_rings[outers[index]];
+                    if (outer.box.contains(inner.box.min_x, inner.box.min_y) &&
+                        outer.box.contains(inner.box.max_x, inner.box.max_y) &&
+                        (best == no_way || outer.area < m_rings[outers[best]].area) &&
+                        is_inside(outer, inner)) {
+                        best = index;
+                    }
+                });
+                containing[i] = best;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned int t = 1; t < num_threads; ++t) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        m_polygons.reserve(outers.size());
+        for (const uint32_t outer : outers) {
+            m_polygons.push_back(polygon{outer, {}});
+        }
+        for (std::size_t i = 0; i < inners.size(); ++i) {
+            if (containing[i] == no_way) {
+                ++m_water_outside;
+            } else {
+                m_polygons[containing[i]].inners.push_back(inners[i]);
+            }
+        }
+    }
+
+public:
+
+    /**
+     * Join the ways from the collector and assemble the land polygons.
+     */
+    void operator()(const CoastlineCollector& collector, unsigned int num_threads) {
+        join(collector);
+        assign_inner_rings(num_threads);
+    }
+
+    const std::vector<ring>& rings() const noexcept {
+        return m_rings;
+    }
+
+    const std::vector<polygon>& polygons() const noexcept {
+        return m_polygons;
+    }
+
+    const std::vector<open_end>& open_ends() const noexcept {
+        return m_open_ends;
+    }
+
+    /**
+     * The number of closed rings ignored because they have less than
+     * four points or no area.
+     */
+    std::size_t degenerate() const noexcept {
+        return m_degenerate;
+    }
+
+    /**
+     * The number of clockwise rings not inside any land polygon.
+     */
+    std::size_t water_outside() const noexcept {
+        return m_water_outside;
+    }
+
+}; // class CoastlineAssembler
+
+/**
+ * Splits land polygons into smaller pieces in several threads. A polygon
+ * with more than max_points points is cut in two halves along the line of
+ * the grid nearest to the middle of the longer side of its bounding box.
+ * The halves are queued again, so pieces of the same polygon are split in
+ * parallel. Pieces within one grid cell are never split any further.
+ */
+class LandSplitter {
+
+public:
+
+    struct result {
+        osmium::object_id_type id;
+        std::unique_ptr<OGRPolygon> polygon;
+    };
+
+private:
+
+    struct job {
+        osmium::object_id_type id;
+        std::unique_ptr<OGRPolygon> polygon;
+    };
+
+    double m_grid_size;
+    std::size_t m_max_points;
+
+    // halves are queued by the workers themselves, so this queue can't be
+    // bounded and has to know when no more jobs can come
+    std::mutex m_jobs_mutex;
+    std::condition_variable m_jobs_changed;
+    std::deque<job> m_jobs;
+    std::size_t m_pending = 0;
+    bool m_closed = false;
+
+    WorkQueue<result> m_results;
+
+    std::atomic<std::size_t> m_failed{0};
+
+    // first error in one of the worker threads, rethrown by drain()
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error{nullptr};
+
+    std::vector<std::thread> m_threads;
+
+    static std::size_t num_points(const OGRPolygon& polygon) {
+        std::size_t points = polygon.getExteriorRing()->getNumPoints();
+        for (int i = 0; i < polygon.getNumInteriorRings(); ++i) {
+            points += polygon.getInteriorRing(i)->getNumPoints();
+        }
+        return points;
+    }
+
+    void push_job(job&& j) {
+        {
+            std::lock_guard<std::mutex> lock{m_jobs_mutex};
+            m_jobs.push_back(std::move(j));
+            ++m_pending;
+        }
+        m_jobs_changed.notify_one();
+    }
+
+    bool pop_job(job& j) {
+        std::unique_lock<std::mutex> lock{m_jobs_mutex};
+        m_jobs_changed.wait(lock, [this] {
+            return !m_jobs.empty() || (m_closed && m_pending == 0);
+        });
+        if (m_jobs.empty()) {
+            return false;
+        }
+        j = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        return true;
+    }
+
+    void job_done() {
+        bool all_done;
+        {
+            std::lock_guard<std::mutex> lock{m_jobs_mutex};
+            all_done = --m_pending == 0 && m_closed;
+        }
+        if (all_done) {
+            m_jobs_changed.notify_all();
+        }
+    }
+
+    // queue all polygons in the geometry for splitting
+    void add_parts(osmium::object_id_type id, OGRGeometry& geometry) {
+        const auto type = wkbFlatten(geometry.getGeometryType());
+        if (geometry.IsEmpty()) {
+            return;
+        }
+        if (type == wkbPolygon) {
+            push_job(job{id, std::unique_ptr<OGRPolygon>{static_cast<OGRPolygon*>(geometry.clone())}});
+        } else if (type == wkbMultiPolygon || type == wkbGeometryCollection) {
+            auto& collection = static_cast<OGRGeometryCollection&>(geometry);
+            for (int i = 0; i < collection.getNumGeometries(); ++i) {
+                add_parts(id, *collection.getGeometryRef(i));
+            }
+        }
+    }
+
+    // find the grid line nearest to the middle between min and max, returns
+    // false if there is none between them
+    bool split_line(double min, double max, double& line) const noexcept {
+        const double middle = (min + max) / 2;
+        const double below = std::floor(middle / m_grid_size) * m_grid_size;
+        const double above = below + m_grid_size;
+        const bool below_ok = below > min;
+        const bool above_ok = above < max;
+        if (below_ok && (!above_ok || middle - below <= above - middle)) {
+            line = below;
+            return true;
+        }
+        if (above_ok) {
+            line = above;
+            return true;
+        }
+        return false;
+    }
+
+    static std::unique_ptr<OGRPolygon> rectangle(double min_x, double min_y, double max_x, double max_y) {
+        OGRLinearRing ring;
+        ring.addPoint(min_x, min_y);
+        ring.addPoint(max_x, min_y);
+        ring.addPoint(max_x, max_y);
+        ring.addPoint(min_x, max_y);
+        ring.addPoint(min_x, min_y);
+        std::unique_ptr<OGRPolygon> polygon{new OGRPolygon};
+        polygon->addRing(&ring);
+        return polygon;
+    }
+
+    void split(job&& j) {
+        if (num_points(*j.polygon) <= m_max_points) {
+            m_results.push(result{j.id, std::move(j.polygon)});
+            return;
+        }
+
+        OGREnvelope envelope;
+        j.polygon->getEnvelope(&envelope);
+
+        double line;
+        bool vertical = envelope.MaxX - envelope.MinX >= envelope.MaxY - envelope.MinY;
+        if (!split_line(vertical ? envelope.MinX : envelope.MinY, vertical ? envelope.MaxX : envelope.MaxY, line)) {
+            vertical = !vertical;
+            if (!split_line(vertical ? envelope.MinX : envelope.MinY, vertical ? envelope.MaxX : envelope.MaxY, line)) {
+                m_results.push(result{j.id, std::move(j.polygon)});
+                return;
+            }
+        }
+
+        const auto first = vertical ? rectangle(envelope.MinX, envelope.MinY, line, envelope.MaxY)
+                                    : rectangle(envelope.MinX, envelope.MinY, envelope.MaxX, line);
+        const auto second = vertical ? rectangle(line, envelope.MinY, envelope.MaxX, envelope.MaxY)
+                                     : rectangle(envelope.MinX, line, envelope.MaxX, envelope.MaxY);
+
+        std::unique_ptr<OGRGeometry> first_part{j.polygon->Intersection(first.get())};
+        std::unique_ptr<OGRGeometry> second_part{j.polygon->Intersection(second.get())};
+        if (!first_part || !second_part) {
+            // GEOS failed, for instance because the polygon is invalid
+            ++m_failed;
+            m_results.push(result{j.id, std::move(j.polygon)});
+            return;
+        }
+        add_parts(j.id, *first_part);
+        add_parts(j.id, *second_part);
+    }
+
+    void worker() {
+        job j;
+        while (pop_job(j)) {
+            try {
+                split(std::move(j));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{m_error_mutex};
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+            job_done();
+        }
+    }
+
+    void check_error() {
+        std::lock_guard<std::mutex> lock{m_error_mutex};
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock{m_jobs_mutex};
+            m_closed = true;
+        }
+        m_jobs_changed.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+        m_threads.clear();
+    }
+
+public:
+
+    /**
+     * The grid size is in degrees.
+     */
+    LandSplitter(double grid_size, std::size_t max_points, unsigned int num_threads) :
+        m_grid_size(grid_size),
+        m_max_points(max_points),
+        m_results(static_cast<std::size_t>(-1)) {
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            m_threads.emplace_back(&LandSplitter::worker, this);
+        }
+    }
+
+    LandSplitter(const LandSplitter&) = delete;
+    LandSplitter& operator=(const LandSplitter&) = delete;
+
+    ~LandSplitter() {
+        close();
+    }
+
+    /**
+     * Queue all polygons in the geometry for splitting.
+     */
+    void add(osmium::object_id_type id, OGRGeometry& geometry) {
+        add_parts(id, geometry);
+    }
+
+    /**
+     * The number of pieces that could not be split because the
+     * intersection failed. They are returned unsplit.
+     */
+    std::size_t failed() const noexcept {
+        return m_failed;
+    }
+
+    /**
+     * Call func(result&) for all results available now.
+     */
+    template <typename TFunc>
+    void drain(TFunc&& func) {
+        check_error();
+        result r;
+        while (m_results.try_pop(r)) {
+            func(r);
+        }
+    }
+
+    /**
+     * Wait for all queued polygons to be split and call func(result&)
+     * for all remaining results.
+     */
+    template <typename TFunc>
+    void finish(TFunc&& func) {
+        close();
+        drain(std::forward<TFunc>(func));
+    }
+
+}; // class LandSplitter
+
+#endif // OAT_COASTLINE_HPP
@@ -6,12 +6,24 @@
 
 *****************************************************************************/
 
+#include <cerrno>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <getopt.h>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 #include <gdalcpp.hpp>
 
+#include <sys/stat.h>
+#include <sys/types.h>
+
 //#define OSMIUM_WITH_TIMER
 
 //#define OSMIUM_AREA_WITH_GEOS
@@ -25,23 +37,27 @@
 #include <osmium/area/problem_reporter_ogr.hpp>
 #include <osmium/area/problem_reporter_stream.hpp>
 #include <osmium/geom/ogr.hpp>
-#include <osmium/handler/dump.hpp>
-#include <osmium/index/map/dense_mem_array.hpp>
-#include <osmium/index/map/dense_mmap_array.hpp>
 #include <osmium/index/map/dummy.hpp>
-#include <osmium/index/map/sparse_mem_array.hpp>
-#include <osmium/index/map/sparse_mmap_array.hpp>
 #include <osmium/index/node_locations_map.hpp>
-#include <osmium/handler/node_locations_for_ways.hpp>
 #include <osmium/io/any_input.hpp>
 #include <osmium/util/memory.hpp>
 #include <osmium/util/verbose_output.hpp>
 #include <osmium/visitor.hpp>
 
 #include "oat.hpp"
-
-using index_type = osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>;
-using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
+#include "oat_area_check.hpp"
+#include "oat_area_dump.hpp"
+#include "oat_area_filter.hpp"
+#include "oat_area_metrics.hpp"
+#include "oat_area_store.hpp"
+#include "oat_geojson.hpp"
+#include "oat_assembly_guard.hpp"
+#include "oat_index_tuning.hpp"
+#include "oat_problem_sink.hpp"
+#include "oat_ring_hash.hpp"
+#include "oat_second_pass.hpp"
+#include "oat_simplify.hpp"
+#include "oat_tiles.hpp"
 
 REGISTER_MAP(osmium::unsigned_object_id_type, osmium::Location, osmium::index::map::Dummy, none)
 
@@ -51,8 +67,26 @@ class OutputOGR : public osmium::handler::Handler {
 
     gdalcpp::Layer m_layer_multipolygons;
 
+    AreaValidator m_validator;
+    AreaMetrics m_metrics;
+
+    std::unique_ptr<DuplicateFinder> m_duplicates{nullptr};
+
+    std::unique_ptr<ParallelSimplifier> m_simplifier{nullptr};
+    std::vector<std::unique_ptr<gdalcpp::Layer>> m_layers_simplified;
+
+    AreaStoreWriter* m_store = nullptr;
+    TileWriter* m_tiles = nullptr;
+
     bool m_check = false;
+    bool m_check_with_geos = false;
     bool m_only_invalid = false;
+    bool m_with_metrics = false;
+    bool m_with_problems = false;
+
+    // number of areas not written because they were found to be valid
+    // before their geometry was created
+    uint64_t m_screened_out = 0;
 
     static void print_area_error(const osmium::Area& area, const osmium::geometry_error& e) {
         std::cerr << "Ignoring illegal geometry for area "
@@ -63,6 +97,57 @@ class OutputOGR : public osmium::handler::Handler {
                   << area.orig_id() << " (" << e.what() << ").\n";
     }
 
+    template <typename TGeom>
+    static bool check_with_geos(TGeom& geom) {
+#ifdef OSMIUM_AREA_WITH_GEOS
+        auto geosgeom = geom.exportToGEOS();
+        geos::operation::valid::IsValidOp ivo(reinterpret_cast<const geos::geom::Geometry *>(geosgeom));
+        ivo.setSelfTouchingRingFormingHoleValid(true);
+        const bool is_valid = ivo.isValid();
+        if (!is_valid) {
+            auto error = ivo.getValidationError();
+            std::cerr << "GEOS ERROR: " << error->toString() << '\n';
+        }
+        return is_valid;
+#else
+        return geom.IsValid();
+#endif
+    }
+
+    static std::unique_ptr<OGRMultiPolygon> create_multipolygon(const AreaSimplifier::result& simplified) {
+        std::unique_ptr<OGRMultiPolygon> multipolygon{new OGRMultiPolygon{}};
+        std::unique_ptr<OGRPolygon> polygon{nullptr};
+        for (const auto& r : simplified.rings) {
+            if (r.is_outer) {
+                if (polygon) {
+                    multipolygon->addGeometryDirectly(polygon.release());
+                }
+                polygon.reset(new OGRPolygon{});
+            }
+            OGRLinearRing ring;
+            for (uint32_t i = r.first; i < r.last; ++i) {
+                const osmium::Location location{simplified.x[i], simplified.y[i]};
+                ring.addPoint(location.lon(), location.lat());
+            }
+            polygon->addRing(&ring);
+        }
+        if (polygon) {
+            multipolygon->addGeometryDirectly(polygon.release());
+        }
+        return multipolygon;
+    }
+
+    void write_simplified(const ParallelSimplifier::result& result) {
+        for (std::size_t n = 0; n < result.levels.size(); ++n) {
+            if (result.levels[n].empty()) {
+                continue;
+            }
+            gdalcpp::Feature feature{*m_layers_simplified[n], create_multipolygon(result.levels[n])};
+            feature.set_field("id", static_cast<int32_t>(result.id));
+            feature.add_to_layer();
+        }
+    }
+
 public:
 
     OutputOGR(gdalcpp::Dataset& dataset, osmium::geom::OGRFactory<>& factory) :
@@ -72,33 +157,145 @@ public:
         m_layer_multipolygons.add_field("valid", OFTInteger, 1);
         m_layer_multipolygons.add_field("source", OFTString, 1);
         m_layer_multipolygons.add_field("orig_id", OFTInteger, 10);
+        m_validator.set_threads(std::max(1u, std::thread::hardware_concurrency()));
     }
 
     void set_check(bool check) noexcept {
         m_check = check;
     }
 
+    void set_check_with_geos(bool check_with_geos) noexcept {
+        m_check_with_geos = check_with_geos;
+    }
+
     void set_only_invalid(bool only_invalid) noexcept {
         m_only_invalid = only_invalid;
     }
 
+    /**
+     * Add the columns "area" (in m²), "perimeter" (in m), and "vertices"
+     * to the output. Call before any areas are written.
+     */
+    void enable_metrics() {
+        m_with_metrics = true;
+        m_layer_multipolygons.add_field("area", OFTReal, 20, 2);
+        m_layer_multipolygons.add_field("perimeter", OFTReal, 20, 2);
+        m_layer_multipolygons.add_field("vertices", OFTInteger, 10);
+    }
+
+    /**
+     * Add the column "problem" with the problem the native check found in
+     * invalid areas to the output. Call before any areas are written.
+     */
+    void enable_problems() {
+        m_with_problems = true;
+        m_layer_multipolygons.add_field("problem", OFTString, 24);
+    }
+
+    uint64_t screened_out() const noexcept {
+        return m_screened_out;
+    }
+
+    void set_store(AreaStoreWriter* store) noexcept {
+        m_store = store;
+    }
+
+    void set_tile_writer(TileWriter* tile_writer) noexcept {
+        m_tiles = tile_writer;
+    }
+
+    /**
+     * Write simplified versions of all areas written into additional
+     * layers "areas_simplified_1", "areas_simplified_2", ... one for each
+     * tolerance (in degrees). Call before any areas are written.
+     */
+    void enable_simplify(gdalcpp::Dataset& dataset, const std::vector<double>& tolerances) {
+        std::vector<double> tolerances_in_coordinates;
+        for (std::size_t n = 0; n < tolerances.size(); ++n) {
+            m_layers_simplified.emplace_back(new gdalcpp::Layer{dataset, "areas_simplified_" + std::to_string(n + 1), wkbMultiPolygon, {"SPATIAL_INDEX=NO"}});
+            m_layers_simplified.back()->add_field("id", OFTInteger, 10);
+            tolerances_in_coordinates.push_back(tolerances[n] * 10000000.0);
+        }
+        m_simplifier.reset(new ParallelSimplifier{tolerances_in_coordinates, std::max(1u, std::thread::hardware_concurrency())});
+    }
+
+    /**
+     * Wait until all areas are simplified and write out the rest of the
+     * simplified areas.
+     */
+    void finish_simplify() {
+        if (m_simplifier) {
+            m_simplifier->finish([this](const ParallelSimplifier::result& result) {
+                write_simplified(result);
+            });
+        }
+    }
+
+    void enable_duplicates() {
+        m_duplicates.reset(new DuplicateFinder{});
+    }
+
+    /**
+     * Write all areas that have the same rings as some other area into
+     * the "duplicates" table. Areas with the same hash belong to the same
+     * group. Returns the number of groups found.
+     */
+    std::size_t write_duplicates(gdalcpp::Dataset& dataset) const {
+        assert(m_duplicates);
+        gdalcpp::Layer layer{dataset, "duplicates", wkbNone};
+        layer.add_field("hash", OFTString, 16);
+        layer.add_field("id", OFTInteger, 10);
+        layer.add_field("source", OFTString, 1);
+        layer.add_field("orig_id", OFTInteger, 10);
+        return m_duplicates->for_each_duplicate([&layer](uint64_t hash, const DuplicateFinder::entry& e) {
+            char hash_hex[17];
+            std::snprintf(hash_hex, sizeof(hash_hex), "%016llx", static_cast<unsigned long long>(hash));
+            // no gdalcpp::Feature here, it needs a geometry
+            OGRFeature* feature = OGRFeature::CreateFeature(layer.get().GetLayerDefn());
+            feature->SetField("hash", hash_hex);
+            feature->SetField("id", static_cast<int>(e.id));
+            feature->SetField("source", e.from_way ? "w" : "r");
+            feature->SetField("orig_id", static_cast<int>(e.orig_id));
+            const OGRErr result = layer.get().CreateFeature(feature);
+            OGRFeature::DestroyFeature(feature);
+            if (result != OGRERR_NONE) {
+                throw std::runtime_error{"Can not write into layer 'duplicates'"};
+            }
+        });
+    }
+
     void area(const osmium::Area& area) {
+        if (m_simplifier) {
+            m_simplifier->drain([this](const ParallelSimplifier::result& result) {
+                write_simplified(result);
+            });
+        }
+        if (m_store) {
+            m_store->add(area);
+        }
+        if (m_tiles) {
+            m_tiles->add(area);
+        }
+        if (m_duplicates) {
+            m_duplicates->add(area);
+        }
         try {
             bool is_valid = false;
-            auto geom = m_factory.create_multipolygon(area);
-            if (m_check) {
-#ifdef OSMIUM_AREA_WITH_GEOS
-                auto geosgeom = geom->exportToGEOS();
-                geos::operation::valid::IsValidOp ivo(reinterpret_cast<const geos::geom::Geometry *>(geosgeom));
-                ivo.setSelfTouchingRingFormingHoleValid(true);
-                is_valid = ivo.isValid();
-                if (!is_valid) {
-                    auto error = ivo.getValidationError();
-                    std::cerr << "GEOS ERROR: " << error->toString() << '\n';
+            if (m_only_invalid) {
+                // Most areas are valid, so check them before creating the
+                // geometry. If GEOS is used for checking, only skip those
+                // areas where both checks must come to the same result.
+                is_valid = m_check_with_geos ? m_validator.certainly_valid(area) : m_validator(area);
+                if (is_valid) {
+                    ++m_screened_out;
+                    return;
                 }
-#else
-                is_valid = geom->IsValid();
-#endif
+            }
+            auto geom = m_factory.create_multipolygon(area);
+            if (m_check && m_check_with_geos) {
+                is_valid = check_with_geos(*geom);
+            } else if (m_check && !m_only_invalid) {
+                is_valid = m_validator(area);
             }
             if (m_only_invalid && is_valid) {
                 return;
@@ -108,7 +305,19 @@ public:
             feature.set_field("valid", is_valid);
             feature.set_field("source", area.from_way() ? "w" : "r");
             feature.set_field("orig_id", static_cast<int32_t>(area.orig_id()));
+            if (m_with_problems && !is_valid) {
+                feature.set_field("problem", AreaValidator::problem_name(m_validator.last_problem()));
+            }
+            if (m_with_metrics) {
+                m_metrics(area);
+                feature.set_field("area", m_metrics.area());
+                feature.set_field("perimeter", m_metrics.perimeter());
+                feature.set_field("vertices", static_cast<int32_t>(m_metrics.vertices()));
+            }
             feature.add_to_layer();
+            if (m_simplifier) {
+                m_simplifier->add(area);
+            }
         } catch (osmium::geometry_error& e) {
             print_area_error(area, e);
         }
@@ -121,16 +330,27 @@ void print_help() {
     std::cout << "oat_create_areas [OPTIONS] OSMFILE\n\n"
               << "Read OSMFILE and build multipolygons from it.\n"
               << "\nOptions:\n"
-              << "  -c, --check                  Check geometries\n"
+              << "  -a, --index-advice=SPEC      Set paging advice for location index (see below)\n"
+              << "  -b, --output-store=DIR       Write areas to memory mappable store in DIR\n"
+              << "  -c, --check[=METHOD]         Check geometries (METHOD: native (default), geos)\n"
               << "  -C, --collect-only           Only collect data, don't assemble areas\n"
               << "  -f, --only-invalid           Filter out valid geometries\n"
+              << "  -F, --filter=EXPR            Only assemble areas with tags matching EXPR\n"
+              << "  -g, --simplify=TOLERANCES    Add simplified areas (comma-separated tolerances\n"
+              << "                               in degrees)\n"
+              << "  -G, --output-format=FORMAT   Output format: spatialite (default), geojsonseq\n"
               << "  -d, --debug[=LEVEL]          Set area assembler debug level\n"
               << "  -D, --dump-areas[=FILE]      Dump areas to file (default: stdout)\n"
+              << "  -E, --dump-format=FORMAT     Format for --dump-areas: text (default), opl,\n"
+              << "                               buffers\n"
               << "  -e, --empty-areas            Create empty areas for broken geometries\n"
               << "  -h, --help                   This help message\n"
               << "  -i, --index=INDEX_TYPE       Set index type for location index (default: sparse_mmap_array)\n"
               << "  -I, --show-index-types       Show available index types for location index\n"
-              << "  -o, --output=DBNAME          Database name\n"
+              << "  -L, --lock-index[=MB]        Lock (MB of) location index into memory for lookups\n"
+              << "  -m, --metrics-columns        Add area, perimeter, and vertex count columns\n"
+              << "  -M, --max-assembly-ms=N      Skip relations taking more than N ms to assemble\n"
+              << "  -o, --output=DBNAME          Database name (or GeoJSON file, '-' for stdout)\n"
               << "  -O, --overwrite              Overwrite existing database\n"
               << "  -p, --report-problems[=FILE] Report problems to file (default: stdout)\n"
               << "  -r, --show-incomplete        Show incomplete relations\n"
@@ -138,8 +358,15 @@ void print_help() {
               << "  -s, --no-new-style           Do not output new style multipolygons\n"
               << "  -t, --keep-type-tag          Keep type tag from mp relation (default: false)\n"
               << "  -S, --no-old-style           Do not output old style multipolygons\n"
+              << "  -T, --tiles=MINZ-MAXZ        Clip areas to tiles on zoom levels MINZ to MAXZ\n"
+              << "                               (needs --output-store)\n"
+              << "  -u, --find-duplicates        Find areas with the same rings\n"
               << "  -w, --no-way-polygons        Do not output areas created from ways\n"
               << "  -x, --no-areas               Do not output areas (same as -s -S -w)\n"
+              << "\nFilter EXPR is a comma-separated list of KEY, KEY=*, or KEY=VALUE.\n"
+              << "\nIndex advice SPEC is a comma-separated list of [PHASE:]ADVICE with PHASE\n"
+              << "'fill' or 'lookup' and ADVICE one of 'normal', 'random', 'sequential',\n"
+              << "'willneed', 'hugepage', or 'nohugepage'.\n"
               ;
 }
 
@@ -166,14 +393,21 @@ public:
 
 }; // class DummyAssembler
 
-using collector_type = osmium::area::MultipolygonCollector<osmium::area::Assembler>;
+using collector_type = osmium::area::MultipolygonCollector<TimedAssembler>;
 using collector_only = osmium::area::MultipolygonCollector<DummyAssembler>;
 
+/**
+ * Read relations in the first pass. Only relations matching the filter
+ * (and old-style multipolygons) are given to the collector, the ids of
+ * their member ways are added to member_ways.
+ */
 template <typename TCollector>
-void read_relations(TCollector& collector, const osmium::io::File& file) {
+void read_relations(TCollector& collector, const osmium::io::File& file, const AreaFilter& filter, IdSet& member_ways) {
     osmium::io::Reader reader(file, osmium::osm_entity_bits::relation);
-    collector.read_relations(reader);
+    FilteringReader<SelectedRelations> source{reader, SelectedRelations{filter, member_ways}};
+    collector.read_relations(source);
     reader.close();
+    member_ways.sort();
 }
 
 template <typename TCollector>
@@ -221,6 +455,16 @@ public:
 
 }; // class optional_output
 
+/**
+ * Copy of the buffer, for when it is needed by two outputs.
+ */
+osmium::memory::Buffer copy_buffer(const osmium::memory::Buffer& buffer) {
+    osmium::memory::Buffer copy{buffer.committed(), osmium::memory::Buffer::auto_grow::no};
+    copy.add_buffer(buffer);
+    copy.commit();
+    return copy;
+}
+
 osmium::osm_entity_bits::type entity_bits(const std::string& location_index_type) {
     if (location_index_type == "none") {
         return osmium::osm_entity_bits::way;
@@ -229,19 +473,63 @@ osmium::osm_entity_bits::type entity_bits(const std::string& location_index_type
     }
 }
 
+/**
+ * Parse comma-separated list of tolerances.
+ */
+bool parse_tolerances(const char* str, std::vector<double>& tolerances) {
+    tolerances.clear();
+    while (true) {
+        char* end = nullptr;
+        const double tolerance = std::strtod(str, &end);
+        if (end == str || !(tolerance > 0)) {
+            return false;
+        }
+        tolerances.push_back(tolerance);
+        if (*end == '\0') {
+            return true;
+        }
+        if (*end != ',') {
+            return false;
+        }
+        str = end + 1;
+    }
+}
+
+/**
+ * Parse zoom range "MINZ-MAXZ" or "ZOOM".
+ */
+bool parse_zoom_range(const char* str, uint32_t& min_zoom, uint32_t& max_zoom) {
+    char* end = nullptr;
+    min_zoom = static_cast<uint32_t>(std::strtoul(str, &end, 10));
+    max_zoom = min_zoom;
+    if (end != str && *end == '-') {
+        max_zoom = static_cast<uint32_t>(std::strtoul(end + 1, &end, 10));
+    }
+    return end != str && *end == '\0' && min_zoom <= max_zoom && max_zoom <= tiles::max_zoom;
+}
+
 int main(int argc, char* argv[]) {
     osmium::util::VerboseOutput vout{true};
 
     static const struct option long_options[] = {
-        {"check",           no_argument,       0, 'c'},
+        {"index-advice",    required_argument, 0, 'a'},
+        {"output-store",    required_argument, 0, 'b'},
+        {"check",           optional_argument, 0, 'c'},
         {"collect-only",    no_argument,       0, 'C'},
         {"only-invalid",    no_argument,       0, 'f'},
+        {"filter",          required_argument, 0, 'F'},
+        {"simplify",        required_argument, 0, 'g'},
+        {"output-format",   required_argument, 0, 'G'},
         {"debug",           optional_argument, 0, 'd'},
         {"dump-areas",      optional_argument, 0, 'D'},
+        {"dump-format",     required_argument, 0, 'E'},
         {"empty-areas",     no_argument,       0, 'e'},
         {"help",            no_argument,       0, 'h'},
         {"index",           required_argument, 0, 'i'},
         {"show-index",      no_argument,       0, 'I'},
+        {"lock-index",      optional_argument, 0, 'L'},
+        {"metrics-columns", no_argument,       0, 'm'},
+        {"max-assembly-ms", required_argument, 0, 'M'},
         {"output",          required_argument, 0, 'o'},
         {"overwrite",       no_argument,       0, 'O'},
         {"report-problems", optional_argument, 0, 'p'},
@@ -250,37 +538,81 @@ int main(int argc, char* argv[]) {
         {"no-new-style",    no_argument,       0, 's'},
         {"keep-type-tag",   no_argument,       0, 't'},
         {"no-old-style",    no_argument,       0, 'S'},
+        {"tiles",           required_argument, 0, 'T'},
+        {"find-duplicates", no_argument,       0, 'u'},
         {"no-way-polygons", no_argument,       0, 'w'},
         {"no-areas",        no_argument,       0, 'x'},
         {0, 0, 0, 0}
     };
 
     std::string database_name;
+    std::string store_directory;
 
     std::string location_index_type = "sparse_mmap_array";
     const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance();
 
-    optional_output dump_stream;
     optional_output problem_stream;
 
+    IndexTuning index_tuning;
+
+    AreaFilter area_filter;
+    IdSet member_ways;
+
+    bool output_geojson = false;
+
+    bool dump_areas = false;
+    std::string dump_filename;
+    AreaDump::format dump_format = AreaDump::format::text;
+
     bool check = false;
+    bool check_with_geos = false;
     bool collect_only = false;
     bool only_invalid = false;
+    bool metrics_columns = false;
+    bool find_duplicates = false;
     bool show_incomplete = false;
     bool overwrite = false;
 
+    std::vector<double> simplify_tolerances;
+
+    // time limit for assembling a relation, 0 means no limit
+    uint64_t max_assembly_ms = 0;
+
+    // zoom levels for --tiles, no tiles are written if min_zoom > max_zoom
+    uint32_t min_zoom = 1;
+    uint32_t max_zoom = 0;
+
     osmium::area::Assembler::config_type assembler_config;
     assembler_config.create_empty_areas = false;
 
     while (true) {
-        int c = getopt_long(argc, argv, "cCd::D::efhi:Io:Op::rRsStwx", long_options, 0);
+        int c = getopt_long(argc, argv, "a:b:c::Cd::D::eE:fF:g:G:hi:IL::mM:o:Op::rRsStT:uwx", long_options, 0);
         if (c == -1) {
             break;
         }
 
         switch (c) {
+            case 'a':
+                try {
+                    index_tuning.set_advice(optarg);
+                } catch (const std::runtime_error& e) {
+                    std::cerr << e.what() << '\n';
+                    exit(exit_code_cmdline_error);
+                }
+                break;
+            case 'b':
+                store_directory = optarg;
+                break;
             case 'c':
                 check = true;
+                if (optarg) {
+                    if (!std::strcmp(optarg, "geos")) {
+                        check_with_geos = true;
+                    } else if (std::strcmp(optarg, "native")) {
+                        std::cerr << "Unknown check method '" << optarg << "'\n";
+                        exit(exit_code_cmdline_error);
+                    }
+                }
                 break;
             case 'C':
                 collect_only = true;
@@ -289,19 +621,44 @@ int main(int argc, char* argv[]) {
                 assembler_config.debug_level = optarg ? std::atoi(optarg) : 1;
                 break;
             case 'D':
+                dump_areas = true;
                 if (optarg) {
-                    dump_stream.set_file(optarg);
-                } else {
-                    dump_stream.set_stdout();
+                    dump_filename = optarg;
                 }
                 break;
             case 'e':
                 assembler_config.create_empty_areas = true;
                 break;
+            case 'E':
+                if (!AreaDump::parse_format(optarg, dump_format)) {
+                    std::cerr << "Unknown dump format '" << optarg << "' (use text, opl, or buffers)\n";
+                    exit(exit_code_cmdline_error);
+                }
+                break;
             case 'f':
                 only_invalid = true;
                 check = true;
                 break;
+            case 'F':
+                if (!area_filter.add(optarg)) {
+                    std::cerr << "Invalid filter expression '" << optarg << "'\n";
+                    exit(exit_code_cmdline_error);
+                }
+                break;
+            case 'g':
+                if (!parse_tolerances(optarg, simplify_tolerances)) {
+                    std::cerr << "Invalid tolerances '" << optarg << "' (use comma-separated list of positive numbers)\n";
+                    exit(exit_code_cmdline_error);
+                }
+                break;
+            case 'G':
+                if (!std::strcmp(optarg, "geojsonseq")) {
+                    output_geojson = true;
+                } else if (std::strcmp(optarg, "spatialite")) {
+                    std::cerr << "Unknown output format '" << optarg << "' (use spatialite or geojsonseq)\n";
+                    exit(exit_code_cmdline_error);
+                }
+                break;
             case 'h':
                 print_help();
                 exit(exit_code_ok);
@@ -318,6 +675,26 @@ int main(int argc, char* argv[]) {
                     std::cout << '\n';
                 }
                 exit(exit_code_ok);
+            case 'L':
+                if (optarg) {
+                    if (!index_tuning.parse_mlock(optarg)) {
+                        std::cerr << "Invalid lock size '" << optarg << "' (use number of megabytes > 0)\n";
+                        exit(exit_code_cmdline_error);
+                    }
+                } else {
+                    index_tuning.set_mlock_all();
+                }
+                break;
+            case 'm':
+                metrics_columns = true;
+                break;
+            case 'M':
+                max_assembly_ms = std::strtoull(optarg, nullptr, 10);
+                if (max_assembly_ms == 0) {
+                    std::cerr << "Invalid time limit '" << optarg << "' (use number of milliseconds > 0)\n";
+                    exit(exit_code_cmdline_error);
+                }
+                break;
             case 'o':
                 database_name = optarg;
                 break;
@@ -346,6 +723,15 @@ int main(int argc, char* argv[]) {
             case 't':
                 assembler_config.keep_type_tag = true;
                 break;
+            case 'T':
+                if (!parse_zoom_range(optarg, min_zoom, max_zoom)) {
+                    std::cerr << "Invalid zoom range '" << optarg << "' (use MINZ-MAXZ with MAXZ <= " << tiles::max_zoom << ")\n";
+                    exit(exit_code_cmdline_error);
+                }
+                break;
+            case 'u':
+                find_duplicates = true;
+                break;
             case 'w':
                 assembler_config.create_way_polygons = false;
                 break;
@@ -365,19 +751,73 @@ int main(int argc, char* argv[]) {
         exit(exit_code_cmdline_error);
     }
 
-    auto location_index = map_factory.create_map(location_index_type);
-    location_handler_type location_handler(*location_index);
-    location_handler.ignore_errors(); // XXX
+    if (!map_factory.has_map_type(location_index_type)) {
+        std::cerr << "Unknown index type '" << location_index_type << "' (use --show-index-types to list them)\n";
+        exit(exit_code_cmdline_error);
+    }
+
+    SecondPass second_pass{location_index_type, index_tuning, vout, std::max(1u, std::thread::hardware_concurrency())};
 
     const osmium::io::File input_file(argv[optind]);
 
-    bool need_locations = location_index_type != "none";
+    if (min_zoom <= max_zoom && store_directory.empty()) {
+        std::cerr << "The --tiles option needs --output-store\n";
+        exit(exit_code_cmdline_error);
+    }
+
+    std::unique_ptr<AreaStoreWriter> store{nullptr};
+    std::unique_ptr<TileWriter> tile_writer{nullptr};
+    if (!store_directory.empty() && !collect_only) {
+        if (::mkdir(store_directory.c_str(), 0777) != 0 && errno != EEXIST) {
+            std::cerr << "Can not create directory '" << store_directory << "': " << std::strerror(errno) << '\n';
+            exit(exit_code_error);
+        }
+        try {
+            store.reset(new AreaStoreWriter{store_directory + "/areas.store"});
+            if (min_zoom <= max_zoom) {
+                tile_writer.reset(new TileWriter{store_directory + "/tiles.db", min_zoom, max_zoom, std::max(1u, std::thread::hardware_concurrency())});
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            exit(exit_code_error);
+        }
+    }
+
+    if (output_geojson && database_name.empty()) {
+        std::cerr << "The geojsonseq output format needs --output (use '-' for stdout)\n";
+        exit(exit_code_cmdline_error);
+    }
+
+    if (metrics_columns && (database_name.empty() || output_geojson)) {
+        std::cerr << "The --metrics-columns option needs --output with the spatialite output format\n";
+        exit(exit_code_cmdline_error);
+    }
+
+    std::unique_ptr<GeoJSONSeqWriter> geojson{nullptr};
+    if (output_geojson && !collect_only) {
+        try {
+            geojson.reset(new GeoJSONSeqWriter{database_name, overwrite, std::max(1u, std::thread::hardware_concurrency())});
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            exit(exit_code_error);
+        }
+    }
+
+    std::unique_ptr<AreaDump> dump{nullptr};
+    if (dump_areas && !collect_only) {
+        try {
+            dump.reset(new AreaDump{dump_filename, dump_format});
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            exit(exit_code_error);
+        }
+    }
 
     if (collect_only) {
         collector_only collector{DummyAssembler::config_type{}};
 
         vout << "Starting first pass (reading relations)...\n";
-        read_relations(collector, input_file);
+        read_relations(collector, input_file, area_filter, member_ways);
         vout << "First pass done.\n";
 
         vout << "Memory:\n";
@@ -385,31 +825,33 @@ int main(int argc, char* argv[]) {
 
         vout << "Starting second pass (reading nodes and ways and assembling areas)...\n";
         osmium::io::Reader reader2(input_file, entity_bits(location_index_type));
-        if (need_locations) {
-            osmium::apply(reader2, location_handler, collector.handler());
-        } else {
-            osmium::apply(reader2, collector.handler());
-        }
+        FilteringReader<SelectedWays> source2{reader2, SelectedWays{area_filter, member_ways}};
+        second_pass(source2, collector.handler());
         reader2.close();
         vout << "Second pass done\n";
+        vout << "Ways skipped before location lookup: " << source2.removed() << '\n';
 
         vout << "Memory:\n";
         collector.used_memory();
 
         vout << "Stats:" << collector.stats() << '\n';
     } else {
-        std::unique_ptr<osmium::area::ProblemReporter> reporter{nullptr};
+        std::unique_ptr<ProblemSink> problems{nullptr};
 
         if (problem_stream) {
-            reporter.reset(new osmium::area::ProblemReporterStream{problem_stream.get()});
-            assembler_config.problem_reporter = reporter.get();
+            problems.reset(new ProblemSinkStream{problem_stream.get()});
+            assembler_config.problem_reporter = problems->reporter();
         }
 
-        if (database_name.empty()) {
-            collector_type collector(assembler_config);
+        if (database_name.empty() || geojson) {
+            std::unique_ptr<AssemblyGuard> guard{nullptr};
+            if (max_assembly_ms > 0) {
+                guard.reset(new AssemblyGuard{max_assembly_ms, problems.get()});
+            }
+            collector_type collector{TimedAssembler::config_type{assembler_config, guard.get()}};
 
             vout << "Starting first pass (reading relations)...\n";
-            read_relations(collector, input_file);
+            read_relations(collector, input_file, area_filter, member_ways);
             vout << "First pass done.\n";
 
             vout << "Memory:\n";
@@ -417,13 +859,38 @@ int main(int argc, char* argv[]) {
 
             vout << "Starting second pass (reading nodes and ways and assembling areas)...\n";
             osmium::io::Reader reader2(input_file, entity_bits(location_index_type));
-            if (need_locations) {
-                osmium::apply(reader2, location_handler, collector.handler([](osmium::memory::Buffer&&) {}));
-            } else {
-                osmium::apply(reader2, collector.handler([](osmium::memory::Buffer&&) {}));
-            }
+            FilteringReader<SelectedWays> source2{reader2, SelectedWays{area_filter, member_ways}};
+            const auto store_areas = [&store, &tile_writer, &geojson, &dump, &problems, &area_filter](osmium::memory::Buffer&& buffer) {
+                if (problems) {
+                    problems->flush();
+                }
+                filter_areas(buffer, area_filter);
+                if (store) {
+                    for (const auto& area : buffer.select<osmium::Area>()) {
+                        store->add(area);
+                        if (tile_writer) {
+                            tile_writer->add(area);
+                        }
+                    }
+                }
+                if (dump) {
+                    dump->add(geojson ? copy_buffer(buffer) : std::move(buffer));
+                }
+                if (geojson) {
+                    geojson->add(std::move(buffer));
+                }
+            };
+            second_pass(source2, collector.handler(store_areas));
             reader2.close();
             vout << "Second pass done\n";
+            vout << "Ways skipped before location lookup: " << source2.removed() << '\n';
+            if (guard) {
+                vout << "Relations skipped after assembly time limit: " << guard->timeouts() << '\n';
+            }
+
+            if (problems) {
+                problems->close();
+            }
 
             vout << "Memory:\n";
             collector.used_memory();
@@ -448,16 +915,35 @@ int main(int argc, char* argv[]) {
 
             OutputOGR output{dataset, factory};
             output.set_check(check);
+            output.set_check_with_geos(check_with_geos);
             output.set_only_invalid(only_invalid);
+            output.set_store(store.get());
+            output.set_tile_writer(tile_writer.get());
+            if (check && !check_with_geos) {
+                output.enable_problems();
+            }
+            if (metrics_columns) {
+                output.enable_metrics();
+            }
+            if (find_duplicates) {
+                output.enable_duplicates();
+            }
+            if (!simplify_tolerances.empty()) {
+                output.enable_simplify(dataset, simplify_tolerances);
+            }
 
             if (!problem_stream) {
-                reporter.reset(new osmium::area::ProblemReporterOGR{dataset});
+                problems.reset(new ProblemSinkOGR{dataset, factory.proj_string()});
+            }
+            assembler_config.problem_reporter = problems->reporter();
+            std::unique_ptr<AssemblyGuard> guard{nullptr};
+            if (max_assembly_ms > 0) {
+                guard.reset(new AssemblyGuard{max_assembly_ms, problems.get()});
             }
-            assembler_config.problem_reporter = reporter.get();
-            collector_type collector(assembler_config);
+            collector_type collector{TimedAssembler::config_type{assembler_config, guard.get()}};
 
             vout << "Starting first pass (reading relations)...\n";
-            read_relations(collector, input_file);
+            read_relations(collector, input_file, area_filter, member_ways);
             vout << "First pass done.\n";
 
             vout << "Memory:\n";
@@ -465,37 +951,43 @@ int main(int argc, char* argv[]) {
 
             vout << "Starting second pass (reading nodes and ways and assembling areas)...\n";
             osmium::io::Reader reader2(input_file, entity_bits(location_index_type));
-
-            if (dump_stream) {
-                osmium::handler::Dump dump_handler{dump_stream.get()};
-                if (need_locations) {
-                    osmium::apply(reader2, location_handler, collector.handler([&output, &dump_handler](osmium::memory::Buffer&& buffer) {
-                        osmium::apply(buffer, dump_handler, output);
-                    }));
-                } else {
-                    osmium::apply(reader2, collector.handler([&output, &dump_handler](osmium::memory::Buffer&& buffer) {
-                        osmium::apply(buffer, dump_handler, output);
-                    }));
-                }
-            } else {
-                if (need_locations) {
-                    osmium::apply(reader2, location_handler, collector.handler([&output](osmium::memory::Buffer&& buffer) {
-                        osmium::apply(buffer, output);
-                    }));
-                } else {
-                    osmium::apply(reader2, collector.handler([&output](osmium::memory::Buffer&& buffer) {
-                        osmium::apply(buffer, output);
-                    }));
+            FilteringReader<SelectedWays> source2{reader2, SelectedWays{area_filter, member_ways}};
+
+            second_pass(source2, collector.handler([&output, &dump, &problems, &area_filter](osmium::memory::Buffer&& buffer) {
+                problems->flush();
+                filter_areas(buffer, area_filter);
+                osmium::apply(buffer, output);
+                if (dump) {
+                    dump->add(std::move(buffer));
                 }
-            }
+            }));
 
             reader2.close();
             vout << "Second pass done\n";
+            vout << "Ways skipped before location lookup: " << source2.removed() << '\n';
+            if (guard) {
+                vout << "Relations skipped after assembly time limit: " << guard->timeouts() << '\n';
+            }
 
-            if (!problem_stream) {
-                reporter.reset();
+            if (!simplify_tolerances.empty()) {
+                vout << "Waiting for simplification to finish...\n";
+                output.finish_simplify();
+            }
+
+            if (only_invalid) {
+                vout << "Valid areas skipped before creating geometry: " << output.screened_out() << '\n';
             }
 
+            if (find_duplicates) {
+                vout << "Writing duplicates...\n";
+                const auto groups = output.write_duplicates(dataset);
+                vout << "Found " << groups << " groups of areas with the same rings.\n";
+            }
+
+            // the OGR problem layers must be closed before the dataset
+            problems->close();
+            problems.reset();
+
             collector.used_memory();
 
             vout << "Stats:" << collector.stats() << '\n';
@@ -506,8 +998,51 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (geojson) {
+        vout << "Waiting for GeoJSON output to finish...\n";
+        try {
+            geojson->close();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            exit(exit_code_error);
+        }
+        vout << "Wrote " << geojson->features() << " areas as GeoJSON.\n";
+    }
+
+    if (dump) {
+        vout << "Waiting for area dump to finish...\n";
+        try {
+            dump->close();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            exit(exit_code_error);
+        }
+    }
+
+    if (store) {
+        vout << "Writing index of area store...\n";
+        try {
+            store->close();
+        } catch (const std::system_error& e) {
+            std::cerr << e.what() << '\n';
+            exit(exit_code_error);
+        }
+        vout << "Wrote " << store->size() << " areas to store.\n";
+    }
+
+    if (tile_writer) {
+        vout << "Waiting for tile clipping to finish...\n";
+        try {
+            const auto pieces = tile_writer->close();
+            vout << "Wrote " << pieces << " clipped areas to tiles.\n";
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            exit(exit_code_error);
+        }
+    }
+
     vout << "Estimated memory usage:\n";
-    vout << "  location index: " << (location_index->used_memory() / 1024) << "kB\n";
+    vout << "  location index: " << (second_pass.index_memory() / 1024) << "kB\n";
 
     osmium::MemoryUsage mcheck;
     vout << "Actual memory usage:\n"
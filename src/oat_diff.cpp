@@ -0,0 +1,225 @@
+/*****************************************************************************
+
+  OSM Area Tools - Compare areas from two runs of oat_create_areas
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <osmium/osm/types.hpp>
+#include <osmium/util/verbose_output.hpp>
+
+#include "oat.hpp"
+#include "oat_area_store.hpp"
+#include "oat_ring_hash.hpp"
+
+/**
+ * Content hash of an area from the area store. The hash doesn't depend on
+ * the order of the rings, on the start point of each ring, and on its
+ * orientation, so areas assembled from the same data in a different order
+ * get the same hash.
+ */
+class AreaContentHasher {
+
+    RingHasher m_hasher;
+    std::vector<uint64_t> m_points;
+    std::vector<uint64_t> m_ring_hashes;
+
+public:
+
+    uint64_t operator()(const AreaStore::area_view& area) {
+        m_ring_hashes.clear();
+        for (uint32_t n = 0; n < area.num_rings(); ++n) {
+            const auto ring = area.ring(n);
+            m_points.resize(ring.size());
+            for (uint32_t i = 0; i < ring.size(); ++i) {
+                m_points[i] = (static_cast<uint64_t>(static_cast<uint32_t>(ring.x()[i])) << 32) |
+                               static_cast<uint32_t>(ring.y()[i]);
+            }
+            const uint64_t h = m_hasher.ring_hash(m_points.data(), m_points.size());
+            m_ring_hashes.push_back(ring.is_outer() ? h : RingHasher::inner_ring_hash(h));
+        }
+        return RingHasher::combine(m_ring_hashes);
+    }
+
+}; // class AreaContentHasher
+
+/**
+ * Walks through two area stores in id order at the same time and writes
+ * out a line for each area that was added, removed, or changed.
+ */
+class AreaDiff {
+
+    std::ostream& m_out;
+    AreaContentHasher m_hasher;
+
+    uint64_t m_same = 0;
+    uint64_t m_added = 0;
+    uint64_t m_removed = 0;
+    uint64_t m_changed = 0;
+
+    void compare(const AreaStore::area_view& old_area, const AreaStore::area_view& new_area) {
+        const bool rings_changed = old_area.num_rings() != new_area.num_rings();
+        const rtree_box& ob = old_area.box();
+        const rtree_box& nb = new_area.box();
+        const bool box_changed = ob.min_x != nb.min_x || ob.min_y != nb.min_y ||
+                                 ob.max_x != nb.max_x || ob.max_y != nb.max_y;
+
+        // only hash if the cheap checks don't already show a difference
+        if (!rings_changed && !box_changed &&
+            old_area.num_points() == new_area.num_points() &&
+            m_hasher(old_area) == m_hasher(new_area)) {
+            ++m_same;
+            return;
+        }
+
+        ++m_changed;
+        m_out << "~ " << new_area.id() << ' ';
+        if (rings_changed) {
+            m_out << 'r';
+        }
+        if (box_changed) {
+            m_out << 'b';
+        }
+        if (!rings_changed && !box_changed) {
+            m_out << 'g';
+        }
+        m_out << '\n';
+    }
+
+public:
+
+    explicit AreaDiff(std::ostream& out) :
+        m_out(out) {
+    }
+
+    void operator()(const AreaStore& old_store, const AreaStore& new_store) {
+        std::size_t o = 0;
+        std::size_t n = 0;
+
+        while (o < old_store.size() || n < new_store.size()) {
+            if (n == new_store.size() || (o < old_store.size() && old_store.at(o).id() < new_store.at(n).id())) {
+                ++m_removed;
+                m_out << "- " << old_store.at(o).id() << '\n';
+                ++o;
+            } else if (o == old_store.size() || new_store.at(n).id() < old_store.at(o).id()) {
+                ++m_added;
+                m_out << "+ " << new_store.at(n).id() << '\n';
+                ++n;
+            } else {
+                compare(old_store.at(o), new_store.at(n));
+                ++o;
+                ++n;
+            }
+        }
+    }
+
+    uint64_t same() const noexcept {
+        return m_same;
+    }
+
+    uint64_t added() const noexcept {
+        return m_added;
+    }
+
+    uint64_t removed() const noexcept {
+        return m_removed;
+    }
+
+    uint64_t changed() const noexcept {
+        return m_changed;
+    }
+
+}; // class AreaDiff
+
+void print_help() {
+    std::cout << "oat_diff [OPTIONS] OLD_STORE_DIR NEW_STORE_DIR\n\n"
+              << "Compare the areas in two area stores written by\n"
+              << "'oat_create_areas --output-store=DIR' and write out the differences.\n"
+              << "One line per difference:\n"
+              << "  + ID       area was added\n"
+              << "  - ID       area was removed\n"
+              << "  ~ ID FLAGS area was changed, FLAGS are one or more of\n"
+              << "             r (number of rings changed), b (bounding box changed),\n"
+              << "             g (only the geometry of the rings changed)\n"
+              << "\nOptions:\n"
+              << "  -h, --help                 This help message\n"
+              << "  -o, --output=FILE          Write differences to FILE (default: stdout)\n"
+              ;
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        {"help",   no_argument,       0, 'h'},
+        {"output", required_argument, 0, 'o'},
+        {0, 0, 0, 0}
+    };
+
+    std::string output_filename;
+
+    while (true) {
+        int c = getopt_long(argc, argv, "ho:", long_options, 0);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+            case 'h':
+                print_help();
+                exit(exit_code_ok);
+            case 'o':
+                output_filename = optarg;
+                break;
+            default:
+                exit(exit_code_cmdline_error);
+        }
+    }
+
+    int remaining_args = argc - optind;
+    if (remaining_args != 2) {
+        std::cerr << "Usage: " << argv[0] << " [OPTIONS] OLD_STORE_DIR NEW_STORE_DIR\n";
+        exit(exit_code_cmdline_error);
+    }
+
+    // differences go to stdout by default, so messages go to stderr
+    osmium::util::VerboseOutput vout{true};
+
+    try {
+        const AreaStore old_store{std::string{argv[optind]} + "/areas.store"};
+        const AreaStore new_store{std::string{argv[optind + 1]} + "/areas.store"};
+        vout << "Comparing " << old_store.size() << " old areas with " << new_store.size() << " new areas...\n";
+
+        std::ofstream file;
+        if (!output_filename.empty()) {
+            file.open(output_filename);
+            if (!file) {
+                std::cerr << "Can not open output file '" << output_filename << "'\n";
+                exit(exit_code_error);
+            }
+        }
+
+        AreaDiff diff{output_filename.empty() ? std::cout : file};
+        diff(old_store, new_store);
+
+        vout << "Unchanged: " << diff.same() << '\n';
+        vout << "Added:     " << diff.added() << '\n';
+        vout << "Removed:   " << diff.removed() << '\n';
+        vout << "Changed:   " << diff.changed() << '\n';
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(exit_code_error);
+    }
+
+    vout << "Done.\n";
+
+    return exit_code_ok;
+}
+
@@ -30,6 +30,7 @@
 #include <osmium/visitor.hpp>
 
 #include "oat.hpp"
+#include "oat_area_filter.hpp"
 
 using index_type = osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>;
 using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
@@ -48,10 +49,17 @@ void print_help() {
 
 using collector_type = osmium::area::MultipolygonCollector<osmium::area::Assembler>;
 
-void read_relations(collector_type& collector, const osmium::io::File& file) {
+/**
+ * Read relations in the first pass, the ids of their member ways are
+ * added to member_ways.
+ */
+void read_relations(collector_type& collector, const osmium::io::File& file, IdSet& member_ways) {
+    const AreaFilter all;
     osmium::io::Reader reader(file, osmium::osm_entity_bits::relation);
-    collector.read_relations(reader);
+    FilteringReader<SelectedRelations> source{reader, SelectedRelations{all, member_ways}};
+    collector.read_relations(source);
     reader.close();
+    member_ways.sort();
 }
 
 osmium::osm_entity_bits::type entity_bits(const std::string& location_index_type) {
@@ -138,9 +146,12 @@ int main(int argc, char* argv[]) {
 
     collector_type collector(assembler_config);
 
-    read_relations(collector, input_file);
+    IdSet member_ways;
+    read_relations(collector, input_file, member_ways);
 
     osmium::io::Reader reader2(input_file, entity_bits(location_index_type));
+    const AreaFilter all;
+    FilteringReader<SelectedWays> source2{reader2, SelectedWays{all, member_ways}};
 
     tag_counter counter;
 
@@ -179,9 +190,9 @@ int main(int argc, char* argv[]) {
     });
 
     if (location_index_type == "none") {
-        osmium::apply(reader2, ch);
+        osmium::apply(source2, ch);
     } else {
-        osmium::apply(reader2, location_handler, ch);
+        osmium::apply(source2, location_handler, ch);
     }
 
     reader2.close();
@@ -0,0 +1,380 @@
+#ifndef OAT_GEOJSON_HPP
+#define OAT_GEOJSON_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Write areas as newline-delimited GeoJSON
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node_ref_list.hpp>
+#include <osmium/osm/tag.hpp>
+
+#include "oat_work_queue.hpp"
+
+namespace geojson {
+
+    // OSM coordinates are stored as integers in units of 1e-7 degrees
+    const uint32_t coordinate_precision = 10000000;
+
+    /**
+     * Append a coordinate in OSM units (1e-7 degrees). Written as a
+     * decimal number with trailing zeros removed, which is the shortest
+     * text giving the same double when parsed. No floating point
+     * arithmetic is needed for that.
+     */
+    inline void append_coordinate(std::string& out, int32_t value) {
+        char digits[16];
+        char* const end = digits + sizeof(digits);
+        char* ptr = end;
+
+        uint32_t abs_value = value < 0 ? static_cast<uint32_t>(-static_cast<int64_t>(value)) : static_cast<uint32_t>(value);
+        uint32_t fraction = abs_value % coordinate_precision;
+        uint32_t integer = abs_value / coordinate_precision;
+
+        if (fraction != 0) {
+            int num_digits = 7;
+            while (fraction % 10 == 0) {
+                fraction /= 10;
+                --num_digits;
+            }
+            while (num_digits-- > 0) {
+                *--ptr = static_cast<char>('0' + fraction % 10);
+                fraction /= 10;
+            }
+            *--ptr = '.';
+        }
+        do {
+            *--ptr = static_cast<char>('0' + integer % 10);
+            integer /= 10;
+        } while (integer != 0);
+        if (value < 0) {
+            *--ptr = '-';
+        }
+        out.append(ptr, end);
+    }
+
+    inline void append_integer(std::string& out, int64_t value) {
+        char digits[24];
+        char* const end = digits + sizeof(digits);
+        char* ptr = end;
+        uint64_t abs_value = value < 0 ? static_cast<uint64_t>(-(value + 1)) + 1 : static_cast<uint64_t>(value);
+        do {
+            *--ptr = static_cast<char>('0' + abs_value % 10);
+            abs_value /= 10;
+        } while (abs_value != 0);
+        if (value < 0) {
+            *--ptr = '-';
+        }
+        out.append(ptr, end);
+    }
+
+    /**
+     * Append a JSON string with quotes, escaping all characters that
+     * need it. UTF-8 sequences are copied as they are.
+     */
+    inline void append_string(std::string& out, const char* str) {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        for (; *str; ++str) {
+            const auto c = static_cast<unsigned char>(*str);
+            switch (c) {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if (c < 0x20) {
+                        out += "\\u00";
+                        out += hex[c >> 4];
+                        out += hex[c & 0xf];
+                    } else {
+                        out += static_cast<char>(c);
+                    }
+            }
+        }
+        out += '"';
+    }
+
+    inline bool append_ring(std::string& out, const osmium::NodeRefList& ring) {
+        out += '[';
+        bool first = true;
+        for (const auto& node_ref : ring) {
+            const osmium::Location location = node_ref.location();
+            if (!location.valid()) {
+                return false;
+            }
+            if (!first) {
+                out += ',';
+            }
+            first = false;
+            out += '[';
+            append_coordinate(out, location.x());
+            out += ',';
+            append_coordinate(out, location.y());
+            out += ']';
+        }
+        out += ']';
+        return true;
+    }
+
+    /**
+     * Append the area as a GeoJSON feature with a MultiPolygon geometry
+     * on a line of its own. Areas without rings or with invalid locations
+     * are not written, returns false for them.
+     */
+    inline bool append_feature(std::string& out, const osmium::Area& area) {
+        const std::size_t size_before = out.size();
+
+        out += "{\"type\":\"Feature\",\"geometry\":{\"type\":\"MultiPolygon\",\"coordinates\":[";
+        bool has_rings = false;
+        for (auto it = area.cbegin(); it != area.cend(); ++it) {
+            if (it->type() == osmium::item_type::outer_ring) {
+                out += has_rings ? "],[" : "[";
+            } else if (it->type() == osmium::item_type::inner_ring) {
+                out += ',';
+            } else {
+                continue;
+            }
+            if (!append_ring(out, static_cast<const osmium::NodeRefList&>(*it))) {
+                out.resize(size_before);
+                return false;
+            }
+            has_rings = true;
+        }
+        if (!has_rings) {
+            out.resize(size_before);
+            return false;
+        }
+
+        out += "]]},\"properties\":{\"id\":";
+        append_integer(out, area.id());
+        out += ",\"source\":";
+        out += area.from_way() ? "\"w\"" : "\"r\"";
+        out += ",\"orig_id\":";
+        append_integer(out, area.orig_id());
+        out += ",\"tags\":{";
+        bool first = true;
+        for (const auto& tag : area.tags()) {
+            if (!first) {
+                out += ',';
+            }
+            first = false;
+            append_string(out, tag.key());
+            out += ':';
+            append_string(out, tag.value());
+        }
+        out += "}}}\n";
+        return true;
+    }
+
+} // namespace geojson
+
+/**
+ * Writes areas as GeoJSON features, one per line (the format GDAL calls
+ * GeoJSONSeq). Buffers with areas are formatted by several worker threads,
+ * each into a string of its own. A writer thread appends the strings to
+ * the output in the order the buffers were added.
+ */
+class GeoJSONSeqWriter {
+
+    struct job {
+        uint64_t sequence;
+        osmium::memory::Buffer buffer;
+    };
+
+    struct result {
+        uint64_t sequence;
+        std::string text;
+    };
+
+    int m_fd = -1;
+    uint64_t m_next_sequence = 0;
+
+    WorkQueue<job> m_jobs;
+    WorkQueue<result> m_results;
+
+    std::atomic<uint64_t> m_features{0};
+
+    // first error in one of the threads, rethrown by close()
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error{nullptr};
+
+    std::vector<std::thread> m_workers;
+    std::thread m_writer;
+
+    void set_error() {
+        std::lock_guard<std::mutex> lock{m_error_mutex};
+        if (!m_error) {
+            m_error = std::current_exception();
+        }
+    }
+
+    void write(const std::string& text) {
+        const char* ptr = text.data();
+        std::size_t size = text.size();
+        while (size > 0) {
+            const auto written = ::write(m_fd, ptr, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Write to GeoJSON output failed"};
+            }
+            ptr += written;
+            size -= static_cast<std::size_t>(written);
+        }
+    }
+
+    void worker() {
+        std::size_t last_size = 0;
+        job j;
+        while (m_jobs.pop(j)) {
+            result r;
+            r.sequence = j.sequence;
+            try {
+                r.text.reserve(last_size);
+                uint64_t features = 0;
+                for (const auto& area : j.buffer.select<osmium::Area>()) {
+                    if (geojson::append_feature(r.text, area)) {
+                        ++features;
+                    }
+                }
+                m_features += features;
+                last_size = r.text.size();
+            } catch (...) {
+                set_error();
+                r.text.clear();
+            }
+            // always send a result, the writer waits for each sequence
+            // number in turn
+            m_results.push(std::move(r));
+        }
+    }
+
+    void writer() {
+        std::map<uint64_t, std::string> waiting;
+        uint64_t next = 0;
+        bool failed = false;
+        result r;
+        while (m_results.pop(r)) {
+            waiting.emplace(r.sequence, std::move(r.text));
+            for (auto it = waiting.begin(); it != waiting.end() && it->first == next; it = waiting.erase(it)) {
+                if (!failed) {
+                    try {
+                        write(it->second);
+                    } catch (...) {
+                        // keep taking results, so the workers never block
+                        set_error();
+                        failed = true;
+                    }
+                }
+                ++next;
+            }
+        }
+    }
+
+public:
+
+    /**
+     * Open the output file, or use stdout if filename is "-". An existing
+     * file is only overwritten if overwrite is set.
+     */
+    GeoJSONSeqWriter(const std::string& filename, bool overwrite, unsigned int num_threads) :
+        m_jobs(num_threads * 4),
+        m_results(num_threads * 4) {
+        if (filename == "-") {
+            m_fd = 1;
+        } else {
+            m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | (overwrite ? O_TRUNC : O_EXCL), 0644);
+            if (m_fd < 0) {
+                throw std::system_error{errno, std::system_category(), "Can not open GeoJSON output '" + filename + "'"};
+            }
+        }
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            m_workers.emplace_back(&GeoJSONSeqWriter::worker, this);
+        }
+        m_writer = std::thread{&GeoJSONSeqWriter::writer, this};
+    }
+
+    GeoJSONSeqWriter(const GeoJSONSeqWriter&) = delete;
+    GeoJSONSeqWriter& operator=(const GeoJSONSeqWriter&) = delete;
+
+    ~GeoJSONSeqWriter() {
+        try {
+            close();
+        } catch (...) {
+            // ignore errors in destructor
+        }
+    }
+
+    /**
+     * Queue buffer with areas for writing. Blocks if the threads are too
+     * far behind.
+     */
+    void add(osmium::memory::Buffer&& buffer) {
+        m_jobs.push(job{m_next_sequence++, std::move(buffer)});
+    }
+
+    /**
+     * The number of features written so far.
+     */
+    uint64_t features() const noexcept {
+        return m_features;
+    }
+
+    /**
+     * Wait for all buffers to be written and close the output. Rethrows
+     * the first error from any of the threads.
+     */
+    void close() {
+        m_jobs.close();
+        for (auto& thread : m_workers) {
+            thread.join();
+        }
+        m_workers.clear();
+        m_results.close();
+        if (m_writer.joinable()) {
+            m_writer.join();
+        }
+        if (m_fd > 1) {
+            const int fd = m_fd;
+            m_fd = -1;
+            if (::close(fd) != 0) {
+                throw std::system_error{errno, std::system_category(), "Close of GeoJSON output failed"};
+            }
+        }
+        std::lock_guard<std::mutex> lock{m_error_mutex};
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+}; // class GeoJSONSeqWriter
+
+#endif // OAT_GEOJSON_HPP
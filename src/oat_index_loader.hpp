@@ -0,0 +1,463 @@
+#ifndef OAT_INDEX_LOADER_HPP
+#define OAT_INDEX_LOADER_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Fill location index from several threads
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/types.hpp>
+
+#include "oat_index_tuning.hpp"
+#include "oat_work_queue.hpp"
+
+/**
+ * Loader policy for dense index types (DenseMemArray, DenseMmapArray).
+ * Each node is written straight into the array at the position of its
+ * id, so threads working on different buffers never touch the same
+ * element. The array is grown from the reading thread only, in large
+ * steps and while no worker is writing, so that the memory never moves
+ * under a worker.
+ */
+template <typename TIndex>
+class DenseIndexLoader {
+
+    // grow the index in steps of this many elements
+    enum : std::size_t {
+        grow_step = 1024 * 1024 * 16
+    };
+
+    TIndex& m_index;
+    osmium::Location* m_data = nullptr;
+    std::size_t m_capacity = 0;
+
+public:
+
+    using index_type = TIndex;
+
+    DenseIndexLoader(TIndex& index, unsigned int /*num_threads*/) :
+        m_index(index) {
+    }
+
+    /**
+     * Called from the reading thread before a buffer with nodes up to
+     * max_id is handed to the workers. If the index has to move in
+     * memory, drain() is called first to wait for all workers. Returns
+     * true if the index was grown (and moved).
+     *
+     * The index is always grown to its full capacity, so paging advice
+     * applied after a step covers all of its memory.
+     */
+    template <typename TDrain>
+    bool prepare(osmium::unsigned_object_id_type max_id, TDrain&& drain) {
+        if (max_id < m_capacity) {
+            return false;
+        }
+        drain();
+        m_capacity = (max_id / grow_step + 1) * grow_step;
+        m_index.reserve(m_capacity);
+        m_index.set(m_capacity - 1, osmium::Location{});
+        m_data = &*m_index.begin();
+        return true;
+    }
+
+    void load(unsigned int /*thread*/, const osmium::memory::Buffer& buffer) noexcept {
+        for (const auto& node : buffer.select<osmium::Node>()) {
+            if (node.id() >= 0) {
+                m_data[node.positive_id()] = node.location();
+            }
+        }
+    }
+
+    void finish(unsigned int /*num_threads*/) noexcept {
+    }
+
+}; // class DenseIndexLoader
+
+/**
+ * Loader policy for sparse index types (SparseMemArray, SparseMmapArray).
+ * Each thread collects the id/location pairs of its buffers in runs of
+ * run_size elements. At the end the runs are sorted in parallel and then
+ * merged into the index, which replaces the one big sort of the whole
+ * index on the first way.
+ *
+ * For the merge the ids are split into ranges with about the same number
+ * of elements. A group of ranges, one per thread, is merged at a time,
+ * each range straight into its part of the index. Runs that are merged
+ * completely are freed after each group, so with sorted input (where each
+ * run covers a small id range) the runs and the index are not both in
+ * memory at the same time.
+ */
+template <typename TIndex>
+class SparseIndexLoader {
+
+    using element_type = typename TIndex::element_type;
+    using run_type = std::vector<element_type>;
+
+    enum : std::size_t {
+        run_size = 1024 * 1024,
+
+        ranges_per_thread = 8,
+
+        // ids taken from each run to find the limits of the ranges
+        samples_per_run = 64
+    };
+
+    TIndex& m_index;
+
+    // runs of each worker thread and of the reading thread
+    std::vector<std::vector<run_type>> m_runs;
+
+    static bool id_order(const element_type& a, const element_type& b) noexcept {
+        return a.first < b.first;
+    }
+
+    // Call func(n) for each n in [0, count) from num_threads threads.
+    template <typename TFunc>
+    static void run_parallel(unsigned int num_threads, std::size_t count, TFunc&& func) {
+        std::vector<std::thread> threads;
+        std::size_t next = 0;
+        std::mutex mutex;
+        for (unsigned int i = 0; i < num_threads && i < count; ++i) {
+            threads.emplace_back([count, &next, &mutex, &func] {
+                while (true) {
+                    std::size_t n;
+                    {
+                        std::lock_guard<std::mutex> lock{mutex};
+                        if (next == count) {
+                            return;
+                        }
+                        n = next++;
+                    }
+                    func(n);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // k-way merge of the parts [begin[k], end[k]) of the sorted runs
+    static void merge_range(const std::vector<run_type>& runs, const std::vector<std::size_t>& begin, const std::vector<std::size_t>& end, element_type* out) {
+        // the index of the run and the position in that run
+        using cursor = std::pair<std::size_t, std::size_t>;
+        const auto greater = [&runs](const cursor& a, const cursor& b) {
+            return id_order(runs[b.first][b.second], runs[a.first][a.second]);
+        };
+        std::priority_queue<cursor, std::vector<cursor>, decltype(greater)> heap{greater};
+        for (std::size_t k = 0; k < runs.size(); ++k) {
+            if (begin[k] < end[k]) {
+                heap.emplace(k, begin[k]);
+            }
+        }
+        while (!heap.empty()) {
+            cursor c = heap.top();
+            if (heap.size() == 1) {
+                const auto& run = runs[c.first];
+                std::copy(run.begin() + c.second, run.begin() + end[c.first], out);
+                return;
+            }
+            heap.pop();
+            *out++ = runs[c.first][c.second];
+            if (++c.second < end[c.first]) {
+                heap.push(c);
+            }
+        }
+    }
+
+public:
+
+    using index_type = TIndex;
+
+    SparseIndexLoader(TIndex& index, unsigned int num_threads) :
+        m_index(index),
+        m_runs(num_threads + 1) {
+    }
+
+    // The index itself is only filled in finish(), so there is nothing
+    // for the fill phase advice to work on.
+    template <typename TDrain>
+    bool prepare(osmium::unsigned_object_id_type /*max_id*/, TDrain&& /*drain*/) noexcept {
+        return false;
+    }
+
+    void load(unsigned int thread, const osmium::memory::Buffer& buffer) {
+        auto& runs = m_runs[thread];
+        for (const auto& node : buffer.select<osmium::Node>()) {
+            if (node.id() >= 0) {
+                if (runs.empty() || runs.back().size() == run_size) {
+                    runs.emplace_back();
+                    runs.back().reserve(run_size);
+                }
+                runs.back().emplace_back(node.positive_id(), node.location());
+            }
+        }
+    }
+
+    void finish(unsigned int num_threads) {
+        std::vector<run_type> runs;
+        for (auto& thread_runs : m_runs) {
+            for (auto& run : thread_runs) {
+                runs.push_back(std::move(run));
+            }
+        }
+        m_runs.clear();
+        m_runs.shrink_to_fit();
+        if (runs.empty()) {
+            return;
+        }
+
+        run_parallel(num_threads, runs.size(), [&runs](std::size_t n) {
+            std::sort(runs[n].begin(), runs[n].end(), id_order);
+        });
+
+        std::vector<osmium::unsigned_object_id_type> samples;
+        for (const auto& run : runs) {
+            for (std::size_t n = 0; n < samples_per_run; ++n) {
+                samples.push_back(run[n * run.size() / samples_per_run].first);
+            }
+        }
+        std::sort(samples.begin(), samples.end());
+
+        // bounds[r][k] is the position in run k where range r starts
+        const std::size_t num_ranges = std::max(1u, num_threads) * ranges_per_thread;
+        std::vector<std::vector<std::size_t>> bounds(num_ranges + 1, std::vector<std::size_t>(runs.size(), 0));
+        for (std::size_t r = 1; r < num_ranges; ++r) {
+            const element_type limit{samples[r * samples.size() / num_ranges], {}};
+            for (std::size_t k = 0; k < runs.size(); ++k) {
+                bounds[r][k] = static_cast<std::size_t>(std::lower_bound(runs[k].begin(), runs[k].end(), limit, id_order) - runs[k].begin());
+            }
+        }
+        for (std::size_t k = 0; k < runs.size(); ++k) {
+            bounds[num_ranges][k] = runs[k].size();
+        }
+
+        const std::size_t group_size = std::max(1u, num_threads);
+        for (std::size_t first = 0; first < num_ranges; first += group_size) {
+            const std::size_t last = std::min(first + group_size, num_ranges);
+
+            // where each range of the group starts in the index
+            std::vector<std::size_t> offsets(last - first + 1, m_index.size());
+            for (std::size_t r = first; r < last; ++r) {
+                offsets[r - first + 1] = offsets[r - first];
+                for (std::size_t k = 0; k < runs.size(); ++k) {
+                    offsets[r - first + 1] += bounds[r + 1][k] - bounds[r][k];
+                }
+            }
+
+            if (offsets.back() > offsets.front()) {
+                // the sparse index has no resize(), so make room for the
+                // elements by adding them with a dummy value
+                while (m_index.size() < offsets.back()) {
+                    m_index.set(0, osmium::Location{});
+                }
+                element_type* data = &*m_index.begin();
+                run_parallel(num_threads, last - first, [&](std::size_t n) {
+                    merge_range(runs, bounds[first + n], bounds[first + n + 1], data + offsets[n]);
+                });
+            }
+
+            for (std::size_t k = 0; k < runs.size(); ++k) {
+                if (!runs[k].empty() && bounds[last][k] == runs[k].size()) {
+                    run_type{}.swap(runs[k]);
+                }
+            }
+        }
+    }
+
+}; // class SparseIndexLoader
+
+/**
+ * Data source for osmium::apply() that fills the location index from a
+ * number of worker threads. Buffers with nodes at the start of the input
+ * are handed to the workers, the nodes are never passed on to the
+ * handlers. When the first way (or the end of the input) is reached, the
+ * reading thread waits for the workers and lets the loader policy finish
+ * the index, so it is complete when the locations of the first way are
+ * looked up. Nodes coming after that (only in unsorted input) are passed
+ * on as usual.
+ *
+ * If there is an IndexPhaseHandler, it is told about every growth step of
+ * the index, so the fill phase advice is applied again, and it is switched
+ * to the lookup phase as soon as the index is complete, before any ways
+ * are passed on.
+ */
+template <typename TSource, typename TLoader>
+class ParallelIndexLoader {
+
+    TSource& m_source;
+    TLoader m_loader;
+    unsigned int m_num_threads;
+    IndexPhaseHandler* m_phase_handler;
+
+    WorkQueue<osmium::memory::Buffer> m_queue;
+
+    std::mutex m_mutex;
+    std::condition_variable m_done;
+    std::size_t m_in_flight = 0;
+
+    // first error in one of the worker threads, rethrown when finishing
+    std::exception_ptr m_error{nullptr};
+
+    std::vector<std::thread> m_threads;
+
+    bool m_finished = false;
+
+    struct no_callback {
+        void moving_in_buffer(std::size_t, std::size_t) noexcept {
+        }
+    };
+
+    void worker(unsigned int thread) {
+        osmium::memory::Buffer buffer;
+        while (m_queue.pop(buffer)) {
+            try {
+                m_loader.load(thread, buffer);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{m_mutex};
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+            buffer = osmium::memory::Buffer{};
+            {
+                std::lock_guard<std::mutex> lock{m_mutex};
+                --m_in_flight;
+            }
+            m_done.notify_all();
+        }
+    }
+
+    void drain() {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        m_done.wait(lock, [this] {
+            return m_in_flight == 0;
+        });
+    }
+
+    void stop_threads() {
+        m_queue.close();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+        m_threads.clear();
+    }
+
+    void finish() {
+        m_finished = true;
+        stop_threads();
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+        m_loader.finish(m_num_threads);
+        if (m_phase_handler) {
+            m_phase_handler->start_lookup_phase();
+        }
+    }
+
+public:
+
+    ParallelIndexLoader(TSource& source, typename TLoader::index_type& index, unsigned int num_threads, IndexPhaseHandler* phase_handler = nullptr) :
+        m_source(source),
+        m_loader(index, num_threads),
+        m_num_threads(num_threads),
+        m_phase_handler(phase_handler),
+        m_queue(num_threads * 4) {
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            m_threads.emplace_back(&ParallelIndexLoader::worker, this, i);
+        }
+    }
+
+    ParallelIndexLoader(const ParallelIndexLoader&) = delete;
+    ParallelIndexLoader& operator=(const ParallelIndexLoader&) = delete;
+
+    ~ParallelIndexLoader() {
+        stop_threads();
+    }
+
+    osmium::memory::Buffer read() {
+        while (true) {
+            osmium::memory::Buffer buffer = m_source.read();
+            if (m_finished) {
+                return buffer;
+            }
+            if (!buffer) {
+                finish();
+                return buffer;
+            }
+
+            osmium::unsigned_object_id_type max_id = 0;
+            bool has_nodes = false;
+            bool only_nodes = true;
+            for (auto& object : buffer.select<osmium::OSMObject>()) {
+                if (object.type() == osmium::item_type::node) {
+                    has_nodes = true;
+                    if (object.id() > 0) {
+                        max_id = std::max(max_id, object.positive_id());
+                    }
+                } else {
+                    only_nodes = false;
+                }
+            }
+
+            if (has_nodes) {
+                const bool grown = m_loader.prepare(max_id, [this] {
+                    drain();
+                });
+                if (grown && m_phase_handler) {
+                    m_phase_handler->index_grown();
+                }
+            }
+
+            if (only_nodes) {
+                {
+                    std::lock_guard<std::mutex> lock{m_mutex};
+                    ++m_in_flight;
+                }
+                m_queue.push(std::move(buffer));
+                continue;
+            }
+
+            // nodes followed by other objects in the same buffer: load
+            // the nodes here and remove them from the buffer
+            if (has_nodes) {
+                m_loader.load(m_num_threads, buffer);
+                for (auto& object : buffer.select<osmium::OSMObject>()) {
+                    if (object.type() == osmium::item_type::node) {
+                        object.set_removed(true);
+                    }
+                }
+                no_callback callback;
+                buffer.purge_removed(&callback);
+            }
+            finish();
+            return buffer;
+        }
+    }
+
+    void close() {
+        m_source.close();
+    }
+
+}; // class ParallelIndexLoader
+
+#endif // OAT_INDEX_LOADER_HPP
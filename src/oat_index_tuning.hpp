@@ -0,0 +1,420 @@
+#ifndef OAT_INDEX_TUNING_HPP
+#define OAT_INDEX_TUNING_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Paging advice and TLB statistics for location indexes
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+#endif
+
+#include <osmium/handler.hpp>
+#include <osmium/index/map.hpp>
+#include <osmium/index/map/dense_file_array.hpp>
+#include <osmium/index/map/dense_mem_array.hpp>
+#include <osmium/index/map/dense_mmap_array.hpp>
+#include <osmium/index/map/sparse_file_array.hpp>
+#include <osmium/index/map/sparse_mem_array.hpp>
+#include <osmium/index/map/sparse_mmap_array.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/util/verbose_output.hpp>
+
+/**
+ * Counts data TLB load misses of the calling process using the Linux perf
+ * interface. If the counter is not available (other operating systems, or
+ * /proc/sys/kernel/perf_event_paranoid forbids it), valid() returns false
+ * and all other functions do nothing.
+ */
+class TLBMissCounter {
+
+    int m_fd = -1;
+
+public:
+
+    TLBMissCounter() {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;
+        m_fd = static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    TLBMissCounter(const TLBMissCounter&) = delete;
+    TLBMissCounter& operator=(const TLBMissCounter&) = delete;
+
+    ~TLBMissCounter() {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+
+    bool valid() const noexcept {
+        return m_fd >= 0;
+    }
+
+    void start() noexcept {
+#ifdef __linux__
+        if (valid()) {
+            ::ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ::ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    uint64_t stop() noexcept {
+        uint64_t count = 0;
+#ifdef __linux__
+        if (valid()) {
+            ::ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (::read(m_fd, &count, sizeof(count)) != sizeof(count)) {
+                count = 0;
+            }
+        }
+#endif
+        return count;
+    }
+
+}; // class TLBMissCounter
+
+/**
+ * Paging settings for the memory of a location index. The index is filled
+ * while reading the nodes ("fill" phase) and then queried in random order
+ * while reading the ways ("lookup" phase). Each phase can have its own
+ * madvise(2) advice, and the whole index can be locked into memory for
+ * the lookup phase.
+ */
+class IndexTuning {
+
+public:
+
+    enum class phase {
+        fill   = 0,
+        lookup = 1
+    };
+
+private:
+
+    // madvise() advice for each phase, several can be combined
+    std::vector<int> m_advice[2];
+
+    // number of bytes to mlock at the start of the lookup phase
+    std::size_t m_mlock_bytes = 0;
+
+    static int parse_advice(const std::string& name) {
+        if (name == "normal") {
+            return MADV_NORMAL;
+        } else if (name == "random") {
+            return MADV_RANDOM;
+        } else if (name == "sequential") {
+            return MADV_SEQUENTIAL;
+        } else if (name == "willneed") {
+            return MADV_WILLNEED;
+        }
+#ifdef MADV_HUGEPAGE
+        if (name == "hugepage") {
+            return MADV_HUGEPAGE;
+        } else if (name == "nohugepage") {
+            return MADV_NOHUGEPAGE;
+        }
+#endif
+        throw std::runtime_error{"Unknown index advice '" + name + "'"};
+    }
+
+    template <typename TMap>
+    static bool get_range(osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>& index, char*& data, std::size_t& size) {
+        auto* map = dynamic_cast<TMap*>(&index);
+        if (!map) {
+            return false;
+        }
+        if (map->begin() != map->end()) {
+            data = reinterpret_cast<char*>(&*map->begin());
+            size = static_cast<std::size_t>(map->end() - map->begin()) * sizeof(*map->begin());
+        }
+        return true;
+    }
+
+    /**
+     * Get the memory range used by the index data. Returns false if the
+     * index type is not known. If the index is still empty, data is set
+     * to nullptr.
+     */
+    static bool memory_range(osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>& index, char*& data, std::size_t& size) {
+        using id_type = osmium::unsigned_object_id_type;
+        using namespace osmium::index::map;
+
+        data = nullptr;
+        size = 0;
+
+        const bool known_type =
+            get_range<DenseMemArray<id_type, osmium::Location>>(index, data, size) ||
+            get_range<SparseMemArray<id_type, osmium::Location>>(index, data, size) ||
+#ifdef __linux__
+            get_range<DenseMmapArray<id_type, osmium::Location>>(index, data, size) ||
+            get_range<SparseMmapArray<id_type, osmium::Location>>(index, data, size) ||
+#endif
+            get_range<DenseFileArray<id_type, osmium::Location>>(index, data, size) ||
+            get_range<SparseFileArray<id_type, osmium::Location>>(index, data, size);
+
+        if (!known_type) {
+            return false;
+        }
+        if (!data) {
+            return true;
+        }
+
+        // madvise() and mlock() need page aligned addresses
+        const auto page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        const auto offset = reinterpret_cast<std::uintptr_t>(data) % page_size;
+        data -= offset;
+        size += offset;
+
+        return true;
+    }
+
+public:
+
+    /**
+     * Parse advice specification of the form "PHASE:ADVICE[,PHASE:ADVICE]"
+     * where PHASE is "fill" or "lookup" and ADVICE is one of "normal",
+     * "random", "sequential", "willneed", "hugepage", or "nohugepage".
+     * An ADVICE without PHASE applies to both phases. Several advices for
+     * the same phase are applied in order.
+     */
+    void set_advice(const std::string& spec) {
+        std::size_t pos = 0;
+        while (pos <= spec.size()) {
+            auto end = spec.find(',', pos);
+            if (end == std::string::npos) {
+                end = spec.size();
+            }
+            const std::string item = spec.substr(pos, end - pos);
+            const auto colon = item.find(':');
+            if (colon == std::string::npos) {
+                const int advice = parse_advice(item);
+                m_advice[0].push_back(advice);
+                m_advice[1].push_back(advice);
+            } else {
+                const std::string phase_name = item.substr(0, colon);
+                const int advice = parse_advice(item.substr(colon + 1));
+                if (phase_name == "fill") {
+                    m_advice[static_cast<int>(phase::fill)].push_back(advice);
+                } else if (phase_name == "lookup") {
+                    m_advice[static_cast<int>(phase::lookup)].push_back(advice);
+                } else {
+                    throw std::runtime_error{"Unknown index phase '" + phase_name + "'"};
+                }
+            }
+            pos = end + 1;
+        }
+    }
+
+    /**
+     * Lock up to the given number of megabytes of the index into memory
+     * during the lookup phase. 0 means no locking.
+     */
+    void set_mlock(std::size_t megabytes) noexcept {
+        if (megabytes > std::numeric_limits<std::size_t>::max() / (1024 * 1024)) {
+            set_mlock_all();
+        } else {
+            m_mlock_bytes = megabytes * 1024 * 1024;
+        }
+    }
+
+    /**
+     * Set the number of megabytes to lock from a command line argument.
+     * Returns false (and changes nothing) if the argument is not a number
+     * greater than 0.
+     */
+    bool parse_mlock(const char* megabytes) noexcept {
+        char* end = nullptr;
+        const unsigned long long value = std::strtoull(megabytes, &end, 10);
+        if (!std::isdigit(static_cast<unsigned char>(*megabytes)) || *end != '\0' || value == 0) {
+            return false;
+        }
+        set_mlock(value > std::numeric_limits<std::size_t>::max() ? std::numeric_limits<std::size_t>::max() : static_cast<std::size_t>(value));
+        return true;
+    }
+
+    void set_mlock_all() noexcept {
+        m_mlock_bytes = std::numeric_limits<std::size_t>::max();
+    }
+
+    bool enabled() const noexcept {
+        return !m_advice[0].empty() || !m_advice[1].empty() || m_mlock_bytes > 0;
+    }
+
+    /**
+     * Apply the settings for the given phase to the index. Problems are
+     * reported on the verbose output, they are never fatal.
+     */
+    void apply(osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>& index, phase p, osmium::util::VerboseOutput& vout) const {
+        const auto& advice = m_advice[static_cast<int>(p)];
+        const bool lock = p == phase::lookup && m_mlock_bytes > 0;
+        if (advice.empty() && !lock) {
+            return;
+        }
+
+        char* data;
+        std::size_t size;
+        if (!memory_range(index, data, size)) {
+            vout << "  Can not set paging advice for this index type.\n";
+            return;
+        }
+        if (!data) {
+            // empty index, nothing to advise yet
+            return;
+        }
+
+        for (const int a : advice) {
+            if (::madvise(data, size, a) != 0) {
+                vout << "  madvise() on location index failed: " << std::strerror(errno) << '\n';
+            }
+        }
+
+        if (lock) {
+            const std::size_t lock_size = std::min(size, m_mlock_bytes);
+            if (::mlock(data, lock_size) != 0) {
+                vout << "  mlock() of " << (lock_size / (1024 * 1024)) << "MB of location index failed: " << std::strerror(errno) << '\n';
+            } else {
+                vout << "  Locked " << (lock_size / (1024 * 1024)) << "MB of location index into memory.\n";
+            }
+        }
+    }
+
+}; // class IndexTuning
+
+/**
+ * Handler that has to be put in front of the location handler in the second
+ * pass. It applies the index tuning for each phase and measures time and
+ * TLB misses for the fill phase (nodes) and the lookup phase (ways). The
+ * TLB miss counter only covers threads started after the handler was
+ * created, so create it before any threads working on the index.
+ */
+class IndexPhaseHandler : public osmium::handler::Handler {
+
+    using clock = std::chrono::steady_clock;
+
+    osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>& m_index;
+    const IndexTuning& m_tuning;
+    osmium::util::VerboseOutput& m_vout;
+
+    TLBMissCounter m_tlb_counter;
+
+    clock::time_point m_phase_start;
+    double m_seconds[2] = { 0.0, 0.0 };
+    uint64_t m_tlb_misses[2] = { 0, 0 };
+
+    bool m_in_lookup_phase = false;
+
+    IndexTuning::phase current_phase() const noexcept {
+        return m_in_lookup_phase ? IndexTuning::phase::lookup : IndexTuning::phase::fill;
+    }
+
+    void start_phase(IndexTuning::phase p) {
+        m_tuning.apply(m_index, p, m_vout);
+        m_tlb_counter.start();
+        m_phase_start = clock::now();
+    }
+
+    void stop_phase(IndexTuning::phase p) {
+        const auto n = static_cast<int>(p);
+        m_seconds[n] = std::chrono::duration<double>(clock::now() - m_phase_start).count();
+        m_tlb_misses[n] = m_tlb_counter.stop();
+    }
+
+public:
+
+    IndexPhaseHandler(osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>& index, const IndexTuning& tuning, osmium::util::VerboseOutput& vout) :
+        m_index(index),
+        m_tuning(tuning),
+        m_vout(vout) {
+        start_phase(IndexTuning::phase::fill);
+    }
+
+    /**
+     * Apply the advice of the current phase again. The advice only
+     * covers the memory the index has when it is applied, so a loader
+     * growing the index has to call this after each step. (Indexes filled
+     * by the location handler only get the fill phase advice if they are
+     * not empty when this handler is created, for instance file based
+     * indexes that already exist.)
+     */
+    void index_grown() {
+        m_tuning.apply(m_index, current_phase(), m_vout);
+    }
+
+    /**
+     * Switch to the lookup phase, if that didn't happen yet. Called on the
+     * first way, or earlier by a loader that knows the index is complete.
+     */
+    void start_lookup_phase() {
+        if (!m_in_lookup_phase) {
+            m_in_lookup_phase = true;
+            stop_phase(IndexTuning::phase::fill);
+            start_phase(IndexTuning::phase::lookup);
+        }
+    }
+
+    void way(const osmium::Way&) {
+        start_lookup_phase();
+    }
+
+    /**
+     * Call after the second pass is done.
+     */
+    void finish() {
+        stop_phase(current_phase());
+    }
+
+    void print_report() const {
+        static const char* names[2] = { "fill (nodes):  ", "lookup (ways): " };
+        m_vout << "Location index phases:\n";
+        for (int n = 0; n < 2; ++n) {
+            m_vout << "  " << names[n] << static_cast<uint64_t>(m_seconds[n] * 1000) << "ms";
+            if (m_tlb_counter.valid()) {
+                m_vout << ", " << m_tlb_misses[n] << " dTLB load misses";
+            }
+            m_vout << '\n';
+        }
+        if (!m_tlb_counter.valid()) {
+            m_vout << "  (dTLB miss counter not available on this system)\n";
+        }
+    }
+
+}; // class IndexPhaseHandler
+
+#endif // OAT_INDEX_TUNING_HPP
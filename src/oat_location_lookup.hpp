@@ -0,0 +1,208 @@
+#ifndef OAT_LOCATION_LOOKUP_HPP
+#define OAT_LOCATION_LOOKUP_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Look up node locations for ways from several threads
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <osmium/index/index.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/node_ref.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "oat_work_queue.hpp"
+
+/**
+ * Data source for osmium::apply() that sets the node locations of all ways
+ * like the NodeLocationsForWays handler (with ignore_errors()), but from a
+ * number of worker threads. Buffers with ways are handed to the workers
+ * and handed on in the order they were read, so the handlers see the same
+ * sequence of objects as without this class.
+ *
+ * The workers only read from the index. Nodes coming after the first way
+ * (only in unsorted input) are collected and added to the index from the
+ * reading thread when the next buffer with ways arrives, after all pending
+ * lookups are done. So the index is sorted once for each switch from nodes
+ * to ways in the input, not for each buffer of nodes.
+ */
+template <typename TSource, typename TIndex>
+class ParallelLocationLookup {
+
+    using task_type = std::packaged_task<osmium::memory::Buffer()>;
+
+    class lookup_job {
+
+        const TIndex* m_index;
+        osmium::memory::Buffer m_buffer;
+
+        osmium::Location location(osmium::object_id_type id) const noexcept {
+            if (id < 0) {
+                return osmium::Location{};
+            }
+            try {
+                return m_index->get(static_cast<osmium::unsigned_object_id_type>(id));
+            } catch (const osmium::not_found&) {
+                return osmium::Location{};
+            }
+        }
+
+    public:
+
+        lookup_job(const TIndex& index, osmium::memory::Buffer&& buffer) :
+            m_index(&index),
+            m_buffer(std::move(buffer)) {
+        }
+
+        osmium::memory::Buffer operator()() {
+            for (auto& way : m_buffer.select<osmium::Way>()) {
+                for (auto& node_ref : way.nodes()) {
+                    node_ref.set_location(location(node_ref.ref()));
+                }
+            }
+            return std::move(m_buffer);
+        }
+
+    }; // class lookup_job
+
+    TSource& m_source;
+    TIndex& m_index;
+
+    // maximum number of buffers read ahead
+    std::size_t m_max_pending;
+
+    WorkQueue<task_type> m_queue;
+    std::deque<std::future<osmium::memory::Buffer>> m_pending;
+    std::vector<std::thread> m_threads;
+
+    // nodes not added to the index yet
+    std::vector<std::pair<osmium::unsigned_object_id_type, osmium::Location>> m_late_nodes;
+
+    bool m_source_done = false;
+
+    void worker() {
+        task_type task;
+        while (m_queue.pop(task)) {
+            task();
+        }
+    }
+
+    void collect_nodes(const osmium::memory::Buffer& buffer) {
+        for (const auto& node : buffer.select<osmium::Node>()) {
+            if (node.id() >= 0) {
+                m_late_nodes.emplace_back(node.positive_id(), node.location());
+            }
+        }
+    }
+
+    void add_late_nodes() {
+        for (auto& pending : m_pending) {
+            pending.wait();
+        }
+        for (const auto& node : m_late_nodes) {
+            m_index.set(node.first, node.second);
+        }
+        m_late_nodes.clear();
+        m_index.sort();
+    }
+
+    void read_ahead() {
+        while (!m_source_done && m_pending.size() < m_max_pending) {
+            osmium::memory::Buffer buffer = m_source.read();
+            if (!buffer) {
+                m_source_done = true;
+                return;
+            }
+
+            bool has_nodes = false;
+            bool has_ways = false;
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                if (object.type() == osmium::item_type::node) {
+                    has_nodes = true;
+                } else if (object.type() == osmium::item_type::way) {
+                    has_ways = true;
+                }
+            }
+
+            if (has_nodes) {
+                collect_nodes(buffer);
+            }
+
+            if (has_ways) {
+                if (!m_late_nodes.empty()) {
+                    add_late_nodes();
+                }
+                task_type task{lookup_job{m_index, std::move(buffer)}};
+                m_pending.push_back(task.get_future());
+                m_queue.push(std::move(task));
+            } else {
+                std::promise<osmium::memory::Buffer> ready;
+                ready.set_value(std::move(buffer));
+                m_pending.push_back(ready.get_future());
+            }
+        }
+    }
+
+    void stop_threads() {
+        m_queue.close();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+        m_threads.clear();
+    }
+
+public:
+
+    ParallelLocationLookup(TSource& source, TIndex& index, unsigned int num_threads) :
+        m_source(source),
+        m_index(index),
+        m_max_pending(num_threads * 4),
+        m_queue(num_threads * 4) {
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            m_threads.emplace_back(&ParallelLocationLookup::worker, this);
+        }
+    }
+
+    ParallelLocationLookup(const ParallelLocationLookup&) = delete;
+    ParallelLocationLookup& operator=(const ParallelLocationLookup&) = delete;
+
+    ~ParallelLocationLookup() {
+        stop_threads();
+    }
+
+    /**
+     * Get the next buffer in input order with all way node locations set.
+     * Rethrows exceptions from the workers.
+     */
+    osmium::memory::Buffer read() {
+        read_ahead();
+        if (m_pending.empty()) {
+            return osmium::memory::Buffer{};
+        }
+        auto future = std::move(m_pending.front());
+        m_pending.pop_front();
+        return future.get();
+    }
+
+    void close() {
+        m_source.close();
+    }
+
+}; // class ParallelLocationLookup
+
+#endif // OAT_LOCATION_LOOKUP_HPP
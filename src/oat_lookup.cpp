@@ -0,0 +1,545 @@
+/*****************************************************************************
+
+  OSM Area Tools - Find areas containing points
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <osmium/osm/types.hpp>
+#include <osmium/util/verbose_output.hpp>
+
+#include "oat.hpp"
+#include "oat_area_rings.hpp"
+#include "oat_area_store.hpp"
+#include "oat_work_queue.hpp"
+
+/**
+ * Index for the point-in-polygon test on areas with many points. The
+ * bounding box of the area is cut into horizontal slabs and each slab
+ * gets a list of the edges crossing it. A ray from a point only crosses
+ * edges in the slab of the point, so only those have to be looked at.
+ * The edges of each slab are kept in the order of their rings.
+ */
+class SlabIndex {
+
+    struct edge {
+        int32_t ax;
+        int32_t ay;
+        int32_t bx;
+        int32_t by;
+        uint32_t ring;
+    };
+
+    int32_t m_min_y;
+    int32_t m_max_y;
+    int64_t m_slab_height;
+
+    // start of the edges of each slab in m_edges, plus end of last slab
+    std::vector<uint32_t> m_offsets;
+    std::vector<edge> m_edges;
+
+    uint32_t slab(int32_t y) const noexcept {
+        return static_cast<uint32_t>((static_cast<int64_t>(y) - m_min_y) / m_slab_height);
+    }
+
+    template <typename TFunc>
+    static void for_each_edge(const AreaStore::area_view& area, TFunc&& func) {
+        for (uint32_t r = 0; r < area.num_rings(); ++r) {
+            const auto ring = area.ring(r);
+            for (uint32_t i = 0; i + 1 < ring.size(); ++i) {
+                func(edge{ring.x()[i], ring.y()[i], ring.x()[i + 1], ring.y()[i + 1], r});
+            }
+        }
+    }
+
+public:
+
+    SlabIndex(const AreaStore::area_view& area, uint32_t edges_per_slab) :
+        m_min_y(area.box().min_y),
+        m_max_y(area.box().max_y) {
+        const uint32_t num_edges = area.num_points() - area.num_rings();
+        const uint32_t num_slabs = std::max(1u, num_edges / edges_per_slab);
+        m_slab_height = (static_cast<int64_t>(m_max_y) - m_min_y) / num_slabs + 1;
+
+        m_offsets.assign(num_slabs + 2, 0);
+        for_each_edge(area, [this](const edge& e) {
+            const uint32_t last = slab(std::max(e.ay, e.by));
+            for (uint32_t s = slab(std::min(e.ay, e.by)); s <= last; ++s) {
+                ++m_offsets[s + 2];
+            }
+        });
+        for (std::size_t s = 2; s < m_offsets.size(); ++s) {
+            m_offsets[s] += m_offsets[s - 1];
+        }
+
+        m_edges.resize(m_offsets.back());
+        for_each_edge(area, [this](const edge& e) {
+            const uint32_t last = slab(std::max(e.ay, e.by));
+            for (uint32_t s = slab(std::min(e.ay, e.by)); s <= last; ++s) {
+                m_edges[m_offsets[s + 1]++] = e;
+            }
+        });
+        m_offsets.pop_back();
+    }
+
+    /**
+     * Is the point inside the area? Like AreaStore::area_view::contains()
+     * a point is inside a ring if the winding number of the ring around
+     * it is not 0, and inside the area if it is inside an odd number of
+     * rings. Points on the boundary are counted as inside. Gives the same
+     * result as area_view::contains().
+     */
+    bool contains(int32_t px, int32_t py) const noexcept {
+        if (py < m_min_y || py > m_max_y) {
+            return false;
+        }
+        const uint32_t s = slab(py);
+        bool inside = false;
+        uint32_t ring = 0;
+        int winding = 0;
+        for (uint32_t n = m_offsets[s]; n < m_offsets[s + 1]; ++n) {
+            const edge& e = m_edges[n];
+            if (e.ring != ring) {
+                inside ^= (winding != 0);
+                winding = 0;
+                ring = e.ring;
+            }
+            if (e.ay <= py) {
+                if (e.by > py) {
+                    const int o = orientation(e.ax, e.ay, e.bx, e.by, px, py);
+                    if (o == 0) {
+                        return true;
+                    }
+                    if (o > 0) {
+                        ++winding;
+                    }
+                } else if (e.by == py && e.ay == py) {
+                    if ((e.ax <= px && px <= e.bx) || (e.bx <= px && px <= e.ax)) {
+                        return true;
+                    }
+                } else if (e.by == py && e.bx == px) {
+                    return true;
+                }
+            } else if (e.by <= py) {
+                const int o = orientation(e.ax, e.ay, e.bx, e.by, px, py);
+                if (o == 0) {
+                    return true;
+                }
+                if (o < 0) {
+                    --winding;
+                }
+            }
+        }
+        return inside ^ (winding != 0);
+    }
+
+}; // class SlabIndex
+
+/**
+ * Finds all areas in an area store containing a point.
+ */
+class AreaLookup {
+
+    const AreaStore& m_store;
+
+    // slab index for each area with many points (indexed by position in
+    // the store), nullptr for other areas
+    std::vector<std::unique_ptr<SlabIndex>> m_indexes;
+
+public:
+
+    AreaLookup(const AreaStore& store, uint32_t min_points, unsigned int num_threads) :
+        m_store(store),
+        m_indexes(store.size()) {
+        std::atomic<std::size_t> next{0};
+        std::vector<std::thread> threads;
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            threads.emplace_back([this, &next, min_points]() {
+                while (true) {
+                    const std::size_t n = next++;
+                    if (n >= m_store.size()) {
+                        break;
+                    }
+                    const auto area = m_store.at(n);
+                    if (area.num_points() >= min_points) {
+                        m_indexes[n].reset(new SlabIndex{area, 8});
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    std::size_t num_indexed() const noexcept {
+        return std::count_if(m_indexes.begin(), m_indexes.end(), [](const std::unique_ptr<SlabIndex>& index) {
+            return !!index;
+        });
+    }
+
+    /**
+     * Add the ids of all areas containing the point to result.
+     */
+    void lookup(int32_t x, int32_t y, std::vector<osmium::object_id_type>& result) const {
+        m_store.tree().search(rtree_box{x, y, x, y}, [this, x, y, &result](uint32_t n) {
+            const auto& index = m_indexes[n];
+            const auto area = m_store.at(n);
+            if (index ? index->contains(x, y) : area.contains(x, y)) {
+                result.push_back(area.id());
+            }
+        });
+        std::sort(result.begin(), result.end());
+    }
+
+}; // class AreaLookup
+
+/**
+ * Reads points (one per line, "LON LAT" with anything after it ignored)
+ * from a file descriptor in batches, looks them up in parallel and writes
+ * each input line followed by a tab and the ids of all areas containing
+ * the point to the output file descriptor. The order of the lines is
+ * kept. The worker threads are started once and get the ranges of lines
+ * of each batch through a queue.
+ */
+class BatchProcessor {
+
+    using range = std::pair<std::size_t, std::size_t>;
+
+    const AreaLookup& m_lookup;
+    unsigned int m_num_threads;
+    std::size_t m_batch_size;
+
+    std::vector<std::string> m_lines;
+    std::vector<std::string> m_results;
+
+    WorkQueue<range> m_queue;
+
+    std::mutex m_mutex;
+    std::condition_variable m_done;
+    std::size_t m_in_flight = 0;
+
+    // first error in one of the worker threads, rethrown after the batch
+    std::exception_ptr m_error{nullptr};
+
+    std::vector<std::thread> m_threads;
+
+    static bool parse_point(const std::string& line, int32_t& x, int32_t& y) {
+        const char* str = line.c_str();
+        char* end;
+        const double lon = std::strtod(str, &end);
+        if (end == str) {
+            return false;
+        }
+        str = end;
+        const double lat = std::strtod(str, &end);
+        if (end == str || lon < -180.0 || lon > 180.0 || lat < -90.0 || lat > 90.0) {
+            return false;
+        }
+        x = static_cast<int32_t>(std::lround(lon * 10000000.0));
+        y = static_cast<int32_t>(std::lround(lat * 10000000.0));
+        return true;
+    }
+
+    void process_range(std::size_t begin, std::size_t end) {
+        std::vector<osmium::object_id_type> ids;
+        for (std::size_t n = begin; n < end; ++n) {
+            std::string& out = m_results[n];
+            out = m_lines[n];
+            out += '\t';
+            int32_t x;
+            int32_t y;
+            if (parse_point(m_lines[n], x, y)) {
+                ids.clear();
+                m_lookup.lookup(x, y, ids);
+                for (std::size_t i = 0; i < ids.size(); ++i) {
+                    if (i > 0) {
+                        out += ' ';
+                    }
+                    out += std::to_string(ids[i]);
+                }
+            } else {
+                out += "ERROR";
+            }
+            out += '\n';
+        }
+    }
+
+    void worker() {
+        range r;
+        while (m_queue.pop(r)) {
+            try {
+                process_range(r.first, r.second);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{m_mutex};
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock{m_mutex};
+                --m_in_flight;
+            }
+            m_done.notify_all();
+        }
+    }
+
+    void process_batch(int out_fd) {
+        m_results.resize(m_lines.size());
+        const std::size_t chunk = (m_lines.size() + m_num_threads - 1) / m_num_threads;
+        for (std::size_t begin = 0; begin < m_lines.size(); begin += chunk) {
+            {
+                std::lock_guard<std::mutex> lock{m_mutex};
+                ++m_in_flight;
+            }
+            m_queue.push(range{begin, std::min(begin + chunk, m_lines.size())});
+        }
+        {
+            std::unique_lock<std::mutex> lock{m_mutex};
+            m_done.wait(lock, [this] {
+                return m_in_flight == 0;
+            });
+            if (m_error) {
+                std::exception_ptr error{nullptr};
+                std::swap(error, m_error);
+                m_lines.clear();
+                std::rethrow_exception(error);
+            }
+        }
+
+        std::string output;
+        for (const auto& result : m_results) {
+            output += result;
+        }
+        const char* ptr = output.data();
+        std::size_t size = output.size();
+        while (size > 0) {
+            const auto written = ::write(out_fd, ptr, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Write failed"};
+            }
+            ptr += written;
+            size -= static_cast<std::size_t>(written);
+        }
+
+        m_lines.clear();
+    }
+
+public:
+
+    BatchProcessor(const AreaLookup& lookup, unsigned int num_threads, std::size_t batch_size) :
+        m_lookup(lookup),
+        m_num_threads(num_threads),
+        m_batch_size(batch_size),
+        m_queue(num_threads) {
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            m_threads.emplace_back(&BatchProcessor::worker, this);
+        }
+    }
+
+    BatchProcessor(const BatchProcessor&) = delete;
+    BatchProcessor& operator=(const BatchProcessor&) = delete;
+
+    ~BatchProcessor() {
+        m_queue.close();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Process all lines from in_fd until end of file. A partial batch is
+     * processed as soon as no more input is immediately available, so
+     * interactive clients get their answers without waiting for a full
+     * batch.
+     */
+    void process(int in_fd, int out_fd) {
+        m_lines.clear();
+        std::string partial;
+        char buffer[64 * 1024];
+        while (true) {
+            const auto length = ::read(in_fd, buffer, sizeof(buffer));
+            if (length < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Read failed"};
+            }
+            if (length == 0) {
+                break;
+            }
+            partial.append(buffer, static_cast<std::size_t>(length));
+            std::size_t start = 0;
+            std::size_t nl;
+            while ((nl = partial.find('\n', start)) != std::string::npos) {
+                m_lines.emplace_back(partial, start, nl - start);
+                start = nl + 1;
+                if (m_lines.size() >= m_batch_size) {
+                    process_batch(out_fd);
+                }
+            }
+            partial.erase(0, start);
+            if (static_cast<std::size_t>(length) < sizeof(buffer) && !m_lines.empty()) {
+                process_batch(out_fd);
+            }
+        }
+        if (!partial.empty()) {
+            m_lines.push_back(partial);
+        }
+        if (!m_lines.empty()) {
+            process_batch(out_fd);
+        }
+    }
+
+}; // class BatchProcessor
+
+void serve_socket(const std::string& path, BatchProcessor& processor, osmium::util::VerboseOutput& vout) {
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::system_error{errno, std::system_category(), "Can not create socket"};
+    }
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error{"Socket path too long"};
+    }
+    std::strcpy(address.sun_path, path.c_str());
+
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        throw std::system_error{errno, std::system_category(), "Can not bind socket '" + path + "'"};
+    }
+    if (::listen(fd, 16) != 0) {
+        throw std::system_error{errno, std::system_category(), "Can not listen on socket '" + path + "'"};
+    }
+
+    vout << "Listening on socket '" << path << "'...\n";
+    while (true) {
+        const int connection = ::accept(fd, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error{errno, std::system_category(), "Accept on socket failed"};
+        }
+        try {
+            processor.process(connection, connection);
+        } catch (const std::system_error& e) {
+            std::cerr << e.what() << '\n';
+        }
+        ::close(connection);
+    }
+}
+
+void print_help() {
+    std::cout << "oat_lookup [OPTIONS] STORE_DIR\n\n"
+              << "Find areas containing points. Reads areas from the area store written\n"
+              << "by 'oat_create_areas --output-store=STORE_DIR' and points (one 'LON LAT'\n"
+              << "per line) from stdin or a socket.\n"
+              << "\nOptions:\n"
+              << "  -b, --batch-size=NUM       Number of points looked up together (default: 65536)\n"
+              << "  -g, --grid-min-points=NUM  Index areas with at least NUM points (default: 256)\n"
+              << "  -h, --help                 This help message\n"
+              << "  -s, --socket=PATH          Listen on unix domain socket PATH instead of stdin\n"
+              << "  -t, --threads=NUM          Number of threads (default: number of cores)\n"
+              ;
+}
+
+int main(int argc, char* argv[]) {
+    osmium::util::VerboseOutput vout{true};
+
+    static const struct option long_options[] = {
+        {"batch-size",      required_argument, 0, 'b'},
+        {"grid-min-points", required_argument, 0, 'g'},
+        {"help",            no_argument,       0, 'h'},
+        {"socket",          required_argument, 0, 's'},
+        {"threads",         required_argument, 0, 't'},
+        {0, 0, 0, 0}
+    };
+
+    std::size_t batch_size = 65536;
+    uint32_t grid_min_points = 256;
+    std::string socket_path;
+    unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    while (true) {
+        int c = getopt_long(argc, argv, "b:g:hs:t:", long_options, 0);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+            case 'b':
+                batch_size = std::max(1, std::atoi(optarg));
+                break;
+            case 'g':
+                grid_min_points = std::max(4, std::atoi(optarg));
+                break;
+            case 'h':
+                print_help();
+                exit(exit_code_ok);
+            case 's':
+                socket_path = optarg;
+                break;
+            case 't':
+                num_threads = std::max(1, std::atoi(optarg));
+                break;
+            default:
+                exit(exit_code_cmdline_error);
+        }
+    }
+
+    int remaining_args = argc - optind;
+    if (remaining_args != 1) {
+        std::cerr << "Usage: " << argv[0] << " [OPTIONS] STORE_DIR\n";
+        exit(exit_code_cmdline_error);
+    }
+
+    try {
+        const AreaStore store{std::string{argv[optind]} + "/areas.store"};
+        vout << "Building index for " << store.size() << " areas...\n";
+        const AreaLookup lookup{store, grid_min_points, num_threads};
+        vout << "Indexed " << lookup.num_indexed() << " areas with at least " << grid_min_points << " points.\n";
+
+        BatchProcessor processor{lookup, num_threads, batch_size};
+        if (socket_path.empty()) {
+            processor.process(0, 1);
+        } else {
+            serve_socket(socket_path, processor, vout);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(exit_code_error);
+    }
+
+    return exit_code_ok;
+}
@@ -0,0 +1,546 @@
+/*****************************************************************************
+
+  OSM Area Tools - Find overlapping areas
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include <gdal_priv.h>
+#include <ogrsf_frmts.h>
+
+#include <geos_c.h>
+
+#include <sqlite.hpp>
+
+#include <osmium/util/memory.hpp>
+#include <osmium/util/verbose_output.hpp>
+
+#include "oat.hpp"
+#include "oat_rtree.hpp"
+
+/**
+ * All areas read from the input database. The geometries are kept as WKB
+ * in one large buffer, each thread creates its own GEOS geometries from it.
+ */
+class AreaList {
+
+    std::vector<int64_t> m_ids;
+    std::vector<rtree_box> m_boxes;
+    std::vector<double> m_areas;
+    std::vector<std::size_t> m_wkb_offsets{0};
+    std::vector<unsigned char> m_wkb;
+
+    static int32_t to_fix(double coordinate, bool round_up) noexcept {
+        const double value = coordinate * 10000000.0;
+        return static_cast<int32_t>(round_up ? std::ceil(value) : std::floor(value));
+    }
+
+public:
+
+    void add(int64_t id, const OGRGeometry& geom) {
+        OGREnvelope envelope;
+        geom.getEnvelope(&envelope);
+
+        m_ids.push_back(id);
+        m_boxes.emplace_back(to_fix(envelope.MinX, false), to_fix(envelope.MinY, false),
+                             to_fix(envelope.MaxX, true), to_fix(envelope.MaxY, true));
+        m_areas.push_back(OGR_G_Area(reinterpret_cast<OGRGeometryH>(const_cast<OGRGeometry*>(&geom))));
+
+        const std::size_t offset = m_wkb.size();
+        m_wkb.resize(offset + geom.WkbSize());
+        geom.exportToWkb(wkbNDR, m_wkb.data() + offset);
+        m_wkb_offsets.push_back(m_wkb.size());
+    }
+
+    std::size_t size() const noexcept {
+        return m_ids.size();
+    }
+
+    int64_t id(std::size_t n) const noexcept {
+        return m_ids[n];
+    }
+
+    const std::vector<rtree_box>& boxes() const noexcept {
+        return m_boxes;
+    }
+
+    // area in square degrees
+    double area(std::size_t n) const noexcept {
+        return m_areas[n];
+    }
+
+    const unsigned char* wkb(std::size_t n) const noexcept {
+        return m_wkb.data() + m_wkb_offsets[n];
+    }
+
+    std::size_t wkb_size(std::size_t n) const noexcept {
+        return m_wkb_offsets[n + 1] - m_wkb_offsets[n];
+    }
+
+}; // class AreaList
+
+struct overlap {
+    int64_t id1;
+    int64_t id2;
+
+    // area of the intersection in square meters
+    double area;
+
+    // area of the intersection relative to the smaller of the two areas
+    double ratio;
+
+    bool operator<(const overlap& other) const noexcept {
+        return id1 < other.id1 || (id1 == other.id1 && id2 < other.id2);
+    }
+};
+
+/**
+ * Does the work for one thread. All areas are tested against each other
+ * tile by tile. A pair of areas is only tested in the tile that contains
+ * the lower left corner of the intersection of their bounding boxes, so
+ * every pair is tested exactly once, whichever thread processes the tile.
+ * That corner lies in the bounding boxes of both areas, so for each area
+ * in the tile only the part of its box inside the tile has to be searched
+ * for the other area.
+ *
+ * A thread works on a whole row of tiles from west to east. The GEOS
+ * geometries (and prepared geometries) of the areas are kept until the
+ * row has passed their bounding box, so areas larger than a tile are only
+ * parsed and prepared once per row.
+ */
+class OverlapWorker {
+
+    struct geos_deleter {
+        GEOSContextHandle_t context;
+        void operator()(GEOSGeometry* geom) const noexcept {
+            GEOSGeom_destroy_r(context, geom);
+        }
+    };
+
+    struct prepared_deleter {
+        GEOSContextHandle_t context;
+        void operator()(const GEOSPreparedGeometry* prepared) const noexcept {
+            GEOSPreparedGeom_destroy_r(context, prepared);
+        }
+    };
+
+    using geos_ptr = std::unique_ptr<GEOSGeometry, geos_deleter>;
+    using prepared_ptr = std::unique_ptr<const GEOSPreparedGeometry, prepared_deleter>;
+
+    struct cached_geometry {
+        geos_ptr geom;
+
+        // created when first needed, destroyed before geom
+        prepared_ptr prepared;
+    };
+
+    const AreaList& m_areas;
+    const PackedRTree& m_tree;
+
+    GEOSContextHandle_t m_context;
+    GEOSWKBReader* m_reader;
+
+    // GEOS geometries of the areas in the current and following tiles
+    // of the row
+    std::unordered_map<uint32_t, cached_geometry> m_geometries;
+
+    std::vector<uint32_t> m_candidates;
+
+    std::vector<overlap> m_overlaps;
+    uint64_t m_pairs_tested = 0;
+    uint64_t m_errors = 0;
+
+    double m_min_area;
+
+    cached_geometry& cached(uint32_t n) {
+        auto it = m_geometries.find(n);
+        if (it != m_geometries.end()) {
+            return it->second;
+        }
+        cached_geometry c{
+            geos_ptr{GEOSWKBReader_read_r(m_context, m_reader, m_areas.wkb(n), m_areas.wkb_size(n)), geos_deleter{m_context}},
+            prepared_ptr{nullptr, prepared_deleter{m_context}}
+        };
+        return m_geometries.emplace(n, std::move(c)).first->second;
+    }
+
+    GEOSGeometry* geometry(uint32_t n) {
+        return cached(n).geom.get();
+    }
+
+    const GEOSPreparedGeometry* prepared(uint32_t n) {
+        auto& c = cached(n);
+        if (!c.prepared && c.geom) {
+            c.prepared.reset(GEOSPrepare_r(m_context, c.geom.get()));
+        }
+        return c.prepared.get();
+    }
+
+    // Forget the geometries of areas ending west of x.
+    void evict(int32_t x) {
+        const auto& boxes = m_areas.boxes();
+        for (auto it = m_geometries.begin(); it != m_geometries.end();) {
+            if (boxes[it->first].max_x < x) {
+                it = m_geometries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // square degrees to square meters at the given latitude
+    static double to_square_meters(double square_degrees, int32_t y) noexcept {
+        const double meters_per_degree = 111319.49;
+        return square_degrees * meters_per_degree * meters_per_degree * std::cos(y / 10000000.0 * 3.14159265358979323846 / 180.0);
+    }
+
+    void test_pair(uint32_t i, uint32_t j, const GEOSPreparedGeometry* prepared, int32_t y) {
+        ++m_pairs_tested;
+        GEOSGeometry* other = geometry(j);
+        if (!other) {
+            ++m_errors;
+            return;
+        }
+
+        const char intersects = GEOSPreparedIntersects_r(m_context, prepared, other);
+        if (intersects == 2) {
+            ++m_errors;
+            return;
+        }
+        if (!intersects) {
+            return;
+        }
+
+        geos_ptr intersection{GEOSIntersection_r(m_context, geometry(i), other), geos_deleter{m_context}};
+        double area = 0.0;
+        if (!intersection || !GEOSArea_r(m_context, intersection.get(), &area)) {
+            ++m_errors;
+            return;
+        }
+
+        const double area_m2 = to_square_meters(area, y);
+        if (area > 0.0 && area_m2 >= m_min_area) {
+            const double smaller = std::min(m_areas.area(i), m_areas.area(j));
+            m_overlaps.push_back(overlap{m_areas.id(i), m_areas.id(j), area_m2, smaller > 0.0 ? area / smaller : 0.0});
+        }
+    }
+
+public:
+
+    OverlapWorker(const AreaList& areas, const PackedRTree& tree, double min_area) :
+        m_areas(areas),
+        m_tree(tree),
+        m_context(GEOS_init_r()),
+        m_reader(GEOSWKBReader_create_r(m_context)),
+        m_min_area(min_area) {
+    }
+
+    OverlapWorker(const OverlapWorker&) = delete;
+    OverlapWorker& operator=(const OverlapWorker&) = delete;
+
+    ~OverlapWorker() {
+        m_geometries.clear();
+        GEOSWKBReader_destroy_r(m_context, m_reader);
+        GEOS_finish_r(m_context);
+    }
+
+    /**
+     * Test all pairs of areas that belong to the tile. Tiles are squares
+     * of tile_size starting at the lower left corner of the extent.
+     */
+    void process_tile(const rtree_box& tile, int64_t tile_size, const rtree_box& extent) {
+        const auto tile_column = (static_cast<int64_t>(tile.min_x) - extent.min_x) / tile_size;
+        const auto tile_row = (static_cast<int64_t>(tile.min_y) - extent.min_y) / tile_size;
+        const auto& boxes = m_areas.boxes();
+
+        m_tree.search(tile, [&](uint32_t i) {
+            const rtree_box& box = boxes[i];
+            const rtree_box search_box{std::max(box.min_x, tile.min_x), std::max(box.min_y, tile.min_y),
+                                       std::min(box.max_x, tile.max_x), std::min(box.max_y, tile.max_y)};
+            m_candidates.clear();
+            m_tree.search(search_box, [&](uint32_t j) {
+                if (j <= i) {
+                    return;
+                }
+                // lower left corner of the intersection of both boxes
+                const int64_t x = std::max(box.min_x, boxes[j].min_x);
+                const int64_t y = std::max(box.min_y, boxes[j].min_y);
+                if ((x - extent.min_x) / tile_size == tile_column &&
+                    (y - extent.min_y) / tile_size == tile_row) {
+                    m_candidates.push_back(j);
+                }
+            });
+
+            if (m_candidates.empty()) {
+                return;
+            }
+
+            const GEOSPreparedGeometry* prepared_geom = prepared(i);
+            if (!prepared_geom) {
+                ++m_errors;
+                return;
+            }
+            const int32_t y = box.min_y / 2 + box.max_y / 2;
+            for (const uint32_t j : m_candidates) {
+                test_pair(i, j, prepared_geom, y);
+            }
+        });
+    }
+
+    /**
+     * Process a row of count tiles from west to east.
+     */
+    void process_row(const rtree_box* tiles, std::size_t count, int64_t tile_size, const rtree_box& extent) {
+        for (std::size_t n = 0; n < count; ++n) {
+            process_tile(tiles[n], tile_size, extent);
+            if (n + 1 < count) {
+                evict(tiles[n + 1].min_x);
+            }
+        }
+        m_geometries.clear();
+    }
+
+    std::vector<overlap>& overlaps() noexcept {
+        return m_overlaps;
+    }
+
+    uint64_t pairs_tested() const noexcept {
+        return m_pairs_tested;
+    }
+
+    uint64_t errors() const noexcept {
+        return m_errors;
+    }
+
+}; // class OverlapWorker
+
+void read_areas(const std::string& filename, AreaList& areas) {
+    GDALAllRegister();
+
+    std::unique_ptr<GDALDataset, void(*)(GDALDataset*)> dataset{
+        static_cast<GDALDataset*>(GDALOpenEx(filename.c_str(), GDAL_OF_VECTOR | GDAL_OF_READONLY, nullptr, nullptr, nullptr)),
+        [](GDALDataset* ds) { GDALClose(ds); }
+    };
+    if (!dataset) {
+        throw std::runtime_error{"Can not open database '" + filename + "'"};
+    }
+
+    OGRLayer* layer = dataset->GetLayerByName("areas");
+    if (!layer) {
+        throw std::runtime_error{"No 'areas' layer in database '" + filename + "'"};
+    }
+
+    layer->ResetReading();
+    while (OGRFeature* feature = layer->GetNextFeature()) {
+        const OGRGeometry* geom = feature->GetGeometryRef();
+        if (geom && !geom->IsEmpty()) {
+            areas.add(feature->GetFieldAsInteger64("id"), *geom);
+        }
+        OGRFeature::DestroyFeature(feature);
+    }
+}
+
+void write_overlaps(const std::string& filename, const std::vector<overlap>& overlaps) {
+    Sqlite::Database db{filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE};
+    db.exec("CREATE TABLE overlaps (id1 INTEGER, id2 INTEGER, area REAL, ratio REAL);");
+
+    db.begin_transaction();
+    Sqlite::Statement statement{db, "INSERT INTO overlaps (id1, id2, area, ratio) VALUES (?, ?, ?, ?);"};
+    for (const auto& o : overlaps) {
+        statement.bind_int64(o.id1);
+        statement.bind_int64(o.id2);
+        statement.bind_double(o.area);
+        statement.bind_double(o.ratio);
+        statement.execute();
+    }
+    db.commit();
+}
+
+void print_help() {
+    std::cout << "oat_overlaps [OPTIONS] AREAS_DB\n\n"
+              << "Find overlapping areas in the output of oat_create_areas.\n"
+              << "\nOptions:\n"
+              << "  -h, --help               This help message\n"
+              << "  -m, --min-area=M2        Minimum area of overlap in m² (default: 0)\n"
+              << "  -o, --output=DBNAME      Output database name (default: overlaps.db)\n"
+              << "  -O, --overwrite          Overwrite existing database\n"
+              << "  -t, --threads=NUM        Number of threads (default: number of cores)\n"
+              << "  -T, --tile-size=DEGREES  Size of tiles the work is split into (default: 1)\n"
+              ;
+}
+
+int main(int argc, char* argv[]) {
+    osmium::util::VerboseOutput vout{true};
+
+    static const struct option long_options[] = {
+        {"help",      no_argument,       0, 'h'},
+        {"min-area",  required_argument, 0, 'm'},
+        {"output",    required_argument, 0, 'o'},
+        {"overwrite", no_argument,       0, 'O'},
+        {"threads",   required_argument, 0, 't'},
+        {"tile-size", required_argument, 0, 'T'},
+        {0, 0, 0, 0}
+    };
+
+    std::string output{"overlaps.db"};
+    bool overwrite = false;
+    double min_area = 0.0;
+    double tile_size_degrees = 1.0;
+    unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    while (true) {
+        int c = getopt_long(argc, argv, "hm:o:Ot:T:", long_options, 0);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+            case 'h':
+                print_help();
+                exit(exit_code_ok);
+            case 'm':
+                min_area = std::atof(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'O':
+                overwrite = true;
+                break;
+            case 't':
+                num_threads = std::max(1, std::atoi(optarg));
+                break;
+            case 'T':
+                tile_size_degrees = std::atof(optarg);
+                if (tile_size_degrees <= 0.0) {
+                    std::cerr << "Tile size must be larger than 0\n";
+                    exit(exit_code_cmdline_error);
+                }
+                break;
+            default:
+                exit(exit_code_cmdline_error);
+        }
+    }
+
+    int remaining_args = argc - optind;
+    if (remaining_args != 1) {
+        std::cerr << "Usage: " << argv[0] << " [OPTIONS] AREAS_DB\n";
+        exit(exit_code_cmdline_error);
+    }
+
+    if (overwrite) {
+        unlink(output.c_str());
+    } else if (access(output.c_str(), F_OK) == 0) {
+        std::cerr << "Output database '" << output << "' exists (use --overwrite to replace it)\n";
+        exit(exit_code_error);
+    }
+
+    AreaList areas;
+
+    vout << "Reading areas...\n";
+    try {
+        read_areas(argv[optind], areas);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << '\n';
+        exit(exit_code_error);
+    }
+    vout << "Read " << areas.size() << " areas.\n";
+
+    vout << "Building spatial index...\n";
+    const PackedRTree tree{areas.boxes()};
+
+    rtree_box extent;
+    for (const auto& box : areas.boxes()) {
+        extent.extend(box);
+    }
+
+    const int64_t tile_size = std::max(int64_t(1), static_cast<int64_t>(tile_size_degrees * 10000000.0));
+    std::vector<rtree_box> tiles;
+    std::size_t tiles_per_row = 0;
+    if (extent.valid()) {
+        tiles_per_row = static_cast<std::size_t>((static_cast<int64_t>(extent.max_x) - extent.min_x) / tile_size + 1);
+        for (int64_t y = extent.min_y; y <= extent.max_y; y += tile_size) {
+            for (int64_t x = extent.min_x; x <= extent.max_x; x += tile_size) {
+                tiles.emplace_back(static_cast<int32_t>(x),
+                                   static_cast<int32_t>(y),
+                                   static_cast<int32_t>(std::min(x + tile_size - 1, int64_t(extent.max_x))),
+                                   static_cast<int32_t>(std::min(y + tile_size - 1, int64_t(extent.max_y))));
+            }
+        }
+    }
+
+    vout << "Testing areas in " << tiles.size() << " tiles with " << num_threads << " threads...\n";
+
+    std::vector<std::unique_ptr<OverlapWorker>> workers;
+    for (unsigned int i = 0; i < num_threads; ++i) {
+        workers.emplace_back(new OverlapWorker{areas, tree, min_area});
+    }
+
+    std::atomic<std::size_t> next_row{0};
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        OverlapWorker* w = worker.get();
+        threads.emplace_back([w, &tiles, tiles_per_row, &next_row, tile_size, &extent]() {
+            while (true) {
+                const std::size_t first = next_row++ * tiles_per_row;
+                if (first >= tiles.size()) {
+                    break;
+                }
+                w->process_row(tiles.data() + first, tiles_per_row, tile_size, extent);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::vector<overlap> overlaps;
+    uint64_t pairs_tested = 0;
+    uint64_t errors = 0;
+    for (auto& worker : workers) {
+        overlaps.insert(overlaps.end(), worker->overlaps().begin(), worker->overlaps().end());
+        pairs_tested += worker->pairs_tested();
+        errors += worker->errors();
+    }
+    workers.clear();
+    std::sort(overlaps.begin(), overlaps.end());
+
+    vout << "Tested " << pairs_tested << " pairs of areas, found " << overlaps.size() << " overlaps.\n";
+    if (errors) {
+        vout << "GEOS errors (probably invalid geometries): " << errors << '\n';
+    }
+
+    vout << "Writing overlaps to database...\n";
+    try {
+        write_overlaps(output, overlaps);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(exit_code_error);
+    }
+
+    osmium::MemoryUsage mcheck;
+    vout << "Actual memory usage:\n"
+         << "  current: " << mcheck.current() << "MB\n"
+         << "  peak:    " << mcheck.peak() << "MB\n";
+
+    vout << "Done.\n";
+
+    return exit_code_ok;
+}
@@ -29,6 +29,7 @@
 #include <osmium/visitor.hpp>
 
 #include "oat.hpp"
+#include "oat_area_filter.hpp"
 
 using index_type = osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>;
 using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
@@ -47,10 +48,17 @@ void print_help() {
 
 using collector_type = osmium::area::MultipolygonCollector<osmium::area::Assembler>;
 
-void read_relations(collector_type& collector, const osmium::io::File& file) {
+/**
+ * Read relations in the first pass, the ids of their member ways are
+ * added to member_ways.
+ */
+void read_relations(collector_type& collector, const osmium::io::File& file, IdSet& member_ways) {
+    const AreaFilter all;
     osmium::io::Reader reader(file, osmium::osm_entity_bits::relation);
-    collector.read_relations(reader);
+    FilteringReader<SelectedRelations> source{reader, SelectedRelations{all, member_ways}};
+    collector.read_relations(source);
     reader.close();
+    member_ways.sort();
 }
 
 osmium::osm_entity_bits::type entity_bits(const std::string& location_index_type) {
@@ -127,7 +135,8 @@ int main(int argc, char* argv[]) {
     collector_type collector(assembler_config);
 
     vout << "Starting first pass (reading relations)...\n";
-    read_relations(collector, input_file);
+    IdSet member_ways;
+    read_relations(collector, input_file, member_ways);
     vout << "First pass done.\n";
 
     vout << "Memory:\n";
@@ -135,11 +144,13 @@ int main(int argc, char* argv[]) {
 
     vout << "Starting second pass (reading nodes and ways and assembling areas)...\n";
     osmium::io::Reader reader2(input_file, entity_bits(location_index_type));
+    const AreaFilter all;
+    FilteringReader<SelectedWays> source2{reader2, SelectedWays{all, member_ways}};
 
     if (location_index_type == "none") {
-        osmium::apply(reader2, collector.handler([](osmium::memory::Buffer&&){}));
+        osmium::apply(source2, collector.handler([](osmium::memory::Buffer&&){}));
     } else {
-        osmium::apply(reader2, location_handler, collector.handler([](osmium::memory::Buffer&&){}));
+        osmium::apply(source2, location_handler, collector.handler([](osmium::memory::Buffer&&){}));
     }
 
     reader2.close();
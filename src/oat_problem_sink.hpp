@@ -0,0 +1,413 @@
+#ifndef OAT_PROBLEM_SINK_HPP
+#define OAT_PROBLEM_SINK_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Buffered problem reporting for several threads
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gdalcpp.hpp>
+
+#include <osmium/area/problem_reporter.hpp>
+#include <osmium/area/problem_reporter_ogr.hpp>
+#include <osmium/area/problem_reporter_stream.hpp>
+#include <osmium/osm/types.hpp>
+
+#include "oat_work_queue.hpp"
+
+/**
+ * Destination for the problems found by assemblers running in one or more
+ * threads. Each thread gets its own problem reporter from reporter() to
+ * put into its assembler config. The problems are collected in a buffer
+ * belonging to that thread and written to the final destination in large
+ * batches. A thread calls flush() at points where it isn't assembling an
+ * area (for instance in the callback of the multipolygon collector) to
+ * hand over its buffer once it is large enough. After all threads are
+ * done, close() writes out everything.
+ */
+class ProblemSink {
+
+public:
+
+    /**
+     * Problem buffer not bound to any thread. Used for assembling an
+     * object in some other thread, its problems are only added to the
+     * sink by calling append() once the object is done.
+     */
+    class buffer {
+
+    public:
+
+        virtual ~buffer() = default;
+
+        virtual osmium::area::ProblemReporter* reporter() = 0;
+
+    }; // class buffer
+
+    virtual ~ProblemSink() = default;
+
+    /**
+     * The problem reporter for the calling thread. It stays the same
+     * until the sink is destroyed.
+     */
+    virtual osmium::area::ProblemReporter* reporter() = 0;
+
+    virtual std::unique_ptr<buffer> make_buffer() = 0;
+
+    /**
+     * Move the problems from the buffer into the buffer of the calling
+     * thread. The buffer is empty afterwards and can be used again.
+     */
+    virtual void append(buffer& b) = 0;
+
+    /**
+     * Report that assembling the relation was aborted after the given
+     * time.
+     */
+    virtual void report_timeout(osmium::object_id_type relation_id, uint64_t ms) = 0;
+
+    virtual void flush() = 0;
+
+    virtual void close() = 0;
+
+protected:
+
+    /**
+     * One instance of TSlot for each thread using the sink.
+     */
+    template <typename TSlot>
+    class per_thread {
+
+        std::mutex m_mutex;
+        std::map<std::thread::id, std::unique_ptr<TSlot>> m_slots;
+
+    public:
+
+        template <typename... TArgs>
+        TSlot& get(TArgs&&... args) {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            auto& slot = m_slots[std::this_thread::get_id()];
+            if (!slot) {
+                slot.reset(new TSlot{std::forward<TArgs>(args)...});
+            }
+            return *slot;
+        }
+
+        TSlot* find() {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            const auto it = m_slots.find(std::this_thread::get_id());
+            return it == m_slots.end() ? nullptr : it->second.get();
+        }
+
+        template <typename TFunc>
+        void for_each(TFunc&& func) {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            for (auto& slot : m_slots) {
+                func(*slot.second);
+            }
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_slots.clear();
+        }
+
+    }; // class per_thread
+
+}; // class ProblemSink
+
+/**
+ * Problem sink writing the text format of ProblemReporterStream to an
+ * output stream. Each thread formats into its own string buffer, the
+ * buffers are written out in order of hand-over by a background thread.
+ */
+class ProblemSinkStream : public ProblemSink {
+
+    // hand over the buffer of a thread once it is this large
+    enum : std::size_t {
+        batch_size = 1024 * 1024
+    };
+
+    struct slot : public buffer {
+        std::ostringstream out;
+        osmium::area::ProblemReporterStream stream_reporter{out};
+
+        osmium::area::ProblemReporter* reporter() override {
+            return &stream_reporter;
+        }
+    };
+
+    std::ostream& m_out;
+    per_thread<slot> m_slots;
+    WorkQueue<std::string> m_queue;
+    std::thread m_writer;
+
+    void hand_over(slot& s) {
+        std::string data = s.out.str();
+        if (!data.empty()) {
+            s.out.str(std::string{});
+            m_queue.push(std::move(data));
+        }
+    }
+
+    void writer() {
+        std::string data;
+        while (m_queue.pop(data)) {
+            m_out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        }
+        m_out.flush();
+    }
+
+public:
+
+    explicit ProblemSinkStream(std::ostream& out) :
+        m_out(out),
+        m_queue(16),
+        m_writer(&ProblemSinkStream::writer, this) {
+    }
+
+    ~ProblemSinkStream() {
+        close();
+    }
+
+    osmium::area::ProblemReporter* reporter() override {
+        return m_slots.get().reporter();
+    }
+
+    std::unique_ptr<buffer> make_buffer() override {
+        return std::unique_ptr<buffer>{new slot{}};
+    }
+
+    void append(buffer& b) override {
+        auto& other = static_cast<slot&>(b);
+        m_slots.get().out << other.out.str();
+        other.out.str(std::string{});
+        flush();
+    }
+
+    void report_timeout(osmium::object_id_type relation_id, uint64_t ms) override {
+        m_slots.get().out << "ASSEMBLY TIMEOUT on relation " << relation_id << " after " << ms << "ms\n";
+    }
+
+    void flush() override {
+        slot* s = m_slots.find();
+        if (s && static_cast<std::size_t>(s->out.tellp()) >= batch_size) {
+            hand_over(*s);
+        }
+    }
+
+    void close() override {
+        if (!m_writer.joinable()) {
+            return;
+        }
+        m_slots.for_each([this](slot& s) {
+            hand_over(s);
+        });
+        m_queue.close();
+        m_writer.join();
+    }
+
+}; // class ProblemSinkStream
+
+/**
+ * Problem sink writing the "perrors" and "lerrors" layers of
+ * ProblemReporterOGR into an OGR dataset. Each thread has a reporter
+ * writing into an in-memory dataset of its own. On flush() the features
+ * are moved out of it as one batch. A GDAL dataset must not be used from
+ * two threads at the same time, so the batches are written into the
+ * output dataset by the thread that also writes the areas into it, from
+ * its flush() and from close().
+ */
+class ProblemSinkOGR : public ProblemSink {
+
+    // hand over the buffer of a thread once it has this many features
+    enum : std::size_t {
+        batch_size = 10000
+    };
+
+    struct feature_deleter {
+        void operator()(OGRFeature* feature) const noexcept {
+            OGRFeature::DestroyFeature(feature);
+        }
+    };
+
+    using feature_ptr = std::unique_ptr<OGRFeature, feature_deleter>;
+
+    struct slot : public buffer {
+        gdalcpp::Dataset dataset;
+        osmium::area::ProblemReporterOGR ogr_reporter;
+
+        explicit slot(const std::string& proj_string) :
+            dataset("Memory", "", gdalcpp::SRS{proj_string}),
+            ogr_reporter(dataset) {
+        }
+
+        osmium::area::ProblemReporter* reporter() override {
+            return &ogr_reporter;
+        }
+    };
+
+    struct batch {
+        std::string layer_name;
+        std::vector<feature_ptr> features;
+    };
+
+    gdalcpp::Dataset& m_dataset;
+    std::string m_proj_string;
+
+    // creates the layers in the output dataset, never reports anything
+    std::unique_ptr<osmium::area::ProblemReporterOGR> m_layers;
+
+    per_thread<slot> m_slots;
+
+    std::mutex m_pending_mutex;
+    std::vector<batch> m_pending;
+
+    // relation ids and times of aborted assemblies, written into the
+    // layer "assembly_timeouts" which is only created if needed
+    std::vector<std::pair<osmium::object_id_type, uint64_t>> m_timeouts;
+    std::unique_ptr<gdalcpp::Layer> m_timeouts_layer{nullptr};
+
+    static std::size_t count(slot& s) {
+        std::size_t features = 0;
+        for (int i = 0; i < s.dataset.get().GetLayerCount(); ++i) {
+            features += static_cast<std::size_t>(s.dataset.get().GetLayer(i)->GetFeatureCount());
+        }
+        return features;
+    }
+
+    void hand_over(slot& s) {
+        std::vector<batch> batches;
+        for (int i = 0; i < s.dataset.get().GetLayerCount(); ++i) {
+            OGRLayer* layer = s.dataset.get().GetLayer(i);
+            batch b;
+            b.layer_name = layer->GetName();
+            layer->ResetReading();
+            while (OGRFeature* feature = layer->GetNextFeature()) {
+                b.features.emplace_back(feature);
+            }
+            for (const auto& feature : b.features) {
+                layer->DeleteFeature(feature->GetFID());
+            }
+            if (!b.features.empty()) {
+                batches.push_back(std::move(b));
+            }
+        }
+        std::lock_guard<std::mutex> lock{m_pending_mutex};
+        for (auto& b : batches) {
+            m_pending.push_back(std::move(b));
+        }
+    }
+
+    void write_pending() {
+        std::vector<batch> batches;
+        std::vector<std::pair<osmium::object_id_type, uint64_t>> timeouts;
+        {
+            std::lock_guard<std::mutex> lock{m_pending_mutex};
+            batches.swap(m_pending);
+            timeouts.swap(m_timeouts);
+        }
+        if (!timeouts.empty() && !m_timeouts_layer) {
+            m_timeouts_layer.reset(new gdalcpp::Layer{m_dataset, "assembly_timeouts", wkbNone});
+            m_timeouts_layer->add_field("relation_id", OFTInteger, 10);
+            m_timeouts_layer->add_field("ms", OFTInteger, 10);
+        }
+        for (const auto& t : timeouts) {
+            // no gdalcpp::Feature here, it needs a geometry
+            feature_ptr feature{OGRFeature::CreateFeature(m_timeouts_layer->get().GetLayerDefn())};
+            feature->SetField("relation_id", static_cast<int>(t.first));
+            feature->SetField("ms", static_cast<int>(t.second));
+            if (m_timeouts_layer->get().CreateFeature(feature.get()) != OGRERR_NONE) {
+                throw std::runtime_error{"Can not write into layer 'assembly_timeouts'"};
+            }
+        }
+        for (const auto& b : batches) {
+            OGRLayer* layer = m_dataset.get().GetLayerByName(b.layer_name.c_str());
+            for (const auto& feature : b.features) {
+                feature_ptr out{OGRFeature::CreateFeature(layer->GetLayerDefn())};
+                out->SetFrom(feature.get());
+                out->SetFID(OGRNullFID);
+                if (layer->CreateFeature(out.get()) != OGRERR_NONE) {
+                    throw std::runtime_error{"Can not write problem into layer '" + b.layer_name + "'"};
+                }
+            }
+        }
+    }
+
+public:
+
+    ProblemSinkOGR(gdalcpp::Dataset& dataset, const std::string& proj_string) :
+        m_dataset(dataset),
+        m_proj_string(proj_string),
+        m_layers(new osmium::area::ProblemReporterOGR{dataset}) {
+    }
+
+    osmium::area::ProblemReporter* reporter() override {
+        return m_slots.get(m_proj_string).reporter();
+    }
+
+    std::unique_ptr<buffer> make_buffer() override {
+        return std::unique_ptr<buffer>{new slot{m_proj_string}};
+    }
+
+    /**
+     * The problems are written into the output dataset by the next call
+     * to flush() or close().
+     */
+    void append(buffer& b) override {
+        hand_over(static_cast<slot&>(b));
+    }
+
+    void report_timeout(osmium::object_id_type relation_id, uint64_t ms) override {
+        std::lock_guard<std::mutex> lock{m_pending_mutex};
+        m_timeouts.emplace_back(relation_id, ms);
+    }
+
+    /**
+     * Hand over the buffer of the calling thread if it is large enough.
+     * Writes all batches handed over so far, so this must only be called
+     * from the thread writing into the output dataset.
+     */
+    void flush() override {
+        slot* s = m_slots.find();
+        if (s && count(*s) >= batch_size) {
+            hand_over(*s);
+        }
+        write_pending();
+    }
+
+    /**
+     * Write all remaining problems. Call from the thread writing into the
+     * output dataset after all threads are done reporting.
+     */
+    void close() override {
+        if (!m_layers) {
+            return;
+        }
+        m_slots.for_each([this](slot& s) {
+            hand_over(s);
+        });
+        write_pending();
+        m_slots.clear();
+        m_layers.reset();
+    }
+
+}; // class ProblemSinkOGR
+
+#endif // OAT_PROBLEM_SINK_HPP
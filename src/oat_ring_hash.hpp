@@ -0,0 +1,256 @@
+#ifndef OAT_RING_HASH_HPP
+#define OAT_RING_HASH_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Hashes of the node id sequences of rings and areas
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/types.hpp>
+
+#include "oat_area_rings.hpp"
+
+/**
+ * Calculates hashes of the node id sequences of rings that do not depend
+ * on the node the ring starts with or on the direction of the ring. Two
+ * rings get the same hash if they consist of the same nodes in the same
+ * cyclic order.
+ *
+ * The hash of an area combines the hashes of all its rings independent of
+ * their order, so the same polygon created from a closed way and from a
+ * multipolygon relation gets the same hash.
+ *
+ * Hashers with different seeds calculate independent hashes of the same
+ * sequences.
+ */
+class RingHasher {
+
+    AreaRings m_rings;
+
+    uint64_t m_seed;
+
+    // scratch space for the values of the ring, the reversed ring, the
+    // failure function of Booth's algorithm, and the ring hashes
+    std::vector<uint64_t> m_values;
+    std::vector<uint64_t> m_reversed;
+    std::vector<int64_t> m_failure;
+    std::vector<uint64_t> m_ring_hashes;
+
+    // Lexicographically least rotation of the sequence (Booth's
+    // algorithm), returns the index of its first element. O(n).
+    std::size_t least_rotation(const uint64_t* ids, std::size_t n) {
+        auto& failure = m_failure;
+        failure.assign(2 * n, -1);
+        std::size_t k = 0;
+        for (std::size_t j = 1; j < 2 * n; ++j) {
+            const auto sj = ids[j % n];
+            int64_t i = failure[j - k - 1];
+            while (i != -1 && sj != ids[(k + i + 1) % n]) {
+                if (sj < ids[(k + i + 1) % n]) {
+                    k = j - i - 1;
+                }
+                i = failure[i];
+            }
+            if (sj != ids[(k + i + 1) % n]) { // i == -1
+                if (sj < ids[k % n]) {
+                    k = j;
+                }
+                failure[j - k] = -1;
+            } else {
+                failure[j - k] = i + 1;
+            }
+        }
+        return k % n;
+    }
+
+    // compare rotation a of sequence x with rotation b of sequence y
+    static bool rotation_less(const uint64_t* x, std::size_t a, const uint64_t* y, std::size_t b, std::size_t n) noexcept {
+        for (std::size_t i = 0; i < n; ++i) {
+            const auto vx = x[(a + i) % n];
+            const auto vy = y[(b + i) % n];
+            if (vx != vy) {
+                return vx < vy;
+            }
+        }
+        return false;
+    }
+
+    static uint64_t mix(uint64_t h, uint64_t value) noexcept {
+        h ^= value + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    uint64_t hash_rotation(const uint64_t* ids, std::size_t start, std::size_t n) const noexcept {
+        uint64_t h = n ^ m_seed;
+        for (std::size_t i = 0; i < n; ++i) {
+            h = mix(h, ids[(start + i) % n]);
+        }
+        return h;
+    }
+
+public:
+
+    explicit RingHasher(uint64_t seed = 0) :
+        m_seed(seed) {
+    }
+
+    /**
+     * Hash of a closed ring given as a sequence of values (with the last
+     * value the same as the first). Values can be node ids or coordinates
+     * packed into 64 bit.
+     */
+    uint64_t ring_hash(const uint64_t* ids, std::size_t count) {
+        // the last value is the same as the first
+        const std::size_t n = count > 0 ? count - 1 : 0;
+        if (n == 0) {
+            return 0;
+        }
+
+        m_reversed.assign(ids, ids + n);
+        std::reverse(m_reversed.begin(), m_reversed.end());
+
+        const std::size_t forward_start = least_rotation(ids, n);
+        const std::size_t backward_start = least_rotation(m_reversed.data(), n);
+
+        if (rotation_less(m_reversed.data(), backward_start, ids, forward_start, n)) {
+            return hash_rotation(m_reversed.data(), backward_start, n);
+        }
+        return hash_rotation(ids, forward_start, n);
+    }
+
+    /**
+     * Hash of a closed ring given as a sequence of node ids (with the last
+     * id the same as the first).
+     */
+    uint64_t ring_hash(const osmium::object_id_type* ids, std::size_t count) {
+        m_values.assign(ids, ids + count);
+        return ring_hash(m_values.data(), count);
+    }
+
+    /**
+     * Hash of an inner ring. Outer and inner rings with the same nodes
+     * get different hashes.
+     */
+    static uint64_t inner_ring_hash(uint64_t hash) noexcept {
+        return mix(hash, 1);
+    }
+
+    /**
+     * Combine the hashes of all rings of an area independent of their
+     * order. The vector is sorted in the process.
+     */
+    static uint64_t combine(std::vector<uint64_t>& ring_hashes, uint64_t seed = 0) noexcept {
+        std::sort(ring_hashes.begin(), ring_hashes.end());
+        uint64_t h = ring_hashes.size() ^ seed;
+        for (const uint64_t rh : ring_hashes) {
+            h = mix(h, rh);
+        }
+        return h;
+    }
+
+    /**
+     * Hash of all rings of an area. Outer and inner rings with the same
+     * nodes get different hashes.
+     */
+    uint64_t operator()(const osmium::Area& area) {
+        m_rings.assign(area);
+        m_ring_hashes.clear();
+        for (const auto& r : m_rings.rings()) {
+            const uint64_t h = ring_hash(m_rings.ids() + r.first, r.size());
+            m_ring_hashes.push_back(r.is_outer ? h : inner_ring_hash(h));
+        }
+        return combine(m_ring_hashes, m_seed);
+    }
+
+}; // class RingHasher
+
+/**
+ * Collects area hashes and finds groups of areas with the same rings. The
+ * node id sequences are not kept, that would need as much memory as the
+ * areas themselves. Instead each area gets two independent 64 bit hashes,
+ * areas are only put in the same group if both of them are the same.
+ */
+class DuplicateFinder {
+
+public:
+
+    struct entry {
+        osmium::object_id_type id;
+        osmium::object_id_type orig_id;
+        bool from_way;
+    };
+
+private:
+
+    // seed of the second hash, any value other than 0 will do
+    enum : uint64_t {
+        check_seed = 0x5851f42d4c957f2dULL
+    };
+
+    struct item {
+        uint64_t hash;
+        uint64_t check;
+        entry area;
+
+        bool same_rings(const item& other) const noexcept {
+            return hash == other.hash && check == other.check;
+        }
+
+        bool operator<(const item& other) const noexcept {
+            return hash < other.hash || (hash == other.hash && check < other.check);
+        }
+    };
+
+    RingHasher m_hasher;
+    RingHasher m_check_hasher{check_seed};
+
+    std::vector<item> m_areas;
+
+public:
+
+    void add(const osmium::Area& area) {
+        m_areas.push_back(item{m_hasher(area), m_check_hasher(area), entry{area.id(), area.orig_id(), area.from_way()}});
+    }
+
+    /**
+     * Call func(hash, entry) for each area in a group of more than one
+     * area with the same rings. All areas of a group are given one after
+     * the other. Returns the number of groups.
+     */
+    template <typename TFunc>
+    std::size_t for_each_duplicate(TFunc&& func) {
+        std::sort(m_areas.begin(), m_areas.end());
+        std::size_t groups = 0;
+        auto it = m_areas.cbegin();
+        while (it != m_areas.cend()) {
+            auto last = std::next(it);
+            while (last != m_areas.cend() && last->same_rings(*it)) {
+                ++last;
+            }
+            if (std::distance(it, last) > 1) {
+                ++groups;
+                for (; it != last; ++it) {
+                    func(it->hash, it->area);
+                }
+            }
+            it = last;
+        }
+        return groups;
+    }
+
+}; // class DuplicateFinder
+
+#endif // OAT_RING_HASH_HPP
@@ -0,0 +1,343 @@
+#ifndef OAT_RTREE_HPP
+#define OAT_RTREE_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Static packed R-tree over bounding boxes
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+/**
+ * Bounding box in OSM coordinate units (1e-7 degrees). Unlike
+ * osmium::Box this is a simple POD that can be stored in flat arrays and
+ * files.
+ */
+struct rtree_box {
+
+    int32_t min_x = std::numeric_limits<int32_t>::max();
+    int32_t min_y = std::numeric_limits<int32_t>::max();
+    int32_t max_x = std::numeric_limits<int32_t>::min();
+    int32_t max_y = std::numeric_limits<int32_t>::min();
+
+    rtree_box() = default;
+
+    rtree_box(int32_t x1, int32_t y1, int32_t x2, int32_t y2) noexcept :
+        min_x(x1),
+        min_y(y1),
+        max_x(x2),
+        max_y(y2) {
+    }
+
+    bool valid() const noexcept {
+        return min_x <= max_x && min_y <= max_y;
+    }
+
+    void extend(int32_t x, int32_t y) noexcept {
+        min_x = std::min(min_x, x);
+        min_y = std::min(min_y, y);
+        max_x = std::max(max_x, x);
+        max_y = std::max(max_y, y);
+    }
+
+    void extend(const rtree_box& other) noexcept {
+        min_x = std::min(min_x, other.min_x);
+        min_y = std::min(min_y, other.min_y);
+        max_x = std::max(max_x, other.max_x);
+        max_y = std::max(max_y, other.max_y);
+    }
+
+    bool intersects(const rtree_box& other) const noexcept {
+        return min_x <= other.max_x && other.min_x <= max_x &&
+               min_y <= other.max_y && other.min_y <= max_y;
+    }
+
+    bool contains(int32_t x, int32_t y) const noexcept {
+        return min_x <= x && x <= max_x && min_y <= y && y <= max_y;
+    }
+
+}; // struct rtree_box
+
+/**
+ * Read-only access to the arrays of a packed R-tree (see PackedRTree). The
+ * arrays can be owned by a PackedRTree or be part of a memory mapped file.
+ */
+class PackedRTreeView {
+
+    const rtree_box* m_boxes = nullptr;
+    const uint32_t* m_indexes = nullptr;
+    const uint32_t* m_level_ends = nullptr;
+    std::size_t m_num_boxes = 0;
+    std::size_t m_num_levels = 0;
+
+public:
+
+    static constexpr const std::size_t node_size = 16;
+
+    // Trees with 32 bit indexes never have more levels than this, so the
+    // stack for search() can have a fixed size.
+    static constexpr const std::size_t max_levels = 16;
+
+    PackedRTreeView() = default;
+
+    PackedRTreeView(const rtree_box* boxes, std::size_t num_boxes, const uint32_t* indexes, const uint32_t* level_ends, std::size_t num_levels) noexcept :
+        m_boxes(boxes),
+        m_indexes(indexes),
+        m_level_ends(level_ends),
+        m_num_boxes(num_boxes),
+        m_num_levels(num_levels) {
+    }
+
+    std::size_t num_levels() const noexcept {
+        return m_num_levels;
+    }
+
+    /**
+     * Call func(index) for the index of every box intersecting the query
+     * box. Doesn't allocate any memory.
+     */
+    template <typename TFunc>
+    void search(const rtree_box& query, TFunc&& func) const {
+        if (m_num_boxes == 0) {
+            return;
+        }
+
+        // pairs of (position of first node, level), each level below the
+        // root adds at most node_size entries
+        std::array<std::pair<uint32_t, uint32_t>, node_size * max_levels> stack;
+        std::size_t stack_size = 0;
+        stack[stack_size++] = std::make_pair(static_cast<uint32_t>(m_num_boxes - 1), static_cast<uint32_t>(m_num_levels - 1));
+
+        while (stack_size > 0) {
+            const auto node = stack[--stack_size];
+
+            const std::size_t end = std::min(static_cast<std::size_t>(node.first) + node_size,
+                                             static_cast<std::size_t>(m_level_ends[node.second]));
+            for (std::size_t pos = node.first; pos < end; ++pos) {
+                if (!query.intersects(m_boxes[pos])) {
+                    continue;
+                }
+                if (node.second == 0) {
+                    func(m_indexes[pos]);
+                } else {
+                    stack[stack_size++] = std::make_pair(m_indexes[pos], node.second - 1);
+                }
+            }
+        }
+    }
+
+}; // class PackedRTreeView
+
+/**
+ * Static R-tree built in one go from a list of boxes. The boxes are sorted
+ * along a Hilbert curve and packed into nodes of node_size entries, all
+ * levels are stored in one flat array (leaves first, root last). Queries
+ * return the index of the box in the list the tree was built from.
+ *
+ * Because the tree consists only of flat arrays, it can be written to a
+ * file and used from there with a PackedRTreeView.
+ */
+class PackedRTree {
+
+public:
+
+    static constexpr const std::size_t node_size = PackedRTreeView::node_size;
+
+private:
+
+    // boxes of all nodes, leaves first
+    std::vector<rtree_box> m_boxes;
+
+    // for leaves the index of the box in the input, for inner nodes the
+    // position of the first child in m_boxes
+    std::vector<uint32_t> m_indexes;
+
+    // end position of each level in m_boxes
+    std::vector<uint32_t> m_level_ends;
+
+    std::size_t m_num_items = 0;
+
+    static uint32_t interleave(uint32_t x) noexcept {
+        x = (x | (x << 8)) & 0x00FF00FF;
+        x = (x | (x << 4)) & 0x0F0F0F0F;
+        x = (x | (x << 2)) & 0x33333333;
+        x = (x | (x << 1)) & 0x55555555;
+        return x;
+    }
+
+    // Position on a Hilbert curve of a point in a 2^16 x 2^16 grid (from
+    // "Fast Hilbert curve generation, sorting, and range queries" by
+    // rawrunprotected, as used in flatbush).
+    static uint32_t hilbert(uint32_t x, uint32_t y) noexcept {
+        uint32_t a = x ^ y;
+        uint32_t b = 0xFFFF ^ a;
+        uint32_t c = 0xFFFF ^ (x | y);
+        uint32_t d = x & (y ^ 0xFFFF);
+
+        uint32_t A = a | (b >> 1);
+        uint32_t B = (a >> 1) ^ a;
+        uint32_t C = ((c >> 1) ^ (b & (d >> 1))) ^ c;
+        uint32_t D = ((a & (c >> 1)) ^ (d >> 1)) ^ d;
+
+        a = A; b = B; c = C; d = D;
+        A = ((a & (a >> 2)) ^ (b & (b >> 2)));
+        B = ((a & (b >> 2)) ^ (b & ((a ^ b) >> 2)));
+        C ^= ((a & (c >> 2)) ^ (b & (d >> 2)));
+        D ^= ((b & (c >> 2)) ^ ((a ^ b) & (d >> 2)));
+
+        a = A; b = B; c = C; d = D;
+        A = ((a & (a >> 4)) ^ (b & (b >> 4)));
+        B = ((a & (b >> 4)) ^ (b & ((a ^ b) >> 4)));
+        C ^= ((a & (c >> 4)) ^ (b & (d >> 4)));
+        D ^= ((b & (c >> 4)) ^ ((a ^ b) & (d >> 4)));
+
+        a = A; b = B; c = C; d = D;
+        C ^= ((a & (c >> 8)) ^ (b & (d >> 8)));
+        D ^= ((b & (c >> 8)) ^ ((a ^ b) & (d >> 8)));
+
+        a = C ^ (C >> 1);
+        b = D ^ (D >> 1);
+
+        const uint32_t i0 = x ^ y;
+        const uint32_t i1 = b | (0xFFFF ^ (i0 | a));
+
+        return (interleave(i1) << 1) | interleave(i0);
+    }
+
+public:
+
+    PackedRTree() = default;
+
+    /**
+     * Build the tree from the boxes. Invalid boxes are never found.
+     */
+    explicit PackedRTree(const std::vector<rtree_box>& boxes) {
+        build(boxes);
+    }
+
+    void build(const std::vector<rtree_box>& boxes) {
+        m_boxes.clear();
+        m_indexes.clear();
+        m_level_ends.clear();
+        m_num_items = boxes.size();
+
+        if (boxes.empty()) {
+            return;
+        }
+
+        // Hilbert values of the box centers relative to the total extent
+        rtree_box extent;
+        for (const auto& b : boxes) {
+            if (b.valid()) {
+                extent.extend(b);
+            }
+        }
+        const double width = std::max(1.0, static_cast<double>(extent.max_x) - extent.min_x);
+        const double height = std::max(1.0, static_cast<double>(extent.max_y) - extent.min_y);
+
+        std::vector<uint32_t> hilbert_values(boxes.size());
+        for (std::size_t i = 0; i < boxes.size(); ++i) {
+            const auto& b = boxes[i];
+            if (!b.valid()) {
+                hilbert_values[i] = std::numeric_limits<uint32_t>::max();
+                continue;
+            }
+            const double cx = (static_cast<double>(b.min_x) + b.max_x) / 2 - extent.min_x;
+            const double cy = (static_cast<double>(b.min_y) + b.max_y) / 2 - extent.min_y;
+            hilbert_values[i] = hilbert(static_cast<uint32_t>(0xFFFF * cx / width),
+                                        static_cast<uint32_t>(0xFFFF * cy / height));
+        }
+
+        m_indexes.resize(boxes.size());
+        std::iota(m_indexes.begin(), m_indexes.end(), 0);
+        std::sort(m_indexes.begin(), m_indexes.end(), [&hilbert_values](uint32_t a, uint32_t b) {
+            return hilbert_values[a] < hilbert_values[b];
+        });
+
+        m_boxes.reserve(boxes.size() + boxes.size() / (node_size - 1) + 1);
+        for (const uint32_t index : m_indexes) {
+            m_boxes.push_back(boxes[index]);
+        }
+        m_level_ends.push_back(static_cast<uint32_t>(m_boxes.size()));
+
+        // build the upper levels until only the root is left
+        std::size_t level_begin = 0;
+        while (m_boxes.size() - level_begin > 1) {
+            const std::size_t level_end = m_boxes.size();
+            for (std::size_t pos = level_begin; pos < level_end; pos += node_size) {
+                rtree_box node;
+                const std::size_t end = std::min(pos + node_size, level_end);
+                for (std::size_t child = pos; child < end; ++child) {
+                    if (m_boxes[child].valid()) {
+                        node.extend(m_boxes[child]);
+                    }
+                }
+                m_boxes.push_back(node);
+                m_indexes.push_back(static_cast<uint32_t>(pos));
+            }
+            m_level_ends.push_back(static_cast<uint32_t>(m_boxes.size()));
+            level_begin = level_end;
+        }
+    }
+
+    std::size_t size() const noexcept {
+        return m_num_items;
+    }
+
+    bool empty() const noexcept {
+        return m_num_items == 0;
+    }
+
+    /**
+     * The arrays of the tree. Together with the number of items they are
+     * all that is needed to recreate the tree with PackedRTreeView.
+     */
+    const std::vector<rtree_box>& boxes() const noexcept {
+        return m_boxes;
+    }
+
+    const std::vector<uint32_t>& indexes() const noexcept {
+        return m_indexes;
+    }
+
+    const std::vector<uint32_t>& level_ends() const noexcept {
+        return m_level_ends;
+    }
+
+    PackedRTreeView view() const noexcept {
+        return PackedRTreeView{m_boxes.data(), m_boxes.size(), m_indexes.data(), m_level_ends.data(), m_level_ends.size()};
+    }
+
+    /**
+     * Call func(index) for the index of every box intersecting the query
+     * box.
+     */
+    template <typename TFunc>
+    void search(const rtree_box& query, TFunc&& func) const {
+        view().search(query, std::forward<TFunc>(func));
+    }
+
+    /**
+     * Return the indexes of all boxes intersecting the query box.
+     */
+    std::vector<uint32_t> search(const rtree_box& query) const {
+        std::vector<uint32_t> result;
+        search(query, [&result](uint32_t index) {
+            result.push_back(index);
+        });
+        return result;
+    }
+
+}; // class PackedRTree
+
+#endif // OAT_RTREE_HPP
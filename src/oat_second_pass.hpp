@@ -0,0 +1,134 @@
+#ifndef OAT_SECOND_PASS_HPP
+#define OAT_SECOND_PASS_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Second pass with a concrete location index type
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <cstddef>
+#include <string>
+#include <utility>
+
+#include <osmium/handler/node_locations_for_ways.hpp>
+#include <osmium/index/map.hpp>
+#include <osmium/index/map/dense_mem_array.hpp>
+#include <osmium/index/map/dense_mmap_array.hpp>
+#include <osmium/index/map/sparse_mem_array.hpp>
+#include <osmium/index/map/sparse_mmap_array.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/util/verbose_output.hpp>
+#include <osmium/visitor.hpp>
+
+#include "oat_index_loader.hpp"
+#include "oat_index_tuning.hpp"
+#include "oat_location_lookup.hpp"
+
+/**
+ * Runs the second pass (nodes and ways) through the location handler and
+ * the given handlers. The index type from the command line is dispatched
+ * once to an instantiation of the whole pipeline for the concrete index
+ * class, so the compiler sees the final set() and get() functions of the
+ * index and can inline them instead of calling them through the virtual
+ * Map interface for every node. For these index types the index is
+ * filled from several threads by the ParallelIndexLoader and the node
+ * locations of the ways are looked up from several threads by the
+ * ParallelLocationLookup, which takes the place of the location handler.
+ * Index types without their own instantiation are created through the
+ * MapFactory and filled serially as usual. The index type "none" runs the
+ * handlers without a location handler.
+ */
+class SecondPass {
+
+    using id_type = osmium::unsigned_object_id_type;
+
+    std::string m_index_type;
+    const IndexTuning& m_tuning;
+    osmium::util::VerboseOutput& m_vout;
+    unsigned int m_num_threads;
+    std::size_t m_index_memory = 0;
+
+    template <typename TIndex, typename TSource, typename... THandlers>
+    void run(TIndex& index, TSource& source, THandlers&&... handlers) {
+        osmium::handler::NodeLocationsForWays<TIndex> location_handler{index};
+        location_handler.ignore_errors(); // XXX
+
+        IndexPhaseHandler index_phase_handler{index, m_tuning, m_vout};
+        osmium::apply(source, index_phase_handler, location_handler, std::forward<THandlers>(handlers)...);
+        index_phase_handler.finish();
+        index_phase_handler.print_report();
+
+        m_index_memory = index.used_memory();
+    }
+
+    template <typename TLoader, typename TSource, typename... THandlers>
+    void run_with(TSource& source, THandlers&&... handlers) {
+        using index_type = typename TLoader::index_type;
+        using loading_source_type = ParallelIndexLoader<TSource, TLoader>;
+
+        index_type index;
+
+        // before any threads are started, so the TLB miss counter covers
+        // them, the lookup phase is started by the loader
+        IndexPhaseHandler index_phase_handler{index, m_tuning, m_vout};
+
+        loading_source_type loading_source{source, index, m_num_threads, &index_phase_handler};
+        ParallelLocationLookup<loading_source_type, index_type> lookup_source{loading_source, index, m_num_threads};
+
+        osmium::apply(lookup_source, std::forward<THandlers>(handlers)...);
+        index_phase_handler.finish();
+        index_phase_handler.print_report();
+
+        m_index_memory = index.used_memory();
+    }
+
+public:
+
+    SecondPass(const std::string& index_type, const IndexTuning& tuning, osmium::util::VerboseOutput& vout, unsigned int num_threads) :
+        m_index_type(index_type),
+        m_tuning(tuning),
+        m_vout(vout),
+        m_num_threads(num_threads) {
+    }
+
+    bool need_locations() const noexcept {
+        return m_index_type != "none";
+    }
+
+    template <typename TSource, typename... THandlers>
+    void operator()(TSource& source, THandlers&&... handlers) {
+        using namespace osmium::index::map;
+
+        if (!need_locations()) {
+            osmium::apply(source, std::forward<THandlers>(handlers)...);
+        } else if (m_index_type == "dense_mem_array") {
+            run_with<DenseIndexLoader<DenseMemArray<id_type, osmium::Location>>>(source, std::forward<THandlers>(handlers)...);
+        } else if (m_index_type == "sparse_mem_array") {
+            run_with<SparseIndexLoader<SparseMemArray<id_type, osmium::Location>>>(source, std::forward<THandlers>(handlers)...);
+#ifdef __linux__
+        } else if (m_index_type == "dense_mmap_array") {
+            run_with<DenseIndexLoader<DenseMmapArray<id_type, osmium::Location>>>(source, std::forward<THandlers>(handlers)...);
+        } else if (m_index_type == "sparse_mmap_array") {
+            run_with<SparseIndexLoader<SparseMmapArray<id_type, osmium::Location>>>(source, std::forward<THandlers>(handlers)...);
+#endif
+        } else {
+            const auto& map_factory = osmium::index::MapFactory<id_type, osmium::Location>::instance();
+            const auto index = map_factory.create_map(m_index_type);
+            run(*index, source, std::forward<THandlers>(handlers)...);
+        }
+    }
+
+    /**
+     * Memory used by the location index at the end of the second pass.
+     */
+    std::size_t index_memory() const noexcept {
+        return m_index_memory;
+    }
+
+}; // class SecondPass
+
+#endif // OAT_SECOND_PASS_HPP
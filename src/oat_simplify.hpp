@@ -0,0 +1,516 @@
+#ifndef OAT_SIMPLIFY_HPP
+#define OAT_SIMPLIFY_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Topology preserving simplification of areas
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/types.hpp>
+
+#include "oat_area_rings.hpp"
+#include "oat_work_queue.hpp"
+
+/**
+ * Simplifies the rings of an area with the Douglas-Peucker algorithm
+ * without changing its topology: Simplified rings don't cross each other
+ * or themselves and inner rings stay inside their outer ring (as long as
+ * this was the case before). Rings that are smaller than the tolerance in
+ * both directions or thinner than the tolerance are removed, together with
+ * the inner rings of a removed outer ring.
+ *
+ * The rings are first simplified independently. Then all segments of the
+ * result are checked for intersections; every simplified segment involved
+ * in an intersection gets back the point farthest from it and the check
+ * is repeated until no intersections are left. Polygons with inner rings
+ * that end up outside their outer ring are not simplified at all.
+ *
+ * The distances of all points to a segment are calculated in a loop over
+ * flat coordinate arrays without branches, so that the compiler can
+ * vectorize it.
+ */
+class AreaSimplifier {
+
+public:
+
+    /**
+     * The simplified area. The rings use the same layout as AreaRings.
+     */
+    struct result {
+
+        std::vector<AreaRings::ring> rings;
+        std::vector<int32_t> x;
+        std::vector<int32_t> y;
+
+        void clear() noexcept {
+            rings.clear();
+            x.clear();
+            y.clear();
+        }
+
+        bool empty() const noexcept {
+            return rings.empty();
+        }
+
+    }; // struct result
+
+private:
+
+    struct segment {
+        int32_t min_x;
+        int32_t max_x;
+        int32_t min_y;
+        int32_t max_y;
+
+        // indexes of the end points in the result
+        uint32_t a;
+        uint32_t b;
+
+        // indexes of the end points in the original area, start of the
+        // ring instead of the closing point, so that adjacent segments
+        // share end points
+        uint32_t from;
+        uint32_t to;
+
+        // end of the range of points the segment replaces in the
+        // original area
+        uint32_t last;
+    };
+
+    const AreaRings* m_area = nullptr;
+    double m_tolerance_squared = 0.0;
+
+    // for each point of the area: is it kept in the simplified area?
+    std::vector<char> m_keep;
+
+    std::vector<char> m_ring_dropped;
+
+    // for each point of the result the index in the original area
+    std::vector<uint32_t> m_source;
+
+    std::vector<double> m_distances;
+    std::vector<std::pair<uint32_t, uint32_t>> m_stack;
+    std::vector<segment> m_segments;
+
+    /**
+     * Find the point with indexes between first and last (exclusive) that
+     * is farthest from the line through these two points (or from the
+     * point if both are at the same location). Returns the index and the
+     * squared distance.
+     */
+    std::pair<uint32_t, double> farthest(uint32_t first, uint32_t last) {
+        if (last - first < 2) {
+            return std::make_pair(first, 0.0);
+        }
+
+        const int32_t* x = m_area->x();
+        const int32_t* y = m_area->y();
+        const double ax = x[first];
+        const double ay = y[first];
+        const double dx = static_cast<double>(x[last]) - ax;
+        const double dy = static_cast<double>(y[last]) - ay;
+        const double length_squared = dx * dx + dy * dy;
+
+        const uint32_t count = last - first - 1;
+        m_distances.resize(count);
+        double* distances = m_distances.data();
+        const int32_t* px = x + first + 1;
+        const int32_t* py = y + first + 1;
+
+        if (length_squared == 0.0) {
+            for (uint32_t i = 0; i < count; ++i) {
+                const double ex = px[i] - ax;
+                const double ey = py[i] - ay;
+                distances[i] = ex * ex + ey * ey;
+            }
+        } else {
+            const double factor = 1.0 / length_squared;
+            for (uint32_t i = 0; i < count; ++i) {
+                const double cross = dx * (py[i] - ay) - dy * (px[i] - ax);
+                distances[i] = cross * cross * factor;
+            }
+        }
+
+        const auto it = std::max_element(distances, distances + count);
+        return std::make_pair(first + 1 + static_cast<uint32_t>(it - distances), *it);
+    }
+
+    bool simplify_ring(const AreaRings::ring& r) {
+        // the last point is the same as the first
+        if (r.size() < 4) {
+            return false;
+        }
+        const uint32_t closing = r.last - 1;
+
+        int32_t min_x = m_area->x()[r.first];
+        int32_t max_x = min_x;
+        int32_t min_y = m_area->y()[r.first];
+        int32_t max_y = min_y;
+        for (uint32_t i = r.first; i < closing; ++i) {
+            min_x = std::min(min_x, m_area->x()[i]);
+            max_x = std::max(max_x, m_area->x()[i]);
+            min_y = std::min(min_y, m_area->y()[i]);
+            max_y = std::max(max_y, m_area->y()[i]);
+        }
+        const double width = static_cast<double>(max_x) - min_x;
+        const double height = static_cast<double>(max_y) - min_y;
+        if (width * width < m_tolerance_squared && height * height < m_tolerance_squared) {
+            return false;
+        }
+
+        const uint32_t far = farthest(r.first, closing).first;
+        m_keep[r.first] = 1;
+        m_keep[far] = 1;
+        m_keep[closing] = 1;
+
+        m_stack.clear();
+        m_stack.emplace_back(r.first, far);
+        m_stack.emplace_back(far, closing);
+        uint32_t kept = 2;
+        while (!m_stack.empty()) {
+            const auto range = m_stack.back();
+            m_stack.pop_back();
+            const auto f = farthest(range.first, range.second);
+            if (f.second > m_tolerance_squared) {
+                m_keep[f.first] = 1;
+                ++kept;
+                m_stack.emplace_back(range.first, f.first);
+                m_stack.emplace_back(f.first, range.second);
+            }
+        }
+
+        // if fewer than three points are left, all points are within the
+        // tolerance of a line
+        return kept >= 3;
+    }
+
+    void build_result(result& out) {
+        out.clear();
+        m_source.clear();
+        const auto& rings = m_area->rings();
+        for (std::size_t n = 0; n < rings.size(); ++n) {
+            if (m_ring_dropped[n]) {
+                continue;
+            }
+            const auto& r = rings[n];
+            AreaRings::ring sr;
+            sr.first = static_cast<uint32_t>(out.x.size());
+            sr.is_outer = r.is_outer;
+            sr.outer = r.is_outer ? static_cast<uint32_t>(out.rings.size()) : (out.rings.empty() ? 0 : out.rings.back().outer);
+            for (uint32_t i = r.first; i < r.last; ++i) {
+                if (m_keep[i]) {
+                    out.x.push_back(m_area->x()[i]);
+                    out.y.push_back(m_area->y()[i]);
+                    m_source.push_back(i);
+                }
+            }
+            sr.last = static_cast<uint32_t>(out.x.size());
+            out.rings.push_back(sr);
+        }
+    }
+
+    void build_segments(const result& out) {
+        m_segments.clear();
+        for (const auto& r : out.rings) {
+            const uint32_t ring_first = m_source[r.first];
+            for (uint32_t i = r.first; i + 1 < r.last; ++i) {
+                segment s;
+                s.min_x = std::min(out.x[i], out.x[i + 1]);
+                s.max_x = std::max(out.x[i], out.x[i + 1]);
+                s.min_y = std::min(out.y[i], out.y[i + 1]);
+                s.max_y = std::max(out.y[i], out.y[i + 1]);
+                s.a = i;
+                s.b = i + 1;
+                s.from = m_source[i];
+                s.last = m_source[i + 1];
+                s.to = (i + 2 == r.last) ? ring_first : m_source[i + 1];
+                m_segments.push_back(s);
+            }
+        }
+        std::sort(m_segments.begin(), m_segments.end(), [](const segment& s1, const segment& s2) {
+            return s1.min_x < s2.min_x;
+        });
+    }
+
+    static bool intersect(const result& out, const segment& s1, const segment& s2) noexcept {
+        const auto orient = [&out](uint32_t a, uint32_t b, uint32_t c) {
+            return orientation(out.x[a], out.y[a], out.x[b], out.y[b], out.x[c], out.y[c]);
+        };
+
+        // adjacent segments only intersect if they overlap
+        uint32_t shared = 0;
+        uint32_t other1 = 0;
+        uint32_t other2 = 0;
+        if (s1.from == s2.from || s1.from == s2.to || s1.to == s2.from || s1.to == s2.to) {
+            shared = (s1.from == s2.from || s1.from == s2.to) ? s1.a : s1.b;
+            other1 = shared == s1.a ? s1.b : s1.a;
+            other2 = (s2.from == s1.from || s2.from == s1.to) ? s2.b : s2.a;
+            if (orient(shared, other1, other2) != 0) {
+                return false;
+            }
+            const int64_t dx1 = static_cast<int64_t>(out.x[other1]) - out.x[shared];
+            const int64_t dy1 = static_cast<int64_t>(out.y[other1]) - out.y[shared];
+            const int64_t dx2 = static_cast<int64_t>(out.x[other2]) - out.x[shared];
+            const int64_t dy2 = static_cast<int64_t>(out.y[other2]) - out.y[shared];
+            return (dx1 > 0) == (dx2 > 0) && (dx1 < 0) == (dx2 < 0) &&
+                   (dy1 > 0) == (dy2 > 0) && (dy1 < 0) == (dy2 < 0);
+        }
+
+        const int o1 = orient(s1.a, s1.b, s2.a);
+        const int o2 = orient(s1.a, s1.b, s2.b);
+        if (o1 * o2 > 0) {
+            return false;
+        }
+        const int o3 = orient(s2.a, s2.b, s1.a);
+        const int o4 = orient(s2.a, s2.b, s1.b);
+
+        // collinear segments with overlapping boxes overlap
+        return o3 * o4 <= 0;
+    }
+
+    // Put back the farthest point of a simplified segment. Returns false
+    // if the segment was not simplified.
+    bool refine(const segment& s) {
+        if (s.last - s.from < 2) {
+            return false;
+        }
+        m_keep[farthest(s.from, s.last).first] = 1;
+        return true;
+    }
+
+    bool fix_intersections(const result& out) {
+        bool changed = false;
+        for (std::size_t i = 0; i < m_segments.size(); ++i) {
+            const segment& s1 = m_segments[i];
+            for (std::size_t j = i + 1; j < m_segments.size() && m_segments[j].min_x <= s1.max_x; ++j) {
+                const segment& s2 = m_segments[j];
+                if (s1.max_y < s2.min_y || s2.max_y < s1.min_y) {
+                    continue;
+                }
+                if (intersect(out, s1, s2)) {
+                    changed |= refine(s1);
+                    changed |= refine(s2);
+                }
+            }
+        }
+        return changed;
+    }
+
+    // Keep all points of polygons with an inner ring not inside the
+    // outer ring any more.
+    bool fix_nesting(const result& out) {
+        bool changed = false;
+        for (const auto& r : out.rings) {
+            if (r.is_outer) {
+                continue;
+            }
+            const auto& outer = out.rings[r.outer];
+            bool inside = false;
+            for (uint32_t i = r.first; i + 1 < r.last; ++i) {
+                const auto pos = point_in_ring(out.x.data() + outer.first, out.y.data() + outer.first, outer.size(), out.x[i], out.y[i]);
+                if (pos == point_position::inside) {
+                    inside = true;
+                    break;
+                }
+                if (pos == point_position::outside) {
+                    break;
+                }
+            }
+            if (!inside) {
+                const uint32_t first = m_source[outer.first];
+                uint32_t last = m_source[r.last - 1] + 1;
+                for (const auto& other : out.rings) {
+                    if (!other.is_outer && other.outer == r.outer) {
+                        last = std::max(last, m_source[other.last - 1] + 1);
+                    }
+                }
+                for (uint32_t i = first; i < last; ++i) {
+                    if (!m_keep[i]) {
+                        m_keep[i] = 1;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        return changed;
+    }
+
+public:
+
+    /**
+     * Simplify the area with the given tolerance (in OSM coordinate
+     * units). Returns false if nothing is left of the area.
+     */
+    bool operator()(const AreaRings& area, double tolerance, result& out) {
+        m_area = &area;
+        m_tolerance_squared = tolerance * tolerance;
+        m_keep.assign(area.num_points(), 0);
+        m_ring_dropped.assign(area.num_rings(), 0);
+
+        const auto& rings = area.rings();
+        for (std::size_t n = 0; n < rings.size(); ++n) {
+            const auto& r = rings[n];
+            if ((!r.is_outer && m_ring_dropped[r.outer]) || !simplify_ring(r)) {
+                m_ring_dropped[n] = 1;
+            }
+        }
+
+        do {
+            build_result(out);
+            build_segments(out);
+        } while (fix_intersections(out) || fix_nesting(out));
+
+        return !out.empty();
+    }
+
+}; // class AreaSimplifier
+
+/**
+ * Simplifies areas with several tolerances in worker threads. Areas are
+ * added from the thread assembling the areas, the results are collected
+ * again in that thread, so that they can be written out without any
+ * locking. Results come back in no particular order.
+ */
+class ParallelSimplifier {
+
+public:
+
+    struct result {
+        osmium::object_id_type id;
+
+        // one simplified area for each tolerance, empty if nothing was
+        // left of the area
+        std::vector<AreaSimplifier::result> levels;
+    };
+
+private:
+
+    struct job {
+        osmium::object_id_type id;
+        AreaRings rings;
+    };
+
+    std::vector<double> m_tolerances;
+
+    WorkQueue<job> m_jobs;
+    WorkQueue<result> m_results;
+
+    // first error in one of the worker threads, rethrown by drain()
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error{nullptr};
+
+    std::vector<std::thread> m_threads;
+
+    void worker() {
+        AreaSimplifier simplifier;
+        job j;
+        while (m_jobs.pop(j)) {
+            try {
+                result r;
+                r.id = j.id;
+                r.levels.resize(m_tolerances.size());
+                for (std::size_t n = 0; n < m_tolerances.size(); ++n) {
+                    simplifier(j.rings, m_tolerances[n], r.levels[n]);
+                }
+                m_results.push(std::move(r));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{m_error_mutex};
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    void check_error() {
+        std::lock_guard<std::mutex> lock{m_error_mutex};
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+public:
+
+    /**
+     * Tolerances are in OSM coordinate units.
+     */
+    ParallelSimplifier(const std::vector<double>& tolerances, unsigned int num_threads) :
+        m_tolerances(tolerances),
+        m_jobs(num_threads * 16),
+        // large enough so that workers never wait for results to be
+        // collected while the assembling thread waits in add()
+        m_results(static_cast<std::size_t>(-1)) {
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            m_threads.emplace_back(&ParallelSimplifier::worker, this);
+        }
+    }
+
+    ParallelSimplifier(const ParallelSimplifier&) = delete;
+    ParallelSimplifier& operator=(const ParallelSimplifier&) = delete;
+
+    ~ParallelSimplifier() {
+        m_jobs.close();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    const std::vector<double>& tolerances() const noexcept {
+        return m_tolerances;
+    }
+
+    /**
+     * Queue area for simplification. Areas with invalid locations are
+     * ignored.
+     */
+    void add(const osmium::Area& area) {
+        job j;
+        j.id = area.id();
+        if (!j.rings.assign(area) || j.rings.empty()) {
+            return;
+        }
+        m_jobs.push(std::move(j));
+    }
+
+    /**
+     * Call func(result&) for all results available now.
+     */
+    template <typename TFunc>
+    void drain(TFunc&& func) {
+        check_error();
+        result r;
+        while (m_results.try_pop(r)) {
+            func(r);
+        }
+    }
+
+    /**
+     * Wait for all queued areas to be simplified and call func(result&)
+     * for all remaining results.
+     */
+    template <typename TFunc>
+    void finish(TFunc&& func) {
+        m_jobs.close();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+        m_threads.clear();
+        drain(std::forward<TFunc>(func));
+    }
+
+}; // class ParallelSimplifier
+
+#endif // OAT_SIMPLIFY_HPP
@@ -6,16 +6,284 @@
 
 *****************************************************************************/
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <getopt.h>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <osmium/area/assembler.hpp>
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/location.hpp>
 
 #include "oat.hpp"
+#include "oat_area_check.hpp"
+
+// the x sweep line is not run for larger rings once it took longer than
+// this, it is quadratic for the star and comb shapes
+const long max_x_sweep_ms = 100;
+
+// number of random areas checked serially and in parallel strips
+const int num_random_areas = 1000;
+
+void print_help() {
+    std::cout << "oat_sizes [OPTIONS]\n\n"
+              << "Print sizes of some C++ structures used in assembling areas.\n"
+              << "\nOptions:\n"
+              << "  -b, --benchmark  Time the validity check on synthetic rings and compare\n"
+              << "                   the serial and the parallel check instead\n"
+              << "  -h, --help       This help message\n"
+              ;
+}
+
+// ring with points alternating between an outer and a small inner circle,
+// so all segments are long and cover a large part of the x range
+std::vector<osmium::Location> star_ring(std::size_t segments) {
+    std::vector<osmium::Location> ring;
+    for (std::size_t i = 0; i < segments; ++i) {
+        const double angle = 2 * M_PI * double(i) / double(segments);
+        const double radius = (i % 2) ? 80000000.0 : 800000000.0;
+        ring.emplace_back(int32_t(radius * std::cos(angle)), int32_t(radius * std::sin(angle)));
+    }
+    return ring;
+}
+
+// ring going back and forth between two vertical lines, so there are
+// many long horizontal segments
+std::vector<osmium::Location> comb_ring(std::size_t segments) {
+    const std::size_t teeth = std::max(segments / 4, std::size_t(1));
+    const int32_t width = 1000000000;
+    const int32_t height = int32_t(800000000 / teeth);
+    std::vector<osmium::Location> ring;
+    for (std::size_t t = 0; t < teeth; ++t) {
+        const int32_t y = int32_t(2 * t) * height - 800000000;
+        ring.emplace_back(width, y);
+        ring.emplace_back(width, y + height);
+        ring.emplace_back(1, y + height);
+        ring.emplace_back(1, y + 2 * height);
+    }
+    ring.emplace_back(0, int32_t(2 * teeth) * height - 800000000);
+    ring.emplace_back(0, -800000000);
+    return ring;
+}
+
+// regular polygon with short segments, the easy case for the x sweep line
+std::vector<osmium::Location> circle_ring(std::size_t segments) {
+    std::vector<osmium::Location> ring;
+    for (std::size_t i = 0; i < segments; ++i) {
+        const double angle = 2 * M_PI * double(i) / double(segments);
+        ring.emplace_back(int32_t(800000000.0 * std::cos(angle)), int32_t(800000000.0 * std::sin(angle)));
+    }
+    return ring;
+}
+
+// random area with an outer ring with many short segments, so that the
+// strips of the parallel check are balanced, and small triangular holes,
+// many of them touching the outer ring at a point, some overlapping each
+// other, crossing the outer ring or outside of it
+std::vector<std::vector<osmium::Location>> random_area(std::mt19937& gen) {
+    std::uniform_int_distribution<int> dist_center{-100000000, 100000000};
+    std::uniform_real_distribution<double> dist_radius{1000000.0, 500000000.0};
+    std::uniform_int_distribution<std::size_t> dist_points{1000, 20000};
+    std::uniform_int_distribution<int> dist_holes{0, 20};
+    std::uniform_int_distribution<int> dist_case{0, 9};
+    std::uniform_real_distribution<double> dist_unit{0.0, 1.0};
+
+    const double cx = dist_center(gen);
+    const double cy = dist_center(gen);
+    const double radius = dist_radius(gen);
+    const std::size_t points = dist_points(gen);
+
+    std::vector<osmium::Location> outer;
+    for (std::size_t i = 0; i < points; ++i) {
+        const double angle = 2 * M_PI * double(i) / double(points);
+        outer.emplace_back(int32_t(cx + radius * std::cos(angle)), int32_t(cy + radius * std::sin(angle)));
+    }
+    if (dist_case(gen) == 0) {
+        // two points swapped make the outer ring cross itself
+        const std::size_t i = std::uniform_int_distribution<std::size_t>{1, points - 2}(gen);
+        std::swap(outer[i], outer[i + 1]);
+    }
+
+    std::vector<std::vector<osmium::Location>> rings{outer};
+    const int holes = dist_holes(gen);
+    for (int h = 0; h < holes; ++h) {
+        const int kind = dist_case(gen);
+        std::vector<osmium::Location> hole;
+        double angle = 2 * M_PI * dist_unit(gen);
+        double distance = 0.9 * radius * dist_unit(gen);
+        if (kind < 4) {
+            // the tip of the hole is one of a few points of the outer ring
+            const std::size_t i = 8 * std::uniform_int_distribution<std::size_t>{0, 63}(gen);
+            hole.push_back(outer[i]);
+            angle = 2 * M_PI * double(i) / double(points);
+            distance = radius;
+        } else {
+            if (kind == 4) {
+                distance = radius * 1.5;
+            }
+            hole.emplace_back(int32_t(cx + distance * std::cos(angle)), int32_t(cy + distance * std::sin(angle)));
+        }
+        const double depth = radius * (0.01 + 0.05 * dist_unit(gen));
+        const double width = 0.001 + 0.01 * dist_unit(gen);
+        hole.emplace_back(int32_t(cx + (distance - depth) * std::cos(angle + width)), int32_t(cy + (distance - depth) * std::sin(angle + width)));
+        hole.emplace_back(int32_t(cx + (distance - depth) * std::cos(angle - width)), int32_t(cy + (distance - depth) * std::sin(angle - width)));
+        rings.push_back(hole);
+    }
+
+    return rings;
+}
+
+template <typename TRingBuilder>
+osmium::object_id_type add_ring(osmium::builder::AreaBuilder& builder, const std::vector<osmium::Location>& ring, osmium::object_id_type id) {
+    TRingBuilder ring_builder{builder};
+    const osmium::object_id_type first = id;
+    for (const auto& location : ring) {
+        ring_builder.add_node_ref(id++, location);
+    }
+    ring_builder.add_node_ref(first, ring.front());
+    return id;
+}
+
+// area with the first ring as outer ring and all others as inner rings
+const osmium::Area& build_area(osmium::memory::Buffer& buffer, const std::vector<std::vector<osmium::Location>>& rings) {
+    buffer.clear();
+    {
+        osmium::builder::AreaBuilder builder{buffer};
+        builder.set_id(2);
+        osmium::object_id_type id = add_ring<osmium::builder::OuterRingBuilder>(builder, rings.front(), 1);
+        for (auto it = std::next(rings.begin()); it != rings.end(); ++it) {
+            id = add_ring<osmium::builder::InnerRingBuilder>(builder, *it, id);
+        }
+    }
+    return buffer.get<osmium::Area>(buffer.commit());
+}
+
+long time_check(AreaValidator& validator, const osmium::Area& area) {
+    const auto start = std::chrono::steady_clock::now();
+    const bool valid = validator(area);
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::setw(10) << ms;
+    if (!valid) {
+        std::cout << " (" << AreaValidator::problem_name(validator.last_problem()) << ")";
+    }
+    return long(ms);
+}
+
+bool benchmark() {
+    osmium::memory::Buffer buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    AreaValidator validator;
+    AreaValidator parallel_validator;
+    const unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    parallel_validator.set_tree_threshold(0);
+    parallel_validator.set_parallel_threshold(0);
+    parallel_validator.set_threads(num_threads);
+    bool same = true;
+
+    std::cout << "shape     segments  x sweep ms    tree ms  with " << num_threads << " threads\n";
+    for (const auto shape : { "star", "comb", "circle" }) {
+        long x_sweep_ms = 0;
+        for (std::size_t segments = 1000; segments <= 1000000; segments *= 10) {
+            const std::string name{shape};
+            const auto ring = name == "star" ? star_ring(segments) :
+                              name == "comb" ? comb_ring(segments) :
+                                               circle_ring(segments);
+            const osmium::Area& area = build_area(buffer, {ring});
+
+            std::cout << std::left << std::setw(7) << shape << std::right << std::setw(11) << ring.size() << "  ";
+            if (x_sweep_ms <= max_x_sweep_ms) {
+                validator.set_tree_threshold(std::numeric_limits<std::size_t>::max());
+                x_sweep_ms = time_check(validator, area);
+            } else {
+                std::cout << std::setw(10) << "-";
+            }
+            std::cout << ' ';
+            validator.set_tree_threshold(0);
+            time_check(validator, area);
+            std::cout << ' ';
+            time_check(parallel_validator, area);
+            if (!validator.same_result(parallel_validator)) {
+                std::cout << "  DIFFERENT RESULTS";
+                same = false;
+            }
+            std::cout << '\n';
+        }
+    }
+
+    // The parallel check must find the same problem and the same touching
+    // points as the serial check. Use at least four strips, so that this
+    // is also tested on machines with few CPUs.
+    parallel_validator.set_threads(std::max(4u, num_threads));
+    std::mt19937 gen{42};
+    int num_invalid = 0;
+    int num_touching = 0;
+    int num_different = 0;
+    for (int n = 0; n < num_random_areas; ++n) {
+        const osmium::Area& area = build_area(buffer, random_area(gen));
+        if (!validator(area)) {
+            ++num_invalid;
+        }
+        if (validator.had_touches()) {
+            ++num_touching;
+        }
+        parallel_validator(area);
+        if (!validator.same_result(parallel_validator)) {
+            ++num_different;
+        }
+    }
+    std::cout << "\nrandom areas: " << num_random_areas << " (" << num_invalid << " invalid, "
+              << num_touching << " with touching rings), serial and parallel check differ on "
+              << num_different << '\n';
+
+    return same && num_different == 0;
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        {"benchmark", no_argument, 0, 'b'},
+        {"help",      no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    bool run_benchmark = false;
+
+    while (true) {
+        int c = getopt_long(argc, argv, "bh", long_options, 0);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+            case 'b':
+                run_benchmark = true;
+                break;
+            case 'h':
+                print_help();
+                exit(exit_code_ok);
+            default:
+                exit(exit_code_cmdline_error);
+        }
+    }
+
+    if (run_benchmark) {
+        return benchmark() ? exit_code_ok : exit_code_error;
+    }
 
-int main() {
     std::cout << "sizeof(osmium::area::detail::NodeRefSegment) = " << sizeof(osmium::area::detail::NodeRefSegment) << '\n';
     std::cout << "sizeof(osmium::area::detail::ProtoRing) = " << sizeof(osmium::area::detail::ProtoRing) << '\n';
 
     return exit_code_ok;
 }
-
@@ -0,0 +1,569 @@
+#ifndef OAT_TILES_HPP
+#define OAT_TILES_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Clip areas to web mercator tiles
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sqlite.hpp>
+
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/types.hpp>
+
+#include "oat_area_rings.hpp"
+#include "oat_work_queue.hpp"
+
+namespace tiles {
+
+    // size of a tile in tile coordinates (as in vector tiles)
+    constexpr const int32_t extent = 4096;
+
+    // areas are clipped to the tile plus this buffer on all sides
+    constexpr const double buffer = 64;
+
+    // tolerance for the simplification in tile coordinates
+    constexpr const double tolerance = 1.0;
+
+    constexpr const uint32_t max_zoom = 24;
+
+    // latitude limit of the web mercator projection
+    constexpr const double max_latitude = 85.0511287798;
+
+    struct point {
+        double x;
+        double y;
+    };
+
+    using ring = std::vector<point>;
+
+    // outer ring first, then the inner rings
+    using polygon = std::vector<ring>;
+
+    /**
+     * Position of a location in the web mercator "world", x from 0 (west)
+     * to 1 (east), y from 0 (north) to 1 (south).
+     */
+    inline point world_coordinates(int32_t x, int32_t y) noexcept {
+        const double lon = x / 10000000.0;
+        const double lat = std::max(-max_latitude, std::min(max_latitude, y / 10000000.0));
+        const double s = std::sin(lat * M_PI / 180);
+        return point{(lon + 180) / 360,
+                     0.5 - std::log((1 + s) / (1 - s)) / (4 * M_PI)};
+    }
+
+    inline void append_wkb(std::string& out, uint32_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    inline void append_wkb(std::string& out, double value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    /**
+     * Encode polygons as WKB multipolygon (in host byte order, which is
+     * assumed to be little endian).
+     */
+    inline void encode_wkb(std::string& out, const std::vector<polygon>& polygons) {
+        out.clear();
+        out += '\x01';
+        append_wkb(out, uint32_t(6));
+        append_wkb(out, static_cast<uint32_t>(polygons.size()));
+        for (const auto& p : polygons) {
+            out += '\x01';
+            append_wkb(out, uint32_t(3));
+            append_wkb(out, static_cast<uint32_t>(p.size()));
+            for (const auto& r : p) {
+                // rings are stored without the closing point
+                append_wkb(out, static_cast<uint32_t>(r.size() + 1));
+                for (const auto& pt : r) {
+                    append_wkb(out, pt.x);
+                    append_wkb(out, pt.y);
+                }
+                append_wkb(out, r.front().x);
+                append_wkb(out, r.front().y);
+            }
+        }
+    }
+
+} // namespace tiles
+
+struct tile_key {
+    uint32_t zoom;
+    uint32_t x;
+    uint32_t y;
+};
+
+/**
+ * Clips polygons to all tiles of a zoom level they cover. Instead of
+ * clipping against every tile, the tile range is split in halves
+ * recursively, so every point only goes through a logarithmic number of
+ * clipping steps. Each ring is clipped on its own using the
+ * Sutherland-Hodgman algorithm which is all that is needed for clipping
+ * against rectangles. This can leave degenerate edges along the tile
+ * border, which doesn't matter for rendering.
+ *
+ * Before clipping, the rings are simplified with the Douglas-Peucker
+ * algorithm using a tolerance appropriate for the zoom level.
+ *
+ * Not thread safe, use one TileClipper per thread.
+ */
+class TileClipper {
+
+    // scratch space for Douglas-Peucker
+    std::vector<char> m_keep;
+    std::vector<std::pair<std::size_t, std::size_t>> m_stack;
+
+    static double segment_distance_squared(const tiles::point& p, const tiles::point& a, const tiles::point& b) noexcept {
+        double dx = b.x - a.x;
+        double dy = b.y - a.y;
+        double x = a.x;
+        double y = a.y;
+        if (dx != 0 || dy != 0) {
+            const double t = ((p.x - a.x) * dx + (p.y - a.y) * dy) / (dx * dx + dy * dy);
+            if (t > 1) {
+                x = b.x;
+                y = b.y;
+            } else if (t > 0) {
+                x += dx * t;
+                y += dy * t;
+            }
+        }
+        dx = p.x - x;
+        dy = p.y - y;
+        return dx * dx + dy * dy;
+    }
+
+    // Simplify a closed ring (stored without closing point). The ring is
+    // split at its first point and the point farthest from it, both
+    // halves are simplified on their own.
+    void simplify(tiles::ring& r, double tolerance) {
+        const std::size_t n = r.size();
+        if (n <= 4) {
+            return;
+        }
+
+        std::size_t far = 0;
+        double max_dist = 0;
+        for (std::size_t i = 1; i < n; ++i) {
+            const double dx = r[i].x - r[0].x;
+            const double dy = r[i].y - r[0].y;
+            const double d = dx * dx + dy * dy;
+            if (d > max_dist) {
+                max_dist = d;
+                far = i;
+            }
+        }
+
+        m_keep.assign(n + 1, 0);
+        m_keep[0] = 1;
+        m_keep[far] = 1;
+        m_keep[n] = 1;
+
+        const double tolerance_squared = tolerance * tolerance;
+        m_stack.clear();
+        m_stack.emplace_back(0, far);
+        m_stack.emplace_back(far, n);
+        while (!m_stack.empty()) {
+            const auto range = m_stack.back();
+            m_stack.pop_back();
+            const tiles::point& a = r[range.first];
+            const tiles::point& b = r[range.second % n];
+            std::size_t index = 0;
+            double dist = tolerance_squared;
+            for (std::size_t i = range.first + 1; i < range.second; ++i) {
+                const double d = segment_distance_squared(r[i], a, b);
+                if (d > dist) {
+                    dist = d;
+                    index = i;
+                }
+            }
+            if (index != 0) {
+                m_keep[index] = 1;
+                m_stack.emplace_back(range.first, index);
+                m_stack.emplace_back(index, range.second);
+            }
+        }
+
+        std::size_t out = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (m_keep[i]) {
+                r[out++] = r[i];
+            }
+        }
+        r.resize(out);
+    }
+
+    // Clip ring against the half plane where the coordinate on the given
+    // axis is <= value (if less is true) or >= value.
+    static void clip_ring(const tiles::ring& in, tiles::ring& out, bool x_axis, double value, bool less) {
+        out.clear();
+        const auto coordinate = [x_axis](const tiles::point& p) {
+            return x_axis ? p.x : p.y;
+        };
+        const auto inside = [&](const tiles::point& p) {
+            return less ? coordinate(p) <= value : coordinate(p) >= value;
+        };
+        const auto intersection = [&](const tiles::point& a, const tiles::point& b) {
+            const double t = (value - coordinate(a)) / (coordinate(b) - coordinate(a));
+            return x_axis ? tiles::point{value, a.y + (b.y - a.y) * t}
+                          : tiles::point{a.x + (b.x - a.x) * t, value};
+        };
+
+        const std::size_t n = in.size();
+        for (std::size_t i = 0; i < n; ++i) {
+            const tiles::point& prev = in[i == 0 ? n - 1 : i - 1];
+            const tiles::point& cur = in[i];
+            const bool cur_inside = inside(cur);
+            const bool prev_inside = inside(prev);
+            if (cur_inside) {
+                if (!prev_inside) {
+                    out.push_back(intersection(prev, cur));
+                }
+                out.push_back(cur);
+            } else if (prev_inside) {
+                out.push_back(intersection(prev, cur));
+            }
+        }
+        if (out.size() < 3) {
+            out.clear();
+        }
+    }
+
+    static std::vector<tiles::polygon> clip_polygons(const std::vector<tiles::polygon>& polygons, bool x_axis, double value, bool less) {
+        std::vector<tiles::polygon> result;
+        tiles::ring clipped;
+        for (const auto& p : polygons) {
+            clip_ring(p.front(), clipped, x_axis, value, less);
+            if (clipped.empty()) {
+                continue;
+            }
+            result.emplace_back();
+            result.back().push_back(std::move(clipped));
+            for (std::size_t i = 1; i < p.size(); ++i) {
+                clip_ring(p[i], clipped, x_axis, value, less);
+                if (!clipped.empty()) {
+                    result.back().push_back(std::move(clipped));
+                }
+            }
+        }
+        return result;
+    }
+
+    static double signed_area(const tiles::ring& r) noexcept {
+        double sum = 0;
+        for (std::size_t i = 0, j = r.size() - 1; i < r.size(); j = i++) {
+            sum += (r[j].x - r[i].x) * (r[j].y + r[i].y);
+        }
+        return sum / 2;
+    }
+
+    // Move the polygons into the coordinate system of the tile and round
+    // to integer coordinates. Rings that collapse are removed.
+    static void to_tile(std::vector<tiles::polygon>& polygons, uint32_t tx, uint32_t ty) {
+        const double ox = static_cast<double>(tx) * tiles::extent;
+        const double oy = static_cast<double>(ty) * tiles::extent;
+        std::size_t out_polygon = 0;
+        for (auto& p : polygons) {
+            std::size_t out_ring = 0;
+            for (auto& r : p) {
+                std::size_t out = 0;
+                for (const auto& pt : r) {
+                    const tiles::point q{std::round(pt.x - ox), std::round(pt.y - oy)};
+                    if (out == 0 || q.x != r[out - 1].x || q.y != r[out - 1].y) {
+                        r[out++] = q;
+                    }
+                }
+                while (out > 1 && r[out - 1].x == r[0].x && r[out - 1].y == r[0].y) {
+                    --out;
+                }
+                r.resize(out);
+                if (out >= 3 && signed_area(r) != 0) {
+                    if (out_ring != static_cast<std::size_t>(&r - p.data())) {
+                        p[out_ring] = std::move(r);
+                    }
+                    ++out_ring;
+                } else if (out_ring == 0) {
+                    // outer ring collapsed, so drop the whole polygon
+                    break;
+                }
+            }
+            p.resize(out_ring);
+            if (!p.empty()) {
+                if (out_polygon != static_cast<std::size_t>(&p - polygons.data())) {
+                    polygons[out_polygon] = std::move(p);
+                }
+                ++out_polygon;
+            }
+        }
+        polygons.resize(out_polygon);
+    }
+
+    template <typename TFunc>
+    void split(std::vector<tiles::polygon>&& polygons, uint32_t zoom, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, TFunc&& func) {
+        if (polygons.empty()) {
+            return;
+        }
+
+        if (x0 == x1 && y0 == y1) {
+            to_tile(polygons, x0, y0);
+            if (!polygons.empty()) {
+                func(tile_key{zoom, x0, y0}, polygons);
+            }
+            return;
+        }
+
+        if (x1 - x0 >= y1 - y0) {
+            const uint32_t mid = x0 + (x1 - x0) / 2;
+            const double border = static_cast<double>(mid + 1) * tiles::extent;
+            split(clip_polygons(polygons, true, border + tiles::buffer, true), zoom, x0, y0, mid, y1, func);
+            split(clip_polygons(polygons, true, border - tiles::buffer, false), zoom, mid + 1, y0, x1, y1, func);
+        } else {
+            const uint32_t mid = y0 + (y1 - y0) / 2;
+            const double border = static_cast<double>(mid + 1) * tiles::extent;
+            split(clip_polygons(polygons, false, border + tiles::buffer, true), zoom, x0, y0, x1, mid, func);
+            split(clip_polygons(polygons, false, border - tiles::buffer, false), zoom, x0, mid + 1, x1, y1, func);
+        }
+    }
+
+public:
+
+    /**
+     * Clip polygons given in world coordinates (see
+     * tiles::world_coordinates()) to all tiles of the zoom level. Calls
+     * func(tile_key, std::vector<tiles::polygon>&) for every tile with
+     * the non-empty clipped polygons in tile coordinates.
+     */
+    template <typename TFunc>
+    void operator()(const std::vector<tiles::polygon>& world_polygons, uint32_t zoom, TFunc&& func) {
+        const double scale = std::ldexp(static_cast<double>(tiles::extent), static_cast<int>(zoom));
+        const double tolerance = tiles::tolerance;
+
+        double min_x = scale;
+        double min_y = scale;
+        double max_x = 0;
+        double max_y = 0;
+
+        std::vector<tiles::polygon> polygons;
+        polygons.reserve(world_polygons.size());
+        for (const auto& wp : world_polygons) {
+            tiles::polygon p;
+            for (const auto& wr : wp) {
+                tiles::ring r;
+                r.reserve(wr.size());
+                double rmin_x = scale;
+                double rmin_y = scale;
+                double rmax_x = 0;
+                double rmax_y = 0;
+                for (const auto& pt : wr) {
+                    const tiles::point q{pt.x * scale, pt.y * scale};
+                    rmin_x = std::min(rmin_x, q.x);
+                    rmin_y = std::min(rmin_y, q.y);
+                    rmax_x = std::max(rmax_x, q.x);
+                    rmax_y = std::max(rmax_y, q.y);
+                    r.push_back(q);
+                }
+                // rings smaller than the tolerance vanish on this zoom level
+                if (rmax_x - rmin_x < tolerance && rmax_y - rmin_y < tolerance) {
+                    if (p.empty()) {
+                        break;
+                    }
+                    continue;
+                }
+                simplify(r, tolerance);
+                if (r.size() < 3) {
+                    if (p.empty()) {
+                        break;
+                    }
+                    continue;
+                }
+                if (p.empty()) {
+                    min_x = std::min(min_x, rmin_x);
+                    min_y = std::min(min_y, rmin_y);
+                    max_x = std::max(max_x, rmax_x);
+                    max_y = std::max(max_y, rmax_y);
+                }
+                p.push_back(std::move(r));
+            }
+            if (!p.empty()) {
+                polygons.push_back(std::move(p));
+            }
+        }
+
+        if (polygons.empty()) {
+            return;
+        }
+
+        const uint32_t max_tile = (1u << zoom) - 1;
+        const auto tile_of = [max_tile](double c) {
+            return static_cast<uint32_t>(std::max(0.0, std::min(static_cast<double>(max_tile), std::floor(c / tiles::extent))));
+        };
+        split(std::move(polygons), zoom,
+              tile_of(min_x - tiles::buffer), tile_of(min_y - tiles::buffer),
+              tile_of(max_x + tiles::buffer), tile_of(max_y + tiles::buffer),
+              std::forward<TFunc>(func));
+    }
+
+}; // class TileClipper
+
+/**
+ * Clips areas to web mercator tiles for a range of zoom levels and writes
+ * the pieces into the "tiles" table of an Sqlite database, keyed by tile
+ * and area id. The geometries are stored as WKB multipolygons in tile
+ * coordinates (0 to tiles::extent, y axis pointing down).
+ *
+ * Areas are added from the thread assembling the areas. They are copied
+ * into a queue and clipped by a number of worker threads, so the
+ * assembler doesn't have to wait.
+ */
+class TileWriter {
+
+    struct job {
+        osmium::object_id_type id;
+        std::vector<tiles::polygon> polygons;
+    };
+
+    Sqlite::Database m_db;
+    std::unique_ptr<Sqlite::Statement> m_insert{nullptr};
+
+    uint32_t m_min_zoom;
+    uint32_t m_max_zoom;
+
+    WorkQueue<job> m_queue;
+
+    std::mutex m_db_mutex;
+    uint64_t m_pieces = 0;
+
+    // first error in one of the worker threads, rethrown by close()
+    std::exception_ptr m_error{nullptr};
+
+    std::vector<std::thread> m_threads;
+
+    AreaRings m_rings;
+
+    void write(osmium::object_id_type id, const tile_key& key, const std::string& wkb) {
+        std::lock_guard<std::mutex> lock{m_db_mutex};
+        m_insert->bind_int(static_cast<int>(key.zoom));
+        m_insert->bind_int64(key.x);
+        m_insert->bind_int64(key.y);
+        m_insert->bind_int64(id);
+        m_insert->bind_blob(wkb.data(), static_cast<int>(wkb.size()));
+        m_insert->execute();
+        ++m_pieces;
+    }
+
+    void worker() {
+        TileClipper clipper;
+        std::string wkb;
+        job j;
+        while (m_queue.pop(j)) {
+            try {
+                for (uint32_t zoom = m_min_zoom; zoom <= m_max_zoom; ++zoom) {
+                    clipper(j.polygons, zoom, [&](const tile_key& key, const std::vector<tiles::polygon>& polygons) {
+                        tiles::encode_wkb(wkb, polygons);
+                        write(j.id, key, wkb);
+                    });
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{m_db_mutex};
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+        }
+    }
+
+public:
+
+    TileWriter(const std::string& filename, uint32_t min_zoom, uint32_t max_zoom, unsigned int num_threads) :
+        m_db(filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE),
+        m_min_zoom(min_zoom),
+        m_max_zoom(max_zoom),
+        m_queue(num_threads * 16) {
+        m_db.exec("PRAGMA journal_mode = OFF;");
+        m_db.exec("DROP TABLE IF EXISTS tiles;");
+        m_db.exec("CREATE TABLE tiles (zoom INTEGER, x INTEGER, y INTEGER, area_id INTEGER, geom BLOB, PRIMARY KEY (zoom, x, y, area_id)) WITHOUT ROWID;");
+        m_insert.reset(new Sqlite::Statement{m_db, "INSERT INTO tiles (zoom, x, y, area_id, geom) VALUES (?, ?, ?, ?, ?);"});
+        m_db.begin_transaction();
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            m_threads.emplace_back(&TileWriter::worker, this);
+        }
+    }
+
+    TileWriter(const TileWriter&) = delete;
+    TileWriter& operator=(const TileWriter&) = delete;
+
+    ~TileWriter() {
+        try {
+            close();
+        } catch (...) {
+            // ignore errors in destructor
+        }
+    }
+
+    /**
+     * Queue area for clipping. Areas with invalid locations are ignored.
+     */
+    void add(const osmium::Area& area) {
+        if (!m_rings.assign(area) || m_rings.empty()) {
+            return;
+        }
+
+        job j;
+        j.id = area.id();
+        for (const auto& r : m_rings.rings()) {
+            if (r.is_outer) {
+                j.polygons.emplace_back();
+            } else if (j.polygons.empty()) {
+                continue;
+            }
+            tiles::ring ring;
+            // the last point is the same as the first
+            ring.reserve(r.size() - 1);
+            for (uint32_t i = r.first; i + 1 < r.last; ++i) {
+                ring.push_back(tiles::world_coordinates(m_rings.x()[i], m_rings.y()[i]));
+            }
+            j.polygons.back().push_back(std::move(ring));
+        }
+
+        m_queue.push(std::move(j));
+    }
+
+    /**
+     * Wait for all queued areas to be clipped and written and commit the
+     * database. Returns the number of pieces written.
+     */
+    uint64_t close() {
+        if (m_threads.empty()) {
+            return m_pieces;
+        }
+        m_queue.close();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+        m_threads.clear();
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+        m_db.commit();
+        return m_pieces;
+    }
+
+}; // class TileWriter
+
+#endif // OAT_TILES_HPP
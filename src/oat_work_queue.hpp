@@ -0,0 +1,103 @@
+#ifndef OAT_WORK_QUEUE_HPP
+#define OAT_WORK_QUEUE_HPP
+
+/*****************************************************************************
+
+  OSM Area Tools - Bounded queue for handing work to threads
+
+  https://github.com/osmcode/osm-area-tools
+
+*****************************************************************************/
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/**
+ * Queue with a maximum size for handing work from producer to consumer
+ * threads. Producers block while the queue is full, consumers block while
+ * it is empty. After close() consumers get the remaining items and then
+ * pop() returns false.
+ */
+template <typename T>
+class WorkQueue {
+
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+    std::deque<T> m_queue;
+    std::size_t m_max_size;
+    bool m_closed = false;
+
+public:
+
+    explicit WorkQueue(std::size_t max_size) :
+        m_max_size(max_size) {
+    }
+
+    WorkQueue(const WorkQueue&) = delete;
+    WorkQueue& operator=(const WorkQueue&) = delete;
+
+    void push(T&& item) {
+        {
+            std::unique_lock<std::mutex> lock{m_mutex};
+            m_not_full.wait(lock, [this] {
+                return m_queue.size() < m_max_size;
+            });
+            m_queue.push_back(std::move(item));
+        }
+        m_not_empty.notify_one();
+    }
+
+    /**
+     * Get the next item. Blocks until an item is available. Returns false
+     * if the queue was closed and is empty.
+     */
+    bool pop(T& item) {
+        {
+            std::unique_lock<std::mutex> lock{m_mutex};
+            m_not_empty.wait(lock, [this] {
+                return m_closed || !m_queue.empty();
+            });
+            if (m_queue.empty()) {
+                return false;
+            }
+            item = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        m_not_full.notify_one();
+        return true;
+    }
+
+    /**
+     * Get the next item if there is one, never blocks.
+     */
+    bool try_pop(T& item) {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            if (m_queue.empty()) {
+                return false;
+            }
+            item = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        m_not_full.notify_one();
+        return true;
+    }
+
+    /**
+     * No more items will be pushed. Wakes up all waiting consumers.
+     */
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_closed = true;
+        }
+        m_not_empty.notify_all();
+    }
+
+}; // class WorkQueue
+
+#endif // OAT_WORK_QUEUE_HPP